@@ -0,0 +1,98 @@
+// Measures how long it takes to launch a CGI-like child process with fork()+execve()
+// (the old launch path) and with posix_spawn() (the current one).
+// Usage: cgi_launch_bench [iterations] [ballast MB]
+// The ballast is touched memory that grows the RSS of the benchmark like a large cache
+// would grow the server, fork() has to copy the page tables for all of it.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+extern char** environ;
+
+static char const* const s_argv[] = {"true", NULL};
+static char const* const s_path = "/bin/true";
+
+// Both return the launch time in microseconds, -1 when the child couldn't be started
+static double launch_fork(void)
+{
+	auto start = std::chrono::steady_clock::now();
+	pid_t pid = fork();
+	if (pid < 0)
+		return (-1.0);
+	if (pid == 0)
+	{
+		execve(s_path, const_cast<char**>(s_argv), environ);
+		_exit(127);
+	}
+	auto end = std::chrono::steady_clock::now();
+	waitpid(pid, NULL, 0);
+	return (std::chrono::duration<double, std::micro>(end - start).count());
+}
+
+static double launch_spawn(void)
+{
+	pid_t pid;
+	auto start = std::chrono::steady_clock::now();
+	if (posix_spawn(&pid, s_path, NULL, NULL, const_cast<char**>(s_argv), environ) != 0)
+		return (-1.0);
+	auto end = std::chrono::steady_clock::now();
+	waitpid(pid, NULL, 0);
+	return (std::chrono::duration<double, std::micro>(end - start).count());
+}
+
+// Failed launches are counted, they aren't samples
+static void run(char const* name, double (*launch)(void), size_t iterations)
+{
+	std::vector<double> samples;
+	size_t failures = 0;
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		double sample = launch();
+		if (sample < 0)
+			++failures;
+		else
+			samples.push_back(sample);
+	}
+	if (samples.empty())
+	{
+		std::cout << name << "\tall " << failures << " launches failed" << std::endl;
+		return ;
+	}
+
+	std::sort(samples.begin(), samples.end());
+	auto percentile = [&](double p) { return samples[static_cast<size_t>(p * (samples.size() - 1))]; };
+	std::cout << name
+		<< "\tp50: " << percentile(0.50) << " us"
+		<< "\tp90: " << percentile(0.90) << " us"
+		<< "\tp99: " << percentile(0.99) << " us"
+		<< "\tmax: " << samples.back() << " us";
+	if (failures > 0)
+		std::cout << "\t(" << failures << " failed)";
+	std::cout << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	size_t iterations = (argc > 1) ? std::strtoul(argv[1], NULL, 10) : 1000;
+	size_t ballast_mb = (argc > 2) ? std::strtoul(argv[2], NULL, 10) : 512;
+	if (iterations == 0)
+		iterations = 1;
+
+	std::vector<char> ballast(ballast_mb * 1024 * 1024);
+	for (size_t i = 0; i < ballast.size(); i += 4096)
+		ballast[i] = 1;
+
+	std::cout << "CGI launch latency, " << iterations << " launches, "
+		<< ballast_mb << " MB ballast" << std::endl;
+
+	run("fork+execve", launch_fork, iterations);
+	run("posix_spawn", launch_spawn, iterations);
+	return (EXIT_SUCCESS);
+}
@@ -0,0 +1,106 @@
+// Measures the routing cost of Server::get_location() on large location tables: a linear scan
+// of prefix locations (the old lookup) against the radix tree, and the tree with exact and regex
+// locations added to the table.
+// Usage: location_routing_bench [locations] [lookups]
+
+#include "Server.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace webserv;
+
+// The old lookup: the longest location path that's a prefix of the request path
+static Location const* linear_lookup(std::vector<Location> const& locations, std::string const& path)
+{
+	Location const* match = NULL;
+	size_t match_length = 0;
+	for (Location const& loc : locations)
+	{
+		if (loc.path.size() > match_length && path.compare(0, loc.path.size(), loc.path) == 0)
+		{
+			match = &loc;
+			match_length = loc.path.size();
+		}
+	}
+	return (match);
+}
+
+template <typename F>
+static void report(char const* name, std::vector<std::string> const& paths, F lookup)
+{
+	size_t found = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (std::string const& path : paths)
+		found += lookup(path);
+	auto end = std::chrono::steady_clock::now();
+	double total = std::chrono::duration<double, std::nano>(end - start).count();
+	std::cout << name << "\t" << total / paths.size() << " ns/lookup"
+		<< "\t(" << found << '/' << paths.size() << " matched)" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	size_t count = (argc > 1) ? std::strtoul(argv[1], NULL, 10) : 1000;
+	size_t lookups = (argc > 2) ? std::strtoul(argv[2], NULL, 10) : 200000;
+	std::mt19937 random(42);
+
+	// Locations like "/api/v2/service17/" and "/static/app5/"
+	std::vector<std::string> prefixes;
+	for (size_t i = 0; i < count; ++i)
+		prefixes.push_back("/" + std::string(i % 2 ? "api/v" + std::to_string(i % 4) : "static") + "/service" + std::to_string(i) + '/');
+
+	std::vector<std::string> paths;
+	for (size_t i = 0; i < lookups; ++i)
+	{
+		std::string const& prefix = prefixes[random() % prefixes.size()];
+		switch (random() % 4)
+		{
+			case 0: paths.push_back(prefix + "index.html"); break;
+			case 1: paths.push_back(prefix + "script.php"); break;
+			case 2: paths.push_back(prefix + "status"); break;
+			default: paths.push_back("/unknown" + std::to_string(i % 100) + "/file.css"); break;
+		}
+	}
+
+	Server prefix_server;
+	for (std::string const& prefix : prefixes)
+		prefix_server.add_location(Location(prefix));
+	prefix_server.compile();
+
+	// Every fourth location gets an exact "status" path, plus a few extension regexes
+	Server mixed_server;
+	for (size_t i = 0; i < prefixes.size(); ++i)
+	{
+		mixed_server.add_location(Location(prefixes[i]));
+		if (i % 4 == 0)
+		{
+			Location exact(prefixes[i] + "status");
+			exact.match = Location::EXACT;
+			mixed_server.add_location(exact);
+		}
+	}
+	for (char const* regex : {"\\.php$", "\\.(gif|jpe?g|png)$", "^/api/v[0-9]+/internal/"})
+	{
+		Location loc(regex);
+		loc.match = Location::REGEX;
+		mixed_server.add_location(loc);
+	}
+	mixed_server.compile();
+
+	std::cout << count << " locations, " << lookups << " lookups" << std::endl;
+	report("linear scan", paths, [&](std::string const& path) {
+		return (linear_lookup(prefix_server.locations, path) != NULL);
+	});
+	report("radix tree", paths, [&](std::string const& path) {
+		return (!prefix_server.get_location(path).path.empty());
+	});
+	report("tree+exact+regex", paths, [&](std::string const& path) {
+		return (!mixed_server.get_location(path).path.empty());
+	});
+	return (0);
+}
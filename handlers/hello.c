@@ -0,0 +1,95 @@
+/*
+** Example handler module, build with "make handlers" and bind it to a location:
+**     "handler": "build/handlers/libhello.so"
+**
+** GET answers right away, POST answers with the size of the body.
+** "?wait=ms" holds the response back for that long through resume().
+*/
+
+#include "webserv_handler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct hello_state
+{
+	size_t body_size;
+	long wait_until; /* ms, 0 when the response isn't held back */
+} hello_state;
+
+static long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void respond(hello_state* state, webserv_output* output)
+{
+	char body[256];
+	char head[128];
+	int body_size;
+	int head_size;
+
+	body_size = snprintf(body, sizeof(body), "Hello from a handler module, %zu bytes received\n", state->body_size);
+	head_size = snprintf(head, sizeof(head), "Content-Type: text/plain\r\nContent-Length: %d\r\n\r\n", body_size);
+	output->write(output->context, head, head_size);
+	output->write(output->context, body, body_size);
+}
+
+static void* hello_begin(webserv_request const* request, webserv_output* output)
+{
+	hello_state* state = calloc(1, sizeof(hello_state));
+	char const* wait = strstr(request->query, "wait=");
+
+	(void)output;
+	if (state != NULL && wait != NULL)
+		state->wait_until = now_ms() + atol(wait + 5);
+	return (state);
+}
+
+static int hello_body(void* data, char const* chunk, size_t size, webserv_output* output)
+{
+	hello_state* state = data;
+
+	(void)chunk;
+	if (state == NULL)
+		return (WEBSERV_HANDLER_ERROR);
+	state->body_size += size;
+	if (size != 0 || state->wait_until != 0)
+		return (WEBSERV_HANDLER_OK);
+	respond(state, output);
+	return (WEBSERV_HANDLER_DONE);
+}
+
+static int hello_resume(void* data, webserv_output* output)
+{
+	hello_state* state = data;
+
+	if (now_ms() < state->wait_until)
+		return (WEBSERV_HANDLER_OK);
+	respond(state, output);
+	return (WEBSERV_HANDLER_DONE);
+}
+
+static void hello_end(void* data)
+{
+	free(data);
+}
+
+static webserv_handler const s_handler = {
+	WEBSERV_HANDLER_ABI_VERSION,
+	"hello",
+	NULL,
+	hello_begin,
+	hello_body,
+	hello_resume,
+	hello_end
+};
+
+webserv_handler const* webserv_handler_get(void)
+{
+	return (&s_handler);
+}
@@ -0,0 +1,87 @@
+#ifndef ACCESSLOG_H
+# define ACCESSLOG_H
+
+# include "Core.h"
+# include "Request.h"
+
+# include <atomic>
+# include <ctime>
+
+namespace webserv {
+
+// Bytes of log lines waiting for the writer thread, when no buffer_size is set
+# define ACCESS_LOG_DEFAULT_BUFFER_SIZE 1048576
+// Milliseconds the writer thread sleeps when there's nothing to write
+# define ACCESS_LOG_WRITE_INTERVAL 50
+
+// One line per response, set with "access_log" in the config.
+// The event loop formats the line into a ring buffer and moves on, a writer thread takes
+// everything in the ring with one writev(). A line that doesn't fit in the ring is dropped and
+// counted, the event loop never waits for the disk. The file is opened again on SIGUSR1, after
+// it was rotated.
+class AccessLog
+{
+	public:
+	enum Format
+	{
+		COMBINED = 0,	// The "combined" format of Apache and nginx
+		JSON			// One JSON object per line
+	};
+
+	// Completed response, as it's logged
+	struct Entry
+	{
+		std::string const& ip;
+		Request const& request;
+		std::string const& uri; // The path of the request line
+		std::string const& status;
+		size_t body_size;
+		double duration; // Milliseconds from the request header to the end of the response
+	};
+
+	// Starts logging to path, an empty path stops it. A reload with other settings starts over.
+	static void configure(std::string const& path, Format format, size_t buffer_size);
+	static void reopen(void);
+	// Writes what's left and stops the writer thread
+	static void close(void);
+	static void log(Entry const& entry);
+	// Lines dropped because the ring was full
+	static size_t get_dropped(void);
+
+	private:
+	AccessLog(std::string const& path, Format format, size_t buffer_size);
+	~AccessLog();
+	AccessLog();
+	AccessLog(AccessLog const& other);
+	AccessLog& operator=(AccessLog const& other);
+
+	void format_line(Entry const& entry);
+	void push(void);
+	void run(void);
+	size_t write_pending(void);
+	void open_file(void);
+
+	private:
+	std::string path;
+	Format format;
+	int fd; // Only used by the writer thread
+
+	// Single producer (the event loop), single consumer (the writer thread).
+	// head and tail count all bytes ever written and taken, the ring position is that modulo capacity.
+	std::vector<char> ring;
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+	std::atomic<bool> reopening;
+	std::atomic<bool> stopping;
+	std::thread writer;
+
+	std::string line; // Formatted by the event loop, kept for its capacity
+	time_t line_second; // Second that line_time was formatted for
+	char line_time[40];
+
+	static std::atomic<size_t> s_dropped;
+};
+
+} // namespace webserv
+
+#endif // ACCESSLOG_H
@@ -0,0 +1,26 @@
+#ifndef ADDRESS_H
+# define ADDRESS_H
+
+# include "Core.h"
+
+namespace webserv {
+
+// Socket address of a "host:port" or "unix:/path" in the config (fastcgi, proxy_pass, upstream servers).
+// Host names are resolved while the config is loaded, the event loop only connects to the result.
+struct Address
+{
+	struct sockaddr_storage storage;
+	socklen_t length;
+
+	int get_family(void) const;
+	addr_t const* get_addr(void) const;
+
+	// Resolves address (blocking) and keeps the result for get(), throws when it can't be resolved
+	static Address const& resolve(std::string const& address);
+	// The result of resolve(), an address that wasn't resolved yet is resolved now
+	static Address const& get(std::string const& address);
+};
+
+} // namespace webserv
+
+#endif // ADDRESS_H
@@ -2,23 +2,49 @@
 # define CGI_H
 
 # include "Core.h"
+# include "Gateway.h"
 # include "Pollable.h"
 # include "Server.h"
 
+# include <chrono>
+
 namespace webserv {
 
+	# define ENV_ARENA_SIZE 4096
+	# define CGI_SPLICE_SIZE 65536
+	# define ENV_MAX_VARS 32
+	// Seconds an aborted CGI gets to exit after SIGTERM, before it's killed with SIGKILL
+	# define CGI_KILL_TIMEOUT 5
+
 	namespace env
 	{
-		std::vector<std::string> initialize(void);
-		bool set_value(std::vector<std::string>& env, std::string const& var, std::string const& value);
-		void to_string_array(char ** env_array, std::vector<std::string> &env);
-		void print(std::vector<std::string> const& env);
+		// CGI environment, "NAME=value" strings stored back to back in one reusable buffer.
+		// Every variable is appended once, there is no lookup.
+		class Arena
+		{
+			public:
+			Arena(void);
+
+			void clear(void);
+			void set_value(char const* var, std::string const& value);
+
+			size_t size(void) const;
+			char const* get(size_t index) const; // "NAME=value"
+			char** data(void); // NULL-terminated array, valid until the next set_value()
+
+			void print(void) const;
+
+			private:
+			std::vector<char> buffer;
+			std::vector<size_t> offsets;
+			std::vector<char*> pointers;
+		};
 	} // namespace env
 
-	class CGI : public Pollable
+	class CGI : public Pollable, public Gateway
 	{
 		public:
-		CGI(std::vector<std::string>& env, Server& server, Location& loc, std::string const& path);
+		CGI(env::Arena& env, Server const& server, Location const& loc, std::string const& path, int stdin_fd = -1);
 		virtual ~CGI();
 
 		virtual sockfd_t get_fd(void) const override;
@@ -36,12 +62,26 @@ namespace webserv {
 
 		virtual short get_events(sockfd_t fd) const override;
 
+		virtual bool is_output_closed(void) const override;
+		virtual bool finish(pollable_map_t& fd_map) override;
+		virtual void abort(pollable_map_t& fd_map) override;
+
+# ifdef __linux__
+		virtual bool can_splice(void) const override;
+		virtual ssize_t splice_from(sockfd_t fd, size_t size) override;
+		virtual ssize_t splice_to(sockfd_t fd, pollable_map_t& fd_map) override;
+		virtual bool is_input_blocked(void) const override;
+# endif
+
 		protected:
 		virtual void on_pollin(pollable_map_t& fd_map) override; // Read from the CGI to Server
 		virtual void on_pollout(pollable_map_t& fd_map) override; // Write from Server to CGI
 		virtual void on_pollhup(pollable_map_t& fd_map, sockfd_t fd) override;
 		// virtual void on_pollnval(pollable_map_t& fd_map) override;
 
+		private:
+		void close_pipe_ends(void);
+
 		private:
 		int pid;
 
@@ -52,11 +92,13 @@ namespace webserv {
 		} pipes;
 
 		bool open_in, open_out, erase_in, erase_out;
+		bool splicing_out; // The output pipe is spliced into the client socket
+		bool in_blocked; // The input pipe was full, it's polled for room instead of the client socket
+		time_t abort_time; // When SIGTERM was sent, 0 while running
+		std::chrono::steady_clock::time_point start_time;
 
 		public:
 		bool destroy;
-		std::vector<char> buffer_in; // Into the CGI
-		std::vector<char> buffer_out; // From the CGI
 	};
 
 } // namespace webserv
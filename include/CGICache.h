@@ -0,0 +1,122 @@
+#ifndef CGICACHE_H
+# define CGICACHE_H
+
+# include "Core.h"
+# include "Gateway.h"
+# include "Request.h"
+# include "Server.h"
+
+namespace webserv {
+
+class Connection;
+
+// Bodies larger than this are spilled to the cgi_cache_directory (not cached without one)
+# define CGI_CACHE_SPILL_SIZE 65536
+// Total size of the bodies kept in memory
+# define CGI_CACHE_MEMORY_SIZE (64 * 1024 * 1024)
+// Amount of responses kept in the cache, and of keys remembered as uncacheable
+# define CGI_CACHE_SIZE 4096
+
+// A cached CGI response, its body is either in memory or in a file in the cache directory
+struct CacheEntry
+{
+	std::string status; // Status field of the CGI, empty when it sent none
+	std::string content_type;
+	std::vector<std::pair<std::string, std::string>> fields; // The other header fields, framing ones excluded
+	std::string body;
+	std::string file; // Path of the spilled body, empty when the body is in memory
+	size_t body_size;
+	time_t expires;
+
+	CacheEntry();
+	~CacheEntry(); // Removes the spilled body
+};
+
+typedef std::shared_ptr<CacheEntry const> cache_entry_t;
+
+// Collects the response of a CGI run that missed the cache.
+// commit() and the destructor release the key and wake the requests waiting for it, without a
+// committed response they run the CGI themselves.
+class CacheFill
+{
+	public:
+	CacheFill(std::string const& key, Location const& loc);
+	~CacheFill();
+
+	private:
+	CacheFill();
+	CacheFill(CacheFill const& other);
+	CacheFill& operator=(CacheFill const& other);
+
+	public:
+	// Takes the parsed CGI header, returns false when the response can't be cached
+	bool set_header(std::unordered_map<std::string, std::string> const& fields);
+	void append(char const* data, size_t size);
+	void commit(void);
+
+	private:
+	bool spill(void);
+	void release(void);
+
+	private:
+	std::string key;
+	std::string directory;
+	size_t ttl;
+	std::shared_ptr<CacheEntry> entry;
+	size_t content_length; // From the CGI header, SIZE_MAX when there is none
+	int file_fd;
+	bool ready; // The header is cacheable
+	bool failed; // The body can't be cached (too large, write error)
+	bool filling; // The key is still held
+};
+
+// Serves a cached response through the Gateway interface.
+// The header is in buffer_out, the body is sent straight from the entry with splice_to().
+class CachedResponse : public Gateway
+{
+	public:
+	CachedResponse(cache_entry_t const& entry);
+	virtual ~CachedResponse();
+
+	private:
+	CachedResponse();
+	CachedResponse(CachedResponse const& other);
+	CachedResponse& operator=(CachedResponse const& other);
+
+	public:
+	virtual bool is_output_closed(void) const override;
+	virtual bool finish(pollable_map_t& fd_map) override;
+	virtual void abort(pollable_map_t& fd_map) override;
+
+	virtual bool can_splice(void) const override;
+	virtual ssize_t splice_to(sockfd_t fd, pollable_map_t& fd_map) override;
+
+	private:
+	cache_entry_t entry;
+	int file_fd;
+	size_t offset; // Amount of the body that has been sent
+};
+
+namespace cgi_cache
+{
+	// method + host + path + query, followed by the cgi_cache_key_headers of the location
+	std::string make_key(Request const& request, Location const& loc);
+
+	// Returns the entry of key, nullptr when it's missing or expired
+	cache_entry_t find(std::string const& key);
+
+	// Responses of key were not cacheable recently, run the CGI without waiting for others
+	bool is_pass(std::string const& key);
+
+	// Returns nullptr when another request is already running the CGI for key
+	CacheFill* begin_fill(std::string const& key, Location const& loc);
+
+	// Connection::cache_filled() is called once the CacheFill of key is done
+	void wait(std::string const& key, Connection* connection);
+	// A waiting connection is gone
+	void cancel_wait(std::string const& key, Connection* connection);
+} // namespace cgi_cache
+
+} // namespace webserv
+
+#endif // CGICACHE_H
@@ -0,0 +1,57 @@
+#ifndef CGIQUEUE_H
+# define CGIQUEUE_H
+
+# include "Core.h"
+# include "Server.h"
+
+# include <deque>
+# include <map>
+
+namespace webserv {
+
+class Connection;
+
+// Limits the amount of CGIs running for a location (cgi_max_concurrent).
+// Requests over the limit wait in a FIFO of cgi_queue_size, beyond that they're rejected.
+class CGIQueue
+{
+	public:
+	enum Admission
+	{
+		RUN = 0,	// A slot is taken, the CGI can start
+		QUEUED,		// Connection::admit_cgi() is called once a slot is free
+		REJECTED	// The queue is full
+	};
+
+	static CGIQueue& get(Server const& server, Location const& loc);
+	static std::map<std::string, std::unique_ptr<CGIQueue>> const& get_all(void);
+
+	Admission admit(Connection* connection);
+	// The CGI of a slot ended, the slot goes to the first queued connection
+	void release(void);
+	// A queued connection is gone
+	void cancel(Connection* connection);
+
+	std::string const& get_name(void) const;
+	size_t get_running(void) const;
+	size_t get_queued(void) const;
+	size_t get_rejected(void) const;
+
+	private:
+	CGIQueue(std::string const& name, size_t max_concurrent, size_t queue_size);
+	CGIQueue(CGIQueue const& other);
+	CGIQueue& operator=(CGIQueue const& other);
+
+	private:
+	std::string name;
+	size_t max_concurrent;
+	size_t queue_size;
+
+	size_t running;
+	size_t rejected; // Total amount of rejected requests
+	std::deque<Connection*> waiting;
+};
+
+} // namespace webserv
+
+#endif // CGIQUEUE_H
@@ -0,0 +1,32 @@
+#ifndef CONFIG_H
+# define CONFIG_H
+
+# include "Core.h"
+# include "AccessLog.h"
+# include "Server.h"
+
+namespace webserv {
+
+// One generation of the configuration. Sockets hand the newest one to new requests, a request
+// holds on to the generation it started with, so a reload (SIGHUP) never changes the servers
+// and locations under a request in flight. A generation is freed with its last request.
+struct Config
+{
+	std::vector<std::unique_ptr<Server>> servers;
+	size_t generation;
+
+	std::string access_log; // Path of the access log, empty for none
+	AccessLog::Format access_log_format;
+	size_t access_log_buffer_size;
+
+	size_t slow_request_threshold; // Milliseconds, slower requests are logged with their phases, 0 for none
+	bool server_timing; // Send the phases of a request in a Server-Timing header
+
+	Config();
+};
+
+typedef std::shared_ptr<Config> config_t;
+
+} // namespace webserv
+
+#endif // CONFIG_H
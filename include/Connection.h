@@ -3,15 +3,25 @@
 
 # include "Core.h"
 # include "CGI.h"
+# include "CGICache.h"
+# include "CGIQueue.h"
+# include "Config.h"
+# include "Gateway.h"
 # include "Pollable.h"
 # include "Request.h"
 # include "Response.h"
 # include "Server.h"
+# include "Upstream.h"
+
+# include <chrono>
 
 namespace webserv {
 
 #define HTTP_HEADER_BUFFER_SIZE 8192
 #define CONNECTION_LIFETIME 60
+// Bounds for discarding the unread body of a rejected request before the connection is closed
+#define LINGER_TIMEOUT 5
+#define LINGER_MAX_SIZE 1048576
 
 class Socket;
 
@@ -24,9 +34,21 @@ class Connection : public Pollable
 		READING,			// Receiving the body of the REQUEST
 		READY_TO_WRITE,		// Ready to send RESPONSE
 		WRITING,			// Sending body of RESPONSE
+		LINGERING,			// Discarding the unread body of a rejected REQUEST before closing
 		CLOSE				// Connection needs to be closed
 	};
 
+	// Moments of a request after its first byte, for the slow request log and Server-Timing
+	enum Phase
+	{
+		PHASE_HEADER = 0,		// The request header is parsed
+		PHASE_ROUTED,			// Server and location are looked up
+		PHASE_GATEWAY,			// The CGI (FastCGI application, upstream, handler) has the request
+		PHASE_RESPONSE_HEADER,	// The response header is sent
+		PHASE_LAST_BYTE,		// The response is complete
+		PHASE_COUNT
+	};
+
 	Connection(sockfd_t connection_fd, addr_t address, Socket* parent);
 	virtual ~Connection();
 
@@ -43,6 +65,7 @@ class Connection : public Pollable
 	Response const& get_last_response(void) const;
 	std::string get_ip(void) const;
 	State get_state(void) const;
+	static char const* get_state_name(State state);
 	virtual sockfd_t get_fd(void) const override;
 
 	virtual bool should_destroy(void) const override;
@@ -50,6 +73,8 @@ class Connection : public Pollable
 	virtual short get_events(sockfd_t fd) const override;
 
 	void reset_time_remaining(void);
+	void admit_cgi(void);
+	void cache_filled(void);
 	virtual void on_post_poll(pollable_map_t& fd_map) override;
 
 	protected:
@@ -62,15 +87,31 @@ class Connection : public Pollable
 	private:
 
 	void new_request(pollable_map_t& fd_map);
+	env::Arena& build_cgi_env(Server const& serv, Location const& loc);
 	void new_request_cgi(pollable_map_t& fd_map);
+	bool new_request_cached(Location const& loc);
+	void new_request_upload(Location const& loc);
+	void start_spooled_cgi(pollable_map_t& fd_map);
+	void release_gateway(pollable_map_t& fd_map);
+	void release_cgi_slot(void);
+	std::string const& pick_upstream(std::string const& address);
+	void report_upstream(Upstream::Result result);
+	bool retry_upstream(pollable_map_t& fd_map);
 	void continue_request(void);
+	void send_continue(void);
+	void linger(void);
 
-	void new_response(void);
+	void new_response(pollable_map_t& fd_map);
 	void new_response_get(Server const& server, Location const& loc);
 	void new_response_cgi(Server const& server, Location const& loc);
 	void new_response_delete(Server const& server, Location const& loc);
+	void new_response_metrics(pollable_map_t const& fd_map);
 	void new_response_redirect(Server const& server, Location const& loc);
 	void continue_response(pollable_map_t& fd_map);
+	void send_chunk(void);
+	void end_response(void);
+	void mark_phase(Phase phase);
+	std::string format_phases(bool server_timing) const;
 
 	Request build_request(std::string buffer);
 	void build_request_get(Request& request, std::stringstream& buffer);
@@ -88,17 +129,62 @@ class Connection : public Pollable
 	State state;
 
 	size_t last_time;
+	std::chrono::steady_clock::time_point idle_start; // Accepted, or the last response was sent
+	size_t requests; // Requests on this connection so far
+
+	// Progress of the chunk that's being sent (chunked transfer-encoding)
+	struct Chunk
+	{
+		char head[24]; // "size CRLF"
+		size_t head_size;
+		size_t head_left;
+		size_t data_left;
+		size_t tail_left; // the CRLF after the data
+		bool last;
+		Chunk();
+	};
 
 	struct HandlerData
 	{
 		Request current_request;
 		Response current_response;
 		std::string custom_page;
+		size_t custom_page_offset;
 		std::vector<char> buffer;
 		std::ifstream file;
 		size_t content_size;
 		size_t received_size;
-		CGI* cgi;
+		Gateway* gateway;
+		bool splice; // Relay the CGI body with splice(2) instead of through the buffers
+		bool splicing_out; // The response body is being spliced, the socket is non-blocking
+		bool chunked; // The gateway output is sent with chunked transfer-encoding
+		Chunk chunk;
+		std::unique_ptr<CacheFill> cache_fill; // Collects the CGI response for the cgi_cache
+		bool cache_waiting; // Another request is running the CGI for this response
+		bool cache_woken; // That request is done, look the response up again
+		std::string cache_key; // Waited for while cache_waiting
+		config_t config; // Generation of the config the request started with, it owns server and location
+		Server* server; // Server and location of the request, looked up once by new_request()
+		Location const* location;
+		CGIQueue* cgi_queue; // Queue of the location when the request holds (or waits for) a CGI slot
+		bool cgi_queued; // Waiting in cgi_queue for a slot
+		bool cgi_admitted; // Got a slot from cgi_queue, the CGI still has to start
+		bool spooling; // The gateway is a Spool collecting the body, the CGI starts once it's complete
+		time_t gateway_deadline; // When the gateway runs into cgi_timeout, 0 for none
+		bool expect_continue; // The client waits for "100 Continue" before it sends the body
+		bool linger; // The body wasn't read, it's discarded for a while after the response so the client sees it
+		time_t linger_deadline;
+		size_t lingered; // Bytes discarded so far
+		bool pass_error_body; // The error status came from the gateway, its body is sent instead of an error page
+		std::shared_ptr<Upstream> upstream; // Upstream of the proxy_pass or fastcgi address, nullptr when it's a single server
+		UpstreamMember* upstream_member; // Member running the request until its result is reported
+		std::chrono::steady_clock::time_point upstream_start;
+		size_t upstream_tries; // Members that failed before sending a response
+		std::chrono::steady_clock::time_point request_start; // When the first byte of the request came in
+		std::string uri; // Path of the request as it was sent, before an index page was added
+		size_t body_sent; // Bytes of the response body sent so far, for the access log
+		uint64_t request_id; // Counted from the start of the server, in the slow request log
+		uint32_t phases[PHASE_COUNT]; // Microseconds after request_start a phase was reached, 0 when it wasn't
 		HandlerData();
 	} handler_data;
 
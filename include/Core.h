@@ -7,13 +7,16 @@
 # include <poll.h>
 # include <string.h>
 # include <sys/socket.h>
+# include <sys/wait.h>
 # include <unistd.h>
 
 // Required C++-STD libraries:
 # include <bitset>
 # include <cstring>
 # include <fstream>
+# include <functional>
 # include <iostream>
+# include <memory>
 # include <set>
 # include <sstream>
 # include <thread>
@@ -0,0 +1,161 @@
+#ifndef FASTCGI_H
+# define FASTCGI_H
+
+# include "CGI.h"
+# include "Core.h"
+# include "Gateway.h"
+# include "Pollable.h"
+
+# include <deque>
+
+namespace webserv {
+
+# define FASTCGI_DEFAULT_CONNECTIONS 4
+# define FASTCGI_IDLE_TIMEOUT 60
+# define FASTCGI_MAX_RECORD 65535
+
+namespace fcgi
+{
+	enum RecordType
+	{
+		BEGIN_REQUEST = 1,
+		ABORT_REQUEST = 2,
+		END_REQUEST = 3,
+		PARAMS = 4,
+		STDIN = 5,
+		STDOUT = 6,
+		STDERR = 7,
+		GET_VALUES = 9,
+		GET_VALUES_RESULT = 10
+	};
+
+	enum Role { RESPONDER = 1 };
+	enum Flags { KEEP_CONN = 1 };
+
+	void append_record(std::vector<char>& out, RecordType type, uint16_t id, char const* data, size_t size);
+	// The CGI environment as name-value pairs, the content of FCGI_PARAMS
+	void encode_params(std::vector<char>& out, env::Arena const& env);
+	void append_params(std::vector<char>& out, uint16_t id, std::vector<char> const& params);
+} // namespace fcgi
+
+class FastCGIConnection;
+class FastCGIPool;
+
+// One HTTP request on a FastCGIConnection, or in the queue of the pool until a connection is free
+class FastCGIRequest : public Gateway
+{
+	public:
+	FastCGIRequest(FastCGIPool* pool, env::Arena const& env, size_t content_length);
+	virtual ~FastCGIRequest();
+
+	virtual bool is_output_closed(void) const override;
+	virtual bool finish(pollable_map_t& fd_map) override;
+	virtual void abort(pollable_map_t& fd_map) override;
+	// A queued request asks the pool for a connection
+	virtual void on_post_poll(pollable_map_t& fd_map) override;
+
+	private:
+	FastCGIRequest();
+	FastCGIRequest(FastCGIRequest const& other);
+	FastCGIRequest& operator=(FastCGIRequest const& other);
+
+	private:
+	friend class FastCGIConnection;
+	friend class FastCGIPool;
+
+	FastCGIPool* pool;
+	FastCGIConnection* connection;
+	uint16_t id;
+	std::vector<char> params; // Sent when the request starts on a connection
+	bool queued;
+	size_t stdin_remaining; // Body bytes still to be sent to the application
+	bool ended; // FCGI_END_REQUEST received (or the connection was lost)
+};
+
+// A persistent connection to a FastCGI application, lives in the fd_map
+class FastCGIConnection : public Pollable
+{
+	public:
+	FastCGIConnection(sockfd_t fd, FastCGIPool* pool, bool connecting);
+	virtual ~FastCGIConnection();
+
+	private:
+	FastCGIConnection();
+	FastCGIConnection(FastCGIConnection const& other);
+	FastCGIConnection& operator=(FastCGIConnection const& other);
+
+	public:
+	virtual sockfd_t get_fd(void) const override;
+	virtual bool should_destroy(void) const override;
+	virtual short get_events(sockfd_t fd) const override;
+	virtual void on_post_poll(pollable_map_t& fd_map) override;
+
+	void begin_request(FastCGIRequest* request);
+	void ask_values(void);
+	void release_request(FastCGIRequest* request);
+
+	size_t get_active_requests(void) const;
+	bool is_closed(void) const;
+
+	protected:
+	virtual void on_pollin(pollable_map_t& fd_map) override;
+	virtual void on_pollout(pollable_map_t& fd_map) override;
+	virtual void on_pollhup(pollable_map_t& fd_map, sockfd_t fd) override;
+
+	private:
+	void fill_stdin(void);
+	void handle_record(unsigned char type, uint16_t id, char const* content, size_t size);
+	void close_connection(void);
+
+	private:
+	sockfd_t socket_fd;
+	FastCGIPool* pool;
+	bool connecting;
+	bool closed;
+	size_t last_time;
+	uint16_t next_id;
+
+	std::vector<char> buffer_out; // Records to the application
+	std::vector<char> buffer_in; // Records from the application
+
+	// Requests by id, nullptr when the request was aborted and its END_REQUEST is still expected
+	std::unordered_map<uint16_t, FastCGIRequest*> requests;
+};
+
+// All connections to one application address ("unix:/path/to.sock" or "host:port").
+// Requests only share a connection when the application reports FCGI_MPXS_CONNS=1 (asked with
+// FCGI_GET_VALUES on the first connection), otherwise they wait in a FIFO once the pool is full.
+class FastCGIPool
+{
+	public:
+	static FastCGIPool& get(std::string const& address);
+
+	FastCGIRequest* new_request(pollable_map_t& fd_map, env::Arena const& env,
+		size_t content_length, size_t max_connections);
+	// Start queued requests on idle connections, or on new ones while the pool isn't full
+	void start_queued(pollable_map_t& fd_map);
+	void cancel(FastCGIRequest* request);
+	void remove_connection(FastCGIConnection* connection);
+	void set_multiplexing(bool multiplexing);
+
+	std::string const& get_address(void) const;
+
+	private:
+	FastCGIPool(std::string const& address);
+	FastCGIConnection* open_connection(pollable_map_t& fd_map);
+	// An idle connection, a new one while the pool isn't full, or the least busy one when
+	// the application multiplexes. nullptr when the request has to wait.
+	FastCGIConnection* find_connection(pollable_map_t& fd_map);
+
+	private:
+	std::string address;
+	size_t max_connections;
+	bool values_asked; // FCGI_GET_VALUES was sent
+	bool multiplexing;
+	std::vector<FastCGIConnection*> connections;
+	std::deque<FastCGIRequest*> queue;
+};
+
+} // namespace webserv
+
+#endif // FASTCGI_H
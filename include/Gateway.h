@@ -0,0 +1,73 @@
+#ifndef GATEWAY_H
+# define GATEWAY_H
+
+# include "Core.h"
+# include "Pollable.h"
+
+namespace webserv {
+
+// Anything a Connection hands a request to (CGI, FastCGI, proxies, handler modules).
+// The request body is pushed into buffer_in, the CGI-style response
+// (header fields, empty line, body) comes out of buffer_out.
+class Gateway
+{
+	public:
+	Gateway();
+	virtual ~Gateway() {}
+
+	// No more data will be added to buffer_out
+	virtual bool is_output_closed(void) const = 0;
+
+	// Release everything the gateway holds, returns true when it can be deleted
+	virtual bool finish(pollable_map_t& fd_map) = 0;
+
+	// Stop the request, the client is gone
+	virtual void abort(pollable_map_t& fd_map) = 0;
+
+	// Called by the connection every round of the event loop, for gateways that have
+	// no descriptors of their own to be polled for (handler modules)
+	virtual void on_post_poll(pollable_map_t& fd_map);
+
+	// Error statuses of the gateway are replaced by the error page of the server (CGI),
+	// or the response of the gateway is passed on as it is (proxies)
+	virtual bool intercept_errors(void) const;
+
+	// The output closed before the response was complete, the client connection can't be reused
+	bool is_truncated(void) const;
+
+	// Zero-copy relaying between a socket and the gateway, only for gateways backed by pipes.
+	// Both return the amount of bytes moved, 0 on end-of-file and -1 when nothing could be moved.
+	// splice_from() sets errno to EAGAIN when the gateway can't take more yet and to EPIPE when
+	// it takes no more input at all.
+	virtual bool can_splice(void) const;
+	virtual ssize_t splice_from(sockfd_t fd, size_t size);
+	virtual ssize_t splice_to(sockfd_t fd, pollable_map_t& fd_map);
+	// splice_from() ran into a full gateway, the socket isn't read until the gateway has room again
+	virtual bool is_input_blocked(void) const;
+
+	// The part of the buffers that hasn't been consumed yet
+	char const* pending_in(void) const;
+	size_t pending_in_size(void) const;
+	char const* pending_out(void) const;
+	size_t pending_out_size(void) const;
+
+	// Mark bytes at the front of the buffers as consumed. The buffers are only
+	// moved once half of them is consumed and cleared when all of it is.
+	void consume_in(size_t size);
+	void consume_out(size_t size);
+
+	public:
+	std::vector<char> buffer_in; // Into the gateway
+	std::vector<char> buffer_out; // From the gateway
+
+	protected:
+	bool truncated;
+
+	private:
+	size_t in_offset;
+	size_t out_offset;
+};
+
+} // namespace webserv
+
+#endif // GATEWAY_H
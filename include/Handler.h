@@ -0,0 +1,81 @@
+#ifndef HANDLER_H
+# define HANDLER_H
+
+# include "Core.h"
+# include "Gateway.h"
+# include "Request.h"
+# include "Server.h"
+# include "webserv_handler.h"
+
+namespace webserv {
+
+// A handler module loaded with dlopen, it stays loaded until the server exits
+class HandlerModule
+{
+	public:
+	// Loads the module on first use, throws when it can't be loaded or initialized
+	static HandlerModule& get(std::string const& path);
+
+	webserv_handler const& get_handler(void) const;
+
+	private:
+	HandlerModule(std::string const& path);
+	HandlerModule(HandlerModule const& other);
+	HandlerModule& operator=(HandlerModule const& other);
+
+	private:
+	std::string path;
+	void* library;
+	webserv_handler const* handler;
+};
+
+// A request run by a handler module inside the event loop.
+// The body in buffer_in and the calls to resume() are handled in on_post_poll().
+class HandlerRequest : public Gateway
+{
+	public:
+	HandlerRequest(HandlerModule& module, Request const& request, Location const& loc,
+		std::string const& client_ip, size_t content_length);
+	virtual ~HandlerRequest();
+
+	private:
+	HandlerRequest();
+	HandlerRequest(HandlerRequest const& other);
+	HandlerRequest& operator=(HandlerRequest const& other);
+
+	public:
+	virtual bool is_output_closed(void) const override;
+	virtual bool finish(pollable_map_t& fd_map) override;
+	virtual void abort(pollable_map_t& fd_map) override;
+	virtual void on_post_poll(pollable_map_t& fd_map) override;
+
+	private:
+	static void write(void* context, char const* data, size_t size);
+	void handle_result(int result);
+
+	private:
+	webserv_handler const* handler;
+	void* state;
+
+	// Storage of the request view
+	std::string method;
+	std::string path;
+	std::string query;
+	std::string http_version;
+	std::string client_ip;
+	std::string location;
+	std::vector<std::pair<std::string, std::string>> fields;
+	std::vector<webserv_header> headers;
+	webserv_request view;
+	webserv_output output;
+
+	size_t content_length;
+	size_t received;
+	bool written; // Part of the response was written, an error can't become a 500 anymore
+	bool body_done; // The last body() call was made
+	bool ended;
+};
+
+} // namespace webserv
+
+#endif // HANDLER_H
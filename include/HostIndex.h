@@ -0,0 +1,57 @@
+#ifndef HOSTINDEX_H
+# define HOSTINDEX_H
+
+# include "Core.h"
+# include "Server.h"
+
+# include <unordered_map>
+
+namespace webserv {
+
+// Server names of the servers on one socket, by lowercased hostname.
+// Exact names are in a hash map, "*.example.com" and "example.*" in tries of labels walked from
+// the end and from the start of the hostname. Exact names win, then the longest leading wildcard,
+// then the longest trailing one. A wildcard stands for one or more labels.
+class HostIndex
+{
+	public:
+	HostIndex(void);
+
+	// The first server added for a name keeps it, like the first server that listed it used to
+	void add(std::string const& name, Server* server);
+	// hostname is the Host header (the port is ignored), nullptr when no name matches
+	Server* find(std::string const& hostname) const;
+
+	static std::string normalize(std::string const& hostname);
+
+	private:
+	class LabelTrie
+	{
+		public:
+		LabelTrie(void);
+
+		void insert(std::vector<std::string> const& labels, Server* server);
+		// The server of the longest path of labels that leaves at least one label unmatched
+		Server* find(std::vector<std::string> const& labels) const;
+		bool empty(void) const;
+
+		private:
+		struct Node
+		{
+			Server* server;
+			std::unordered_map<std::string, size_t> children; // Indices in nodes
+		};
+		std::vector<Node> nodes; // nodes[0] is the root
+	};
+
+	static std::vector<std::string> split_labels(std::string const& name);
+
+	private:
+	std::unordered_map<std::string, Server*> names;
+	LabelTrie leading; // "*.example.com", labels from the end
+	LabelTrie trailing; // "example.*", labels from the start
+};
+
+} // namespace webserv
+
+#endif // HOSTINDEX_H
@@ -0,0 +1,39 @@
+#ifndef LOCATIONTREE_H
+# define LOCATIONTREE_H
+
+# include "Core.h"
+
+namespace webserv {
+
+// Radix tree of location paths, a lookup walks the request path once and returns the
+// longest location path that's a prefix of it (an equal path being the longest).
+// Values are indices into Server::locations, so a copied tree stays valid.
+class LocationTree
+{
+	public:
+	static size_t const npos = static_cast<size_t>(-1);
+
+	LocationTree(void);
+
+	// The first value inserted for a path is kept, like the first of two equal locations matched
+	void insert(std::string const& path, size_t value);
+	// npos when no path is a prefix of path
+	size_t find(std::string const& path) const;
+
+	private:
+	struct Node
+	{
+		std::string label; // Part of the path on the edge from the parent
+		size_t value;
+		std::vector<size_t> children; // Indices in nodes, no two labels start with the same character
+	};
+
+	size_t find_child(size_t node, char c) const;
+
+	private:
+	std::vector<Node> nodes; // nodes[0] is the root, with an empty label
+};
+
+} // namespace webserv
+
+#endif // LOCATIONTREE_H
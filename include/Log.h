@@ -0,0 +1,18 @@
+#ifndef LOG_H
+# define LOG_H
+
+# include <iostream>
+
+// Diagnostics on stdout, requests are in the access log (see AccessLog).
+// LOG_DEBUG is the chatter of every event (connections, CGIs, bytes sent), it's only compiled
+// into DEBUG builds. LOG_INFO is for what an operator wants to see: sockets, reloads, upstreams
+// going down, timeouts. Both take a stream expression: LOG_INFO("CGI timed out: " << fd)
+# ifdef DEBUG
+#  define LOG_DEBUG(message) (std::cout << message << std::endl)
+# else
+#  define LOG_DEBUG(message) ((void)0)
+# endif
+
+# define LOG_INFO(message) (std::cout << message << std::endl)
+
+#endif // LOG_H
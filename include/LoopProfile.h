@@ -0,0 +1,106 @@
+#ifndef LOOPPROFILE_H
+# define LOOPPROFILE_H
+
+# include "Core.h"
+# include "Metrics.h"
+# include "Pollable.h"
+
+# include <chrono>
+# include <ctime>
+# include <typeindex>
+
+namespace webserv {
+
+// Iterations of the event loop taking longer than this (milliseconds, poll() not included) are kept
+# define LOOP_SLOW_ITERATION 10
+// Amount of slow iterations kept, the oldest is overwritten
+# define LOOP_SLOW_ITERATIONS 32
+// Amount of the slowest handler calls kept since the start
+# define LOOP_SLOWEST_CALLS 8
+
+// Where the time of the event loop goes: waiting in poll(), the descriptors that were ready and
+// every handler call (notify() and on_post_poll()) by type of Pollable. A handler blocking the
+// loop shows up in the slowest calls and in the slow iterations, with its descriptor and the
+// state of the Connection. Written out on SIGUSR1, the histograms are also in the metrics.
+class LoopProfile
+{
+	public:
+	enum Phase
+	{
+		NOTIFY = 0,	// Handling the events of poll()
+		POST_POLL	// on_post_poll(), which runs for every descriptor
+	};
+
+	// Handler calls by type of Pollable
+	struct TypeStats
+	{
+		std::string name;
+		Histogram dispatch; // notify() only
+		uint64_t post_poll_calls;
+		std::chrono::steady_clock::duration post_poll_time;
+	};
+
+	// A handler call on one descriptor
+	struct Call
+	{
+		std::chrono::steady_clock::time_point start;
+		std::chrono::steady_clock::duration duration;
+		TypeStats* type;
+		char const* state; // Of a Connection, else nullptr
+		Phase phase;
+		sockfd_t fd;
+		short revents;
+		time_t time;
+	};
+
+	struct SlowIteration
+	{
+		time_t time;
+		std::chrono::steady_clock::duration busy;
+		size_t ready;
+		Call slowest;
+	};
+
+	static LoopProfile& get(void);
+
+	void start_poll(void);
+	void end_poll(int ready);
+	Call start_call(Pollable const* pollable, sockfd_t fd, short revents, Phase phase);
+	void end_call(Call& call);
+	void end_iteration(void);
+
+	void dump(void) const;
+
+	uint64_t get_iterations(void) const;
+	uint64_t get_ready(void) const;
+	size_t get_max_ready(void) const;
+	Histogram const& get_poll_duration(void) const;
+	Histogram const& get_busy_duration(void) const;
+	std::unordered_map<std::type_index, TypeStats> const& get_types(void) const;
+
+	private:
+	LoopProfile(void);
+	LoopProfile(LoopProfile const& other);
+	LoopProfile& operator=(LoopProfile const& other);
+
+	private:
+	uint64_t iterations;
+	uint64_t ready; // Ready descriptors over all iterations
+	size_t max_ready;
+	Histogram poll_duration;
+	Histogram busy_duration; // Of an iteration after poll() returned
+	std::unordered_map<std::type_index, TypeStats> types;
+	std::vector<Call> slowest_calls; // Slowest first
+	std::vector<SlowIteration> slow_iterations;
+	size_t next_slow_iteration;
+
+	// The running iteration
+	std::chrono::steady_clock::time_point poll_start;
+	std::chrono::steady_clock::time_point iteration_start;
+	size_t iteration_ready;
+	Call iteration_slowest;
+};
+
+} // namespace webserv
+
+#endif // LOOPPROFILE_H
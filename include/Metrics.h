@@ -0,0 +1,81 @@
+#ifndef METRICS_H
+# define METRICS_H
+
+# include "Core.h"
+# include "Pollable.h"
+# include "Request.h"
+
+# include <chrono>
+# include <ctime>
+
+namespace webserv {
+
+// Powers of two of microseconds the histogram buckets are split in, values beyond are counted in the last one
+# define HISTOGRAM_MAX_EXPONENT 40
+// Buckets per power of two, the upper bound of a value is at most 1/8 (12.5%) above it
+# define HISTOGRAM_SUB_BUCKETS 8
+
+// Latencies in log-linear buckets (like HdrHistogram): exact below 8µs, then 8 buckets for every
+// power of two. Recording is an increment, percentiles are only worked out when scraped.
+class Histogram
+{
+	public:
+	Histogram(void);
+
+	void record(std::chrono::steady_clock::duration duration);
+
+	uint64_t get_count(void) const;
+	double get_sum(void) const; // Seconds
+	double get_max(void) const; // Seconds
+	// Upper bound of the bucket that holds the percentile (0.0 - 1.0), in seconds
+	double percentile(double fraction) const;
+	// Values below microseconds, microseconds has to be a power of two
+	uint64_t count_below(uint64_t microseconds) const;
+
+	private:
+	static size_t bucket_of(uint64_t microseconds);
+	static uint64_t bucket_end(size_t bucket);
+
+	private:
+	std::vector<uint64_t> buckets;
+	uint64_t count;
+	uint64_t sum; // Microseconds
+	uint64_t max;
+};
+
+// Counters of the server, served by a location with "metrics" set (Prometheus text, or JSON
+// with ?format=json). The event loop is the only thread that counts, so the counters are plain
+// integers, no atomics. What can be read off the server (connections by state, upstreams, CGI
+// queues) is only collected when scraped.
+class Metrics
+{
+	public:
+	static Metrics& get(void);
+
+	static std::string render_prometheus(pollable_map_t const& fd_map);
+	static std::string render_json(pollable_map_t const& fd_map);
+
+	private:
+	Metrics(void);
+	Metrics(Metrics const& other);
+	Metrics& operator=(Metrics const& other);
+
+	public:
+	time_t start_time;
+	uint64_t connections_accepted;
+	uint64_t connections_closed;
+	uint64_t requests[PUT + 1]; // By RequestType
+	uint64_t responses[600]; // By status code
+	uint64_t bytes_received;
+	uint64_t bytes_sent;
+	uint64_t cgi_spawns;
+	uint64_t cgi_failures; // CGIs that couldn't start, exited with an error or were killed
+	Histogram cgi_duration;
+	Histogram header_duration; // From the first byte of the request to the end of its header
+	Histogram first_byte_duration; // From the first byte of the request to the response header
+	Histogram request_duration; // From the first byte of the request to the end of the response
+};
+
+} // namespace webserv
+
+#endif // METRICS_H
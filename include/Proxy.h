@@ -0,0 +1,155 @@
+#ifndef PROXY_H
+# define PROXY_H
+
+# include "Core.h"
+# include "Gateway.h"
+# include "Pollable.h"
+# include "Request.h"
+# include "Server.h"
+
+namespace webserv {
+
+// Idle keep-alive connections kept per upstream server
+# define PROXY_DEFAULT_CONNECTIONS 8
+# define PROXY_IDLE_TIMEOUT 30
+// Response bytes buffered for a slow client before reading from the upstream stops
+# define PROXY_BUFFER_SIZE 65536
+// Largest response head (and chunk size line) accepted from the upstream
+# define PROXY_MAX_HEADER_SIZE 16384
+
+namespace proxy
+{
+	// Splits "http://host:port/uri" into the address "host:port" and the uri (may be empty)
+	bool parse_url(std::string const& url, std::string& address, std::string& uri);
+
+	// Request line and header fields for the upstream, the location prefix is replaced by the uri of proxy_pass
+	std::string build_head(Request const& request, Location const& loc, std::string const& client_ip);
+} // namespace proxy
+
+class UpstreamConnection;
+class ProxyPool;
+
+// One request forwarded to an upstream HTTP server.
+// The upstream response is presented like CGI output: "Status:" and header fields, an empty line
+// and the body, with the transfer-encoding already decoded.
+class ProxyRequest : public Gateway
+{
+	public:
+	ProxyRequest(ProxyPool* pool, std::string const& head);
+	virtual ~ProxyRequest();
+
+	private:
+	ProxyRequest();
+	ProxyRequest(ProxyRequest const& other);
+	ProxyRequest& operator=(ProxyRequest const& other);
+
+	public:
+	virtual bool is_output_closed(void) const override;
+	virtual bool finish(pollable_map_t& fd_map) override;
+	virtual void abort(pollable_map_t& fd_map) override;
+	virtual bool intercept_errors(void) const override;
+
+	private:
+	friend class UpstreamConnection;
+	friend class ProxyPool;
+
+	ProxyPool* pool;
+	UpstreamConnection* connection;
+	std::string head; // Kept to retry on a new connection when a reused one turns out to be closed
+	size_t body_sent;
+	bool ended; // The response is complete (or the connection was lost)
+};
+
+// A connection to the upstream, it handles one request at a time and is kept alive in between
+class UpstreamConnection : public Pollable
+{
+	public:
+	UpstreamConnection(sockfd_t fd, ProxyPool* pool, bool connecting);
+	virtual ~UpstreamConnection();
+
+	private:
+	UpstreamConnection();
+	UpstreamConnection(UpstreamConnection const& other);
+	UpstreamConnection& operator=(UpstreamConnection const& other);
+
+	public:
+	virtual sockfd_t get_fd(void) const override;
+	virtual bool should_destroy(void) const override;
+	virtual short get_events(sockfd_t fd) const override;
+	virtual void on_post_poll(pollable_map_t& fd_map) override;
+
+	void begin_request(ProxyRequest* request, bool reused);
+	void detach(void);
+	void close_connection(void);
+
+	bool is_reusable(void) const;
+	bool is_stale(void) const; // The upstream closed the idle connection
+
+	protected:
+	virtual void on_pollin(pollable_map_t& fd_map) override;
+	virtual void on_pollout(pollable_map_t& fd_map) override;
+	virtual void on_pollhup(pollable_map_t& fd_map, sockfd_t fd) override;
+
+	private:
+	enum Parse
+	{
+		HEAD = 0,			// Status line and header fields
+		BODY_LENGTH,		// content-length bytes
+		BODY_UNTIL_CLOSE,	// Everything until the upstream closes
+		CHUNK_SIZE,
+		CHUNK_DATA,
+		CHUNK_END,			// The CRLF after the data of a chunk
+		TRAILER,
+		DONE
+	};
+
+	size_t parse_head(char const* data, size_t size);
+	void parse_response(void);
+	void upstream_closed(pollable_map_t& fd_map);
+
+	private:
+	sockfd_t socket_fd;
+	ProxyPool* pool;
+	bool connecting;
+	bool closed;
+	bool reused; // Served a request before this one
+	size_t last_time;
+
+	ProxyRequest* request;
+	size_t head_sent;
+	size_t received; // Response bytes received
+
+	std::vector<char> buffer_in; // Raw response
+	Parse parse;
+	size_t remaining; // Of the body or of the chunk
+	bool keep_alive;
+};
+
+// The connections to one upstream server ("host:port")
+class ProxyPool
+{
+	public:
+	static ProxyPool& get(std::string const& address);
+
+	ProxyRequest* new_request(pollable_map_t& fd_map, std::string const& head, size_t max_idle);
+	// Run the request on an idle connection, or on a new one
+	void start_request(pollable_map_t& fd_map, ProxyRequest* request, bool allow_idle);
+	// The request on the connection is done, keep it for the next request if possible
+	void release(UpstreamConnection* connection);
+	void remove_connection(UpstreamConnection* connection);
+
+	std::string const& get_address(void) const;
+
+	private:
+	ProxyPool(std::string const& address);
+	UpstreamConnection* open_connection(pollable_map_t& fd_map);
+
+	private:
+	std::string address;
+	size_t max_idle;
+	std::vector<UpstreamConnection*> idle;
+};
+
+} // namespace webserv
+
+#endif // PROXY_H
@@ -0,0 +1,54 @@
+#ifndef REAPER_H
+# define REAPER_H
+
+# include "Core.h"
+# include "Pollable.h"
+
+namespace webserv {
+
+// Collects the exit status of the CGI children.
+// SIGCHLD is delivered as a readable descriptor (signalfd on Linux, a self-pipe elsewhere),
+// so children are only reaped when one of them actually exited.
+class Reaper : public Pollable
+{
+	public:
+	Reaper();
+	virtual ~Reaper();
+
+	private:
+	Reaper(Reaper const& other);
+	Reaper& operator=(Reaper const& other);
+
+	public:
+	virtual sockfd_t get_fd(void) const override;
+	virtual bool should_destroy(void) const override;
+	virtual short get_events(sockfd_t fd) const override;
+
+	// Keep the exit status of pid once it exits, other children are reaped silently
+	static void watch(pid_t pid);
+	static void forget(pid_t pid);
+	// Returns true (and the status from waitpid()) when pid has exited
+	static bool has_exited(pid_t pid, int& status);
+
+	protected:
+	virtual void on_pollin(pollable_map_t& fd_map) override;
+	virtual void on_pollout(pollable_map_t& fd_map) override;
+	virtual void on_pollhup(pollable_map_t& fd_map, sockfd_t fd) override;
+
+	private:
+	void reap(void);
+
+	private:
+	sockfd_t signal_fd;
+# ifndef __linux__
+	sockfd_t signal_pipe[2];
+# endif
+	bool destroy;
+
+	// Watched children, the status is -1 while they're running
+	std::unordered_map<pid_t, int> children;
+};
+
+} // namespace webserv
+
+#endif // REAPER_H
@@ -16,7 +16,8 @@ enum RequestType
 	UNKNOWN,
 	GET,
 	POST,
-	DELETE
+	DELETE,
+	PUT
 };
 
 struct Request
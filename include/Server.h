@@ -2,7 +2,10 @@
 # define SERVER_H
 
 #include "Core.h"
+#include "LocationTree.h"
+#include "Request.h"
 #include <algorithm>
+#include <regex.h>
 #include <utility>
 
 namespace webserv{
@@ -10,7 +13,15 @@ namespace webserv{
 // the location block enables us to handle several types of URIs/routes within a server block
 class Location{
 	public:
-		std::string										path; //the URI of the location block
+		enum Match{
+			PREFIX = 0,		//"/path/": paths starting with it, the longest one wins
+			EXACT,			//"= /path": only that path, checked first
+			REGEX,			//"~ regex": paths the regex finds a match in, checked after the prefixes, longest regex first
+			REGEX_ICASE		//"~* regex": same, ignoring case
+		};
+
+		std::string										path; //the URI of the location block (the regex of a regex location)
+		Match											match; //how path is matched against request paths
 		std::string										root; //(inherit if not defined) root directory for the location.
 		std::pair<bool,std::string>						index; //(inherit if not defined)index page name if not defined will inherit from server
 		std::pair<bool, bool>							autoindex;//(inherit if not defined) //show the directory listing if true else it won't
@@ -20,6 +31,35 @@ class Location{
 		std::string										redirect;	//defines the redirect for this location. The redirect will be code 301 for permanent redirect and this will contain the url that is being redirected to
 		std::vector<std::string>						cgi; //contains the cgi extentions the location support
 		std::string										upload_directory; //defines the path for storing files
+		std::string										fastcgi; //address of the FastCGI application handling this location ("unix:/path" or "host:port"), empty for none
+		size_t											fastcgi_connections; //maximum amount of persistent connections to the FastCGI application
+		bool											cgi_splice; //relay CGI bodies between the socket and the pipes with splice(2) (Linux only)
+		size_t											cgi_cache; //seconds a GET response of the CGI is cached, 0 means disabled
+		std::string										cgi_cache_directory; //directory for cached responses that are too large to keep in memory
+		std::vector<std::string>						cgi_cache_key_headers; //request headers that are part of the cache key besides method, host, path and query
+		size_t											cgi_max_concurrent; //maximum amount of CGIs running at once for this location, 0 means unlimited
+		size_t											cgi_queue_size; //amount of requests waiting for a CGI slot, requests beyond it get 503
+		std::string										proxy_pass; //upstream HTTP server requests are forwarded to ("http://host:port/uri"), empty for none
+		size_t											proxy_connections; //maximum amount of idle keep-alive connections kept to the upstream
+		size_t											cgi_timeout; //seconds a CGI may run before it's stopped and 504 is sent, 0 means no limit
+		std::string										handler; //path of the handler module (shared object) answering requests in-process, empty for none
+		size_t											cgi_spool_threshold; //bodies larger than this (bytes) are stored in a temporary file before the CGI starts, 0 means disabled
+		std::string										cgi_spool_directory; //directory for the temporary body files, empty for P_tmpdir
+		bool											metrics; //answer with the counters of the server (Prometheus text, JSON with ?format=json) instead of files
+
+		//resolved by Server::compile() once the config is loaded, with the settings of the server for what the location doesn't set.
+		//request handling only reads these
+		std::string										effective_root;
+		std::string										effective_index;
+		bool											effective_autoindex;
+		size_t											effective_client_max_body_size;
+		std::string										effective_redirect;
+		std::string										name; //the location as written in the config ("/path/", "= /path", "~ regex")
+		std::string										uri_prefix; //the part of request paths the location stands for: its path, "/" for a regex location
+		std::string										upload_path; //upload_directory, a relative one joined to the root and uri_prefix of the location
+		unsigned										allowed_methods; //bit (1 << RequestType) per allowed method
+		int												error_page_base; //status code of error_page_table[0]
+		std::vector<std::string>						error_page_table; //full paths of the error pages by status code - error_page_base, empty for none
 
 		Location(void);
 		Location(std::string const & path); //constructor to create a Location object with the path set
@@ -37,15 +77,14 @@ class Location{
 		//getters
 		std::string							get_error_page(int error_code) const; //returns the error page name/path if no error pages been defined return a string object that is empty 
 		bool								is_http_command_allowed(std::string const & http_command) const; //return if a http command is allowed on this location
-		std::string							get_cgi_path(std::string const & path); //returns the path that is related with the extention else return empty string
+		std::string							get_cgi_path(std::string const & path) const; //returns the path that is related with the extention else return empty string
 };
 
 class Server{
 	//the server block contains the the server configuration directives
 
 	private:
-		size_t	match_paths(std::string const & input_path, std::string const & loc_block_path);
-		bool	find_http_command(std::vector<std::string> const & http_commands, std::string const & http_command) const;
+		void	compile_location(Location & location) const;
 
 	public:
 		int										port; //port of the virtual server if no port has been set the default port should be 80
@@ -61,6 +100,18 @@ class Server{
 		std::string								redirect;	//defines the redirect for this location. The redirect will be code 301 for permanent redirect and this will contain the and this will contain the url that is being redirected to
 		
 		std::vector<Location>					locations; //stores all the locations blocks that has been defined for the server. The string is the path and the Location object is the location block
+	private:
+		struct RegexLocation{
+			std::shared_ptr<regex_t>			regex;
+			size_t								index;
+		};
+
+		LocationTree							location_tree; //the paths of prefix locations, the values are indices in locations
+		std::unordered_map<std::string, size_t>	exact_locations; //paths of exact locations, by index in locations
+		std::vector<RegexLocation>				regex_locations; //compiled regexes of regex locations, longest first
+		Location								no_location; //returned by get_location when no location matches
+
+	public:
 
 		Server(void);
 		~Server(void);
@@ -69,20 +120,25 @@ class Server{
 		void								add_server_name(std::string const & server_name); //add server names to the server block
 		void								add_error_page(int error_code, std::string const & error_page); //add error page to the server block
 		void								add_allowed_http_command(std::string const & http_command); //add allowed HTTP commands for the server block
-		void								add_location(Location const & location_block); //add location to the server block
+		bool								add_location(Location const & location_block); //add location to the server block, false when its regex doesn't compile
+		void								compile(void); //resolves the inheritance of the locations, after the last one was added
 
 		//getters
-		Location 							get_location(std::string const & loc_path); //will return the best matching location block. if not will return nullpointer
+		Location const &					get_location(std::string const & loc_path) const; //will return the matching location block: an exact one, else the first matching regex one, else the longest prefix. if not will return an empty location
 		bool								contain_server_name(std::string const & server_name) const; //return true if the server name has been found in the list
 		bool								is_http_command_allowed(std::string const & http_command, Location const & location) const; //return if a http command is allowed on this location
+		bool								is_method_allowed(RequestType method, Location const & location) const; //same with the method of a request
 		std::string							get_error_page(int error_code, Location const & location) const; //returns the error page name/path if no error pages been defined return a string object that is empty 
 		std::string const & 				get_root(Location const & location) const; //get the root of a particular location
 		size_t								get_client_max_body_size(Location const & location) const; //will return the client max body size for that location
 		bool								is_auto_index_on(Location const & location) const; //will return true autoindex for location is on
 		std::string const &					get_index_page(Location const & location) const; //will return the index page for the location
-		std::pair<std::string, std::string>	get_cgi(Location & location, std::string const & path) const; //will return the path to the cgi binary or script
+		std::pair<std::string, std::string>	get_cgi(Location const & location, std::string const & path) const; //will return the path to the cgi binary or script
 		std::string const &					get_redirection(Location const & location) const; //will return the url of the redirection if set
 		std::string const &					get_upload_dir(Location const & location) const; // will return the upload path set in the location block
+		std::string const &					get_fastcgi(Location const & location) const; // will return the address of the FastCGI application if set
+		std::string const &					get_proxy_pass(Location const & location) const; // will return the url of the upstream server if set
+		std::string const &					get_handler(Location const & location) const; // will return the path of the handler module if set
 };
 
 } //namespace webserv
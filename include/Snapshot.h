@@ -0,0 +1,30 @@
+#ifndef SNAPSHOT_H
+# define SNAPSHOT_H
+
+# include "Core.h"
+# include "Config.h"
+# include "Upstream.h"
+
+namespace webserv {
+
+// Bumped whenever the layout or the fields of Config, Server, Location or Upstream change
+# define SNAPSHOT_VERSION 4
+// The snapshot of "config.json" is "config.json.snapshot"
+# define SNAPSHOT_SUFFIX ".snapshot"
+
+// A binary copy of a parsed and validated config (webserv --compile-config), loaded with mmap
+// in place of parsing the JSON file. It's stamped with the size and modification time of the
+// JSON file, a snapshot of an older version of the file isn't used.
+namespace snapshot {
+
+// Writes the servers and upstreams next to config_path
+void write(std::string const& config_path, Config const& config, upstream_map_t const& upstreams);
+// The servers of the snapshot of config_path, its upstreams are added (Upstream::add).
+// nullptr when there's no snapshot or config_path changed since, throws when it's damaged.
+config_t read(std::string const& config_path);
+
+} // namespace snapshot
+
+} // namespace webserv
+
+#endif // SNAPSHOT_H
@@ -3,6 +3,8 @@
 
 # include "Core.h"
 
+# include "Config.h"
+# include "HostIndex.h"
 # include "Pollable.h"
 # include "Server.h"
 
@@ -15,6 +17,8 @@ class Socket : public Pollable
 	public:
 	// Constructors
 	Socket(uint16_t _port, std::string const& host = "0.0.0.0");
+	// Adopts a descriptor that's already bound and listening, inherited from the previous binary
+	Socket(sockfd_t inherited_fd, uint16_t _port, std::string const& _host);
 
 	virtual ~Socket();
 
@@ -30,7 +34,17 @@ class Socket : public Pollable
 	std::string const& get_host(void) const;
 	Server& get_server(std::string const& host);
 	std::vector<Server*> get_servers(void);
-	void add_server_ref(std::unique_ptr<Server>& server_ref);
+	void add_server_ref(Server* server);
+	// Takes servers of the config, the ones that listen on the address of the socket
+	void set_config(config_t const& config, std::vector<Server*> const& config_servers);
+	config_t const& get_config(void) const;
+
+	// The address isn't in the config anymore: stop accepting, the connections finish their request
+	void retire(void);
+	bool is_retired(void) const;
+	void add_connection(void);
+	void remove_connection(void);
+	size_t get_connections(void) const;
 
 	virtual sockfd_t get_fd(void) const override;
 
@@ -51,7 +65,11 @@ class Socket : public Pollable
 	sockfd_t socket_fd;
 	addr_in_t address;
 
-	std::vector<Server*> servers;
+	config_t config; // The generation the servers belong to
+	std::vector<Server*> servers; // The first one is the default server
+	HostIndex host_index; // server_names of the servers
+	bool retired;
+	size_t connections;
 };
 
 } // namespace webserv
@@ -0,0 +1,54 @@
+#ifndef SPOOL_H
+# define SPOOL_H
+
+# include "Core.h"
+# include "Gateway.h"
+
+namespace webserv {
+
+// Size of the reads from the client socket
+# define SPOOL_BUFFER_SIZE 65536
+
+// Collects a request body in an unlinked temporary file, read from the client as fast as it arrives.
+// Once it's complete the file becomes the stdin of the CGI, so a CGI that reads slowly doesn't
+// hold back the upload. It produces no output of its own.
+class Spool : public Gateway
+{
+	public:
+	Spool(std::string const& directory, size_t content_length);
+	virtual ~Spool();
+
+	private:
+	Spool();
+	Spool(Spool const& other);
+	Spool& operator=(Spool const& other);
+
+	public:
+	virtual bool is_output_closed(void) const override;
+	virtual bool finish(pollable_map_t& fd_map) override;
+	virtual void abort(pollable_map_t& fd_map) override;
+	virtual void on_post_poll(pollable_map_t& fd_map) override;
+
+	virtual bool can_splice(void) const override;
+	virtual ssize_t splice_from(sockfd_t fd, size_t size) override;
+
+	// The whole body is in the file
+	bool is_complete(void) const;
+	bool has_failed(void) const;
+	// The file, positioned at the start of the body
+	int get_fd(void) const;
+
+	private:
+	void receive(char const* data, size_t size);
+
+	private:
+	int file_fd;
+	size_t content_length;
+	size_t received;
+	std::vector<char> buffer; // For reads from the socket
+	bool failed;
+};
+
+} // namespace webserv
+
+#endif // SPOOL_H
@@ -0,0 +1,93 @@
+#ifndef UPLOAD_H
+# define UPLOAD_H
+
+# include "Core.h"
+# include "Gateway.h"
+# include "Request.h"
+# include "Server.h"
+
+namespace webserv {
+
+// Size of the reads from the client socket
+# define UPLOAD_BUFFER_SIZE 65536
+// Largest header block of a multipart/form-data part
+# define UPLOAD_MAX_PART_HEADER_SIZE 8192
+
+// POST/PUT into the upload_directory of a location, without a CGI.
+// The body is read from the socket with splice_from() and written to a temporary file in the
+// upload directory, preallocated from Content-Length. The file is renamed into place once it's
+// complete. multipart/form-data bodies are parsed as they arrive, each part with a filename
+// becomes a file. The response ("201 Created" and a Location) comes out of buffer_out like CGI output.
+class Upload : public Gateway
+{
+	public:
+	// Errors are answered once the whole body has been received, so the connection can be kept
+	Upload(Request const& request, Location const& loc, std::string const& directory, size_t content_length);
+	virtual ~Upload();
+
+	private:
+	Upload();
+	Upload(Upload const& other);
+	Upload& operator=(Upload const& other);
+
+	public:
+	virtual bool is_output_closed(void) const override;
+	virtual bool finish(pollable_map_t& fd_map) override;
+	virtual void abort(pollable_map_t& fd_map) override;
+	virtual void on_post_poll(pollable_map_t& fd_map) override;
+
+	virtual bool can_splice(void) const override;
+	virtual ssize_t splice_from(sockfd_t fd, size_t size) override;
+
+	private:
+	enum Parse
+	{
+		RAW = 0,		// The body is the file
+		PREAMBLE,		// Before the first boundary
+		PART_HEADER,
+		PART_DATA,
+		PART_END,		// After a boundary: "--" ends the body, CRLF starts the next part
+		EPILOGUE
+	};
+
+	struct File
+	{
+		std::string temp_path;
+		std::string path;
+		std::string uri;
+		int fd;
+		size_t size;
+	};
+
+	void receive(char const* data, size_t size);
+	void check_end(void);
+	void parse_multipart(void);
+	void parse_part_header(std::string const& header);
+	void open_file(std::string const& name);
+	void write_file(char const* data, size_t size);
+	void close_file(void);
+	void complete(void);
+	void fail(std::string const& status);
+
+	private:
+	std::string directory;
+	std::string base_uri; // Where the stored files can be requested from
+	bool replace; // PUT: an existing file is replaced
+
+	Parse parse;
+	std::string delimiter; // CRLF "--" boundary
+	std::string pending; // Received multipart data that isn't parsed yet
+
+	File file; // The file being written, fd is -1 when there is none
+	std::vector<File> stored; // Complete files, renamed into place once the whole body is in
+
+	size_t content_length;
+	size_t received;
+	std::vector<char> buffer; // For reads from the socket
+	bool failed; // The status is in buffer_out, the rest of the body is dropped
+	bool ended;
+};
+
+} // namespace webserv
+
+#endif // UPLOAD_H
@@ -0,0 +1,150 @@
+#ifndef UPSTREAM_H
+# define UPSTREAM_H
+
+# include "Core.h"
+# include "Pollable.h"
+
+# include <cstdint>
+# include <map>
+
+namespace webserv {
+
+# define UPSTREAM_DEFAULT_MAX_FAILS 1
+# define UPSTREAM_DEFAULT_FAIL_TIMEOUT 10
+// Points of each member on the consistent hash ring
+# define UPSTREAM_RING_POINTS 160
+// Weight of a new sample in the latency average
+# define UPSTREAM_EWMA_WEIGHT 0.2
+// Size of the response read from a member for the health_check status line
+# define UPSTREAM_PROBE_BUFFER_SIZE 256
+
+class Upstream;
+
+typedef std::map<std::string, std::shared_ptr<Upstream>> upstream_map_t;
+
+// One server of an upstream ("host:port" or "unix:/path")
+struct UpstreamMember
+{
+	std::string address;
+	size_t active; // Requests in flight
+	size_t fails; // Failures since first_fail
+	time_t first_fail;
+	time_t ejected_until; // Passively ejected after max_fails failures
+	bool healthy; // Outcome of the last health probe
+	bool probing;
+	time_t next_probe;
+	double latency; // EWMA of the time until the response header in ms, 0 until measured
+	size_t requests;
+	size_t failures;
+
+	UpstreamMember(std::string const& address);
+	bool is_available(time_t now) const;
+};
+
+// A named group of servers for proxy_pass or fastcgi, set in the "upstreams" block of the config
+class Upstream
+{
+	public:
+	enum Policy
+	{
+		ROUND_ROBIN = 0,
+		LEAST_CONN,		// Fewest requests in flight, weighed by the latency of the member
+		HASH_URI,		// Consistent hash of the request uri
+		HASH_IP			// Consistent hash of the client address
+	};
+
+	enum Result
+	{
+		SUCCESS = 0,	// The member sent a response header
+		FAILURE,		// Connection failed, or it ended or timed out without a response
+		CANCELLED		// The request ended without telling anything about the member
+	};
+
+	Upstream(std::string const& name);
+
+	private:
+	Upstream();
+	Upstream(Upstream const& other);
+	Upstream& operator=(Upstream const& other);
+
+	public:
+	static std::shared_ptr<Upstream> find(std::string const& name);
+	static void add(Upstream* upstream);
+	static upstream_map_t const& get_all(void);
+	// A reload swaps in the upstreams of the new config, requests and probes keep the ones they hold
+	static void replace_all(upstream_map_t const& upstreams);
+	// Starts the health probes that are due, called once per round of the event loop
+	static void tick(pollable_map_t& fd_map);
+
+	// Resolves the address, throws when it can't be
+	void add_member(std::string const& address);
+	void build_ring(void);
+
+	// Returns the member for a request, nullptr when there are none.
+	// Members that are ejected or failed their health probe are only used when all of them are.
+	UpstreamMember* pick(std::string const& uri, std::string const& client_ip);
+	void report(UpstreamMember* member, Result result, double latency);
+	void probe_done(UpstreamMember* member, bool healthy);
+
+	std::string const& get_name(void) const;
+	std::vector<UpstreamMember> const& get_members(void) const;
+
+	public:
+	Policy policy;
+	size_t max_fails;
+	size_t fail_timeout;
+	size_t health_interval; // Seconds between health probes of a member, 0 for none
+	std::string health_check; // Uri requested by the probes, without one a probe only connects
+
+	private:
+	UpstreamMember* pick_round_robin(time_t now, bool available_only);
+	UpstreamMember* pick_least_conn(time_t now, bool available_only);
+	UpstreamMember* pick_hash(std::string const& key, time_t now, bool available_only);
+
+	private:
+	std::string name;
+	std::vector<UpstreamMember> members;
+	std::vector<std::pair<uint32_t, size_t>> ring; // Points on the hash ring and their member
+	size_t next; // Round robin position
+};
+
+// Checks one member of an upstream, the result goes to Upstream::probe_done()
+class HealthProbe : public Pollable
+{
+	public:
+	HealthProbe(std::shared_ptr<Upstream> const& upstream, UpstreamMember* member);
+	virtual ~HealthProbe();
+
+	private:
+	HealthProbe();
+	HealthProbe(HealthProbe const& other);
+	HealthProbe& operator=(HealthProbe const& other);
+
+	public:
+	virtual sockfd_t get_fd(void) const override;
+	virtual bool should_destroy(void) const override;
+	virtual short get_events(sockfd_t fd) const override;
+	virtual void on_post_poll(pollable_map_t& fd_map) override;
+
+	protected:
+	virtual void on_pollin(pollable_map_t& fd_map) override;
+	virtual void on_pollout(pollable_map_t& fd_map) override;
+	virtual void on_pollhup(pollable_map_t& fd_map, sockfd_t fd) override;
+
+	private:
+	void done(bool healthy);
+
+	private:
+	sockfd_t socket_fd;
+	std::shared_ptr<Upstream> upstream;
+	UpstreamMember* member;
+	std::string request;
+	size_t sent;
+	std::string response;
+	time_t deadline;
+	bool finished;
+};
+
+} // namespace webserv
+
+#endif // UPSTREAM_H
@@ -15,7 +15,8 @@ namespace data
 	ssize_t send(sockfd_t fd, std::vector<char> const& buffer);
 	ssize_t send(sockfd_t fd, std::string const& str);
 
-	bool send_file(sockfd_t fd, std::ifstream& istream, size_t buffer_size);
+	// sent_size is increased by the bytes that were sent
+	bool send_file(sockfd_t fd, std::ifstream& istream, size_t buffer_size, size_t& sent_size);
 } // namespace data
 
 } // namespace webserv
@@ -5,7 +5,32 @@
 
 namespace webserv {
 
-std::string build_index(std::string const& dir_path, std::string const& dir_name);
+// Amount of entries shown on a single page of a directory listing
+# define INDEX_PAGE_SIZE 1000
+// Amount of directories kept in the listing cache
+# define INDEX_CACHE_SIZE 64
+
+// Listing options taken from the query string:
+// ?sort=name|mtime|size&order=asc|desc&page=N&format=html|json
+struct IndexOptions
+{
+	enum Sort
+	{
+		NAME = 0,
+		MTIME,
+		SIZE
+	};
+
+	Sort sort;
+	bool reverse;
+	size_t page;
+	bool json;
+
+	IndexOptions();
+};
+
+IndexOptions parse_index_options(std::string const& query);
+std::string build_index(std::string const& dir_path, std::string const& dir_name, IndexOptions const& options = IndexOptions());
 
 } // webserv
 
@@ -2,13 +2,17 @@
 # define PARSING_H
 
 # include "njson/njson.h"
+# include "Config.h"
 # include "Server.h"
 # include "Socket.h"
 
 namespace webserv {
 
+bool parse_upstreams(njson::Json::pointer& root_node);
+bool parse_access_log(njson::Json::pointer& root_node, Config& config);
+bool parse_request_timing(njson::Json::pointer& root_node, Config& config);
 std::vector<std::unique_ptr<Server>> parse_servers(njson::Json::pointer& root_node);
-std::vector<std::unique_ptr<Socket>> build_sockets(std::vector<std::unique_ptr<Server>>& servers);
+std::vector<std::unique_ptr<Socket>> build_sockets(config_t const& config, std::vector<std::unique_ptr<Socket>>& previous);
 
 } // namespace webserv
 
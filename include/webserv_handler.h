@@ -0,0 +1,86 @@
+#ifndef WEBSERV_HANDLER_H
+# define WEBSERV_HANDLER_H
+
+/*
+** C ABI for handler modules, shared objects bound to a location with
+** "handler": "path/to/libfoo.so". A module runs inside the event loop, so it
+** must never block: work that has to wait is done in resume().
+**
+** The module exports webserv_handler_get(), returning its webserv_handler.
+** Responses are written like CGI output: header fields ("Status: 404 Not Found",
+** "Content-Type: text/plain", ...), an empty line and the body. Without a
+** Content-Length the body is sent chunked, or the connection closes at its end.
+*/
+
+# include <stddef.h>
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+# define WEBSERV_HANDLER_ABI_VERSION 1
+
+/* Return values of body() and resume() */
+# define WEBSERV_HANDLER_OK 0		/* Not done yet */
+# define WEBSERV_HANDLER_DONE 1		/* The response is complete */
+# define WEBSERV_HANDLER_ERROR -1	/* 500 when nothing was written yet, the response is cut off otherwise */
+
+typedef struct webserv_header
+{
+	char const* name; /* lowercase */
+	char const* value;
+} webserv_header;
+
+/* Valid until end() */
+typedef struct webserv_request
+{
+	char const* method;
+	char const* path;
+	char const* query;
+	char const* http_version;
+	char const* client_ip;
+	char const* location; /* Path of the location the handler is bound to */
+	webserv_header const* headers;
+	size_t header_count;
+	size_t content_length;
+} webserv_request;
+
+typedef struct webserv_output
+{
+	void* context;
+	/* Appends to the response, callable from begin(), body() and resume() */
+	void (*write)(void* context, char const* data, size_t size);
+} webserv_output;
+
+typedef struct webserv_handler
+{
+	unsigned int abi_version; /* WEBSERV_HANDLER_ABI_VERSION */
+	char const* name;
+
+	/* Once when the module is loaded, non-zero stops the server from starting. Optional. */
+	int (*init)(void);
+
+	/* A new request, the returned pointer is passed to the other calls */
+	void* (*begin)(webserv_request const* request, webserv_output* output);
+
+	/* Each part of the request body, then once with size 0 when all of it was received */
+	int (*body)(void* state, char const* data, size_t size, webserv_output* output);
+
+	/* Every round of the event loop once the body was received and the response
+	** isn't done yet. Optional, handlers without it are done after body(). */
+	int (*resume)(void* state, webserv_output* output);
+
+	/* The request ended (or the client is gone), release the state */
+	void (*end)(void* state);
+} webserv_handler;
+
+/* Name of the symbol the server looks up */
+# define WEBSERV_HANDLER_SYMBOL "webserv_handler_get"
+
+webserv_handler const* webserv_handler_get(void);
+
+# ifdef __cplusplus
+}
+# endif
+
+#endif /* WEBSERV_HANDLER_H */
@@ -0,0 +1,262 @@
+#include "AccessLog.h"
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <stdexcept>
+#include <sys/uio.h>
+
+namespace webserv {
+
+static AccessLog* s_log = nullptr;
+
+std::atomic<size_t> AccessLog::s_dropped(0);
+
+AccessLog::AccessLog(std::string const& path, Format format, size_t buffer_size)
+:	path(path),
+	format(format),
+	fd(-1),
+	ring(buffer_size),
+	head(0),
+	tail(0),
+	reopening(false),
+	stopping(false),
+	line_second(0)
+{
+	if (buffer_size == 0)
+		throw (std::runtime_error("access_log buffer_size can't be 0"));
+	fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+		throw (std::runtime_error("Can't open access_log " + path + ": " + strerror(errno)));
+	line_time[0] = '\0';
+
+	// Signals are handled by the event loop: the thread starts with all of them blocked,
+	// SIGCHLD in particular has to stay blocked for the signalfd of the Reaper
+	sigset_t all;
+	sigset_t previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	writer = std::thread(&AccessLog::run, this);
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+AccessLog::~AccessLog()
+{
+	stopping = true;
+	writer.join();
+	::close(fd);
+}
+
+// Unused
+AccessLog::AccessLog() : fd(-1) {}
+AccessLog::AccessLog(AccessLog const& other) : fd(-1) { (void)other; }
+AccessLog& AccessLog::operator=(AccessLog const& other) { (void)other; return *this; }
+//END
+
+void AccessLog::configure(std::string const& path, Format format, size_t buffer_size)
+{
+	if (s_log != nullptr && s_log->path == path && s_log->format == format && s_log->ring.size() == buffer_size)
+		return ;
+	// Opened before the running log stops, a path that can't be opened leaves it running
+	AccessLog* log = path.empty() ? nullptr : new AccessLog(path, format, buffer_size);
+	close();
+	s_log = log;
+}
+
+void AccessLog::reopen(void)
+{
+	if (s_log != nullptr)
+		s_log->reopening = true;
+}
+
+void AccessLog::close(void)
+{
+	delete s_log;
+	s_log = nullptr;
+}
+
+void AccessLog::log(Entry const& entry)
+{
+	if (s_log == nullptr)
+		return ;
+	s_log->format_line(entry);
+	s_log->push();
+}
+
+size_t AccessLog::get_dropped(void) { return (s_dropped); }
+
+static std::string const& find_field(Request const& request, char const* name)
+{
+	static std::string const none;
+	auto it = request.fields.find(name);
+	return (it == request.fields.end() ? none : it->second);
+}
+
+// Quotes, backslashes and control characters are escaped ("\x22" in the combined format,
+// "\u0022" in JSON), so a field can't end early or start a new line
+static void append_escaped(std::string& out, std::string const& value, AccessLog::Format format)
+{
+	for (unsigned char c : value)
+	{
+		if (c == '"' || c == '\\' || c < 0x20 || c == 0x7f)
+		{
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), format == AccessLog::JSON ? "\\u%04x" : "\\x%02X", c);
+			out += escaped;
+		}
+		else
+			out += static_cast<char>(c);
+	}
+}
+
+void AccessLog::format_line(Entry const& entry)
+{
+	time_t now = std::time(nullptr);
+	if (now != line_second)
+	{
+		struct tm local;
+		localtime_r(&now, &local);
+		strftime(line_time, sizeof(line_time), format == JSON ? "%Y-%m-%dT%H:%M:%S%z" : "%d/%b/%Y:%H:%M:%S %z", &local);
+		line_second = now;
+	}
+
+	Request const& request = entry.request;
+	std::string const& referer = find_field(request, "referer");
+	std::string const& user_agent = find_field(request, "user-agent");
+	line.clear();
+	if (format == JSON)
+	{
+		char duration[32];
+		snprintf(duration, sizeof(duration), "%.3f", entry.duration);
+		line += "{\"time\":\"";
+		line += line_time;
+		line += "\",\"remote_addr\":\"";
+		line += entry.ip;
+		line += "\",\"host\":\"";
+		append_escaped(line, find_field(request, "host"), format);
+		line += "\",\"method\":\"";
+		line += get_request_string(request.type);
+		line += "\",\"uri\":\"";
+		append_escaped(line, entry.uri, format);
+		if (!request.path_arguments.empty())
+		{
+			line += '?';
+			append_escaped(line, request.path_arguments, format);
+		}
+		line += "\",\"protocol\":\"";
+		append_escaped(line, request.http_version, format);
+		line += "\",\"status\":";
+		line += entry.status.empty() ? "0" : entry.status;
+		line += ",\"body_bytes\":";
+		line += std::to_string(entry.body_size);
+		line += ",\"referer\":\"";
+		append_escaped(line, referer, format);
+		line += "\",\"user_agent\":\"";
+		append_escaped(line, user_agent, format);
+		line += "\",\"duration_ms\":";
+		line += duration;
+		line += "}\n";
+		return ;
+	}
+
+	// ip - - [time] "request line" status bytes "referer" "user agent"
+	line += entry.ip;
+	line += " - - [";
+	line += line_time;
+	line += "] \"";
+	line += get_request_string(request.type);
+	line += ' ';
+	append_escaped(line, entry.uri, format);
+	if (!request.path_arguments.empty())
+	{
+		line += '?';
+		append_escaped(line, request.path_arguments, format);
+	}
+	line += ' ';
+	append_escaped(line, request.http_version, format);
+	line += "\" ";
+	line += entry.status.empty() ? "-" : entry.status;
+	line += ' ';
+	line += std::to_string(entry.body_size);
+	line += " \"";
+	if (referer.empty())
+		line += '-';
+	append_escaped(line, referer, format);
+	line += "\" \"";
+	if (user_agent.empty())
+		line += '-';
+	append_escaped(line, user_agent, format);
+	line += "\"\n";
+}
+
+// Only called by the event loop
+void AccessLog::push(void)
+{
+	size_t capacity = ring.size();
+	size_t position = head.load(std::memory_order_relaxed);
+	size_t used = position - tail.load(std::memory_order_acquire);
+	if (line.size() > capacity - used)
+	{
+		s_dropped.fetch_add(1, std::memory_order_relaxed);
+		return ;
+	}
+	size_t start = position % capacity;
+	size_t first = std::min(line.size(), capacity - start);
+	std::memcpy(ring.data() + start, line.data(), first);
+	std::memcpy(ring.data(), line.data() + first, line.size() - first);
+	head.store(position + line.size(), std::memory_order_release);
+}
+
+// The writer thread
+void AccessLog::run(void)
+{
+	while (true)
+	{
+		if (reopening.exchange(false))
+			open_file();
+		bool stop = stopping;
+		if (write_pending() > 0)
+			continue ;
+		if (stop)
+			break ;
+		std::this_thread::sleep_for(std::chrono::milliseconds(ACCESS_LOG_WRITE_INTERVAL));
+	}
+}
+
+// Everything in the ring, in one writev() (two parts when it wraps around)
+size_t AccessLog::write_pending(void)
+{
+	size_t capacity = ring.size();
+	size_t position = tail.load(std::memory_order_relaxed);
+	size_t size = head.load(std::memory_order_acquire) - position;
+	if (size == 0)
+		return (0);
+
+	size_t start = position % capacity;
+	struct iovec iov[2];
+	int count = 1;
+	iov[0] = {ring.data() + start, std::min(size, capacity - start)};
+	if (size > iov[0].iov_len)
+		iov[count++] = {ring.data(), size - iov[0].iov_len};
+
+	ssize_t written = writev(fd, iov, count);
+	if (written < 0 && errno == EINTR)
+		return (1);
+	// The lines are lost when the file can't be written, the ring keeps moving
+	if (written < 0)
+		written = size;
+	tail.store(position + written, std::memory_order_release);
+	return (written);
+}
+
+// After a rotation the path is a new file, the old one is closed once the new one is open
+void AccessLog::open_file(void)
+{
+	int new_fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (new_fd == -1)
+		return ;
+	::close(fd);
+	fd = new_fd;
+}
+
+} // namespace webserv
@@ -0,0 +1,63 @@
+#include "Address.h"
+#include "Core.h"
+
+#include <netdb.h>
+#include <stdexcept>
+#include <sys/un.h>
+
+namespace webserv {
+
+// Addresses by their text in the config, a reload resolves them again
+static std::unordered_map<std::string, Address> s_addresses;
+
+int Address::get_family(void) const { return (storage.ss_family); }
+
+addr_t const* Address::get_addr(void) const { return (reinterpret_cast<addr_t const*>(&storage)); }
+
+Address const& Address::resolve(std::string const& address)
+{
+	Address resolved = {};
+
+	if (address.compare(0, 5, "unix:") == 0)
+	{
+		struct sockaddr_un addr = {};
+		std::string path = address.substr(5);
+		if (path.empty() || path.size() >= sizeof(addr.sun_path))
+			throw (std::runtime_error("Invalid socket path: " + address));
+		addr.sun_family = AF_UNIX;
+		std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+		std::memcpy(&resolved.storage, &addr, sizeof(addr));
+		resolved.length = sizeof(addr);
+	}
+	else
+	{
+		size_t pos = address.find_last_of(':');
+		if (pos == std::string::npos || pos == 0)
+			throw (std::runtime_error("Invalid address: " + address));
+		struct addrinfo hints = {};
+		struct addrinfo* info = nullptr;
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_NUMERICSERV;
+		int error = getaddrinfo(address.substr(0, pos).c_str(), address.substr(pos + 1).c_str(), &hints, &info);
+		if (error != 0)
+			throw (std::runtime_error(address + ": " + gai_strerror(error)));
+		std::memcpy(&resolved.storage, info->ai_addr, info->ai_addrlen);
+		resolved.length = info->ai_addrlen;
+		freeaddrinfo(info);
+	}
+
+	Address& stored = s_addresses[address];
+	stored = resolved;
+	return (stored);
+}
+
+Address const& Address::get(std::string const& address)
+{
+	auto it = s_addresses.find(address);
+	if (it != s_addresses.end())
+		return (it->second);
+	return (resolve(address));
+}
+
+} // namespace webserv
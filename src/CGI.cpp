@@ -1,161 +1,200 @@
 #include "CGI.h"
 #include "Core.h"
+#include "Log.h"
+#include "Metrics.h"
 #include "Pollable.h"
+#include "Reaper.h"
+#include <algorithm>
+#include <csignal>
 #include <cstring>
+#include <spawn.h>
 #include <stdexcept>
 #include <unistd.h>
 
+// posix_spawn_file_actions_addchdir_np() exists since glibc 2.29 (and macOS 10.15)
+#ifdef __GLIBC__
+# if !__GLIBC_PREREQ(2, 29)
+#  define CGI_SPAWN_TRAMPOLINE
+# endif
+#endif
+
 namespace webserv {
 
 namespace env
 {
 
-	std::vector<std::string> initialize(void)
+	Arena::Arena(void)
 	{
-		static std::vector<std::string> env = {
-			"AUTH_TYPE", "CONTENT_LENGTH", "CONTENT_TYPE", "GATEWAY_INTERFACE",
-			"PATH_INFO", "PATH_TRANSLATED", "QUERY_STRING", "REMOTE_ADDR",
-			"REMOTE_HOST", "REMOTE_IDENT", "REMOTE_USER", "REQUEST_METHOD",
-			"SCRIPT_NAME", "SERVER_NAME", "SERVER_PROTOCOL", "SERVER_SOFTWARE",
-			"UPLOAD_DIRECTORY"
-		};
-
-		if (env[0].back() != '=')
-		{
-			for(auto& s : env) s += '=';
-		}
-		return (env);
+		buffer.reserve(ENV_ARENA_SIZE);
+		offsets.reserve(ENV_MAX_VARS);
+		pointers.reserve(ENV_MAX_VARS + 1);
 	}
 
-	bool set_value(std::vector<std::string>& env, std::string const& var, std::string const& value)
+	void Arena::clear(void)
 	{
-		for(size_t i = 0; i < env.size(); i ++) {
-			if (env[i].substr(0,env[i].find('=')) == var)
-			{
-				env[i] = var + "=" + value;
-				return true;
-			}
-		}
-		return false;
+		buffer.clear();
+		offsets.clear();
 	}
 
-	void to_string_array(char ** env_array, std::vector<std::string> &env)
+	void Arena::set_value(char const* var, std::string const& value)
 	{
-		for(size_t i = 0; i < env.size(); i++)
-		{
-			env_array[i] = (char *) env[i].c_str();
-		}
-		env_array[env.size()] = NULL;
+		offsets.push_back(buffer.size());
+		buffer.insert(buffer.end(), var, var + std::strlen(var));
+		buffer.push_back('=');
+		buffer.insert(buffer.end(), value.begin(), value.end());
+		buffer.push_back('\0');
 	}
 
-	void print(std::vector<std::string> const& env){
-		for(size_t i = 0; i < env.size(); i++) {
-			std::cout << env[i] << std::endl;
-		}
+	size_t Arena::size(void) const
+	{
+		return (offsets.size());
+	}
+
+	char const* Arena::get(size_t index) const
+	{
+		return (buffer.data() + offsets[index]);
+	}
+
+	char** Arena::data(void)
+	{
+		pointers.clear();
+		for (size_t offset : offsets)
+			pointers.push_back(buffer.data() + offset);
+		pointers.push_back(NULL);
+		return (pointers.data());
+	}
+
+	void Arena::print(void) const
+	{
+		for (size_t i = 0; i < size(); i++)
+			std::cout << get(i) << std::endl;
 	}
 
 } // namespace env
 
-CGI::CGI(std::vector<std::string>& env, Server& server, Location& loc, std::string const& path) : destroy(false)
+static void set_cloexec(int fd)
+{
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		throw std::runtime_error(std::string {"CGI failed to set FD_CLOEXEC on the pipes "} + strerror(errno));
+}
+
+// The CGI is started with posix_spawn(), which doesn't copy the page tables of the server
+// like fork() does. The working directory is changed by a file action of the spawn.
+// With a stdin_fd (a spooled body) there is no input pipe, the CGI reads the file itself.
+CGI::CGI(env::Arena& env, Server const& server, Location const& loc, std::string const& path, int stdin_fd) : splicing_out(false), in_blocked(false), abort_time(0), destroy(false)
 {
-	std::cout << "Lauching new CGI" << std::endl;
+	LOG_DEBUG("Lauching new CGI");
 	//setting up the pipes
 
-	if(pipe(pipes.in) == -1)
+	pipes.in[0] = -1;
+	pipes.in[1] = -1;
+	if(stdin_fd < 0 && pipe(pipes.in) == -1)
 		throw std::runtime_error(std::string {"CGI::CGI() failed create pipe "} + strerror(errno));
 	if (pipe(pipes.out) == -1)
+	{
+		close(pipes.in[0]);
+		close(pipes.in[1]);
 		throw std::runtime_error(std::string {"CGI::CGI() failed create pipe "} + strerror(errno));
+	}
 
-	open_in = true;
+	open_in = (stdin_fd < 0);
 	open_out = true;
 	erase_in = false;
 	erase_out = false;
 
-	pid = fork();
-	if(pid < 0)
-		// Fork unavailable THROW, needs to be caught
-		throw std::runtime_error(std::string {"CGI::CGI() failed to fork: "} + strerror(errno) );
+	std::string cgi_path = server.get_root(loc) + server.get_cgi(loc, path).first;
+	std::string cgi_exec = cgi_path.substr(cgi_path.find_last_of('/') + 1);
+	cgi_path = cgi_path.substr(0, cgi_path.find_last_of('/'));
 
-	// Child process directly turns into the CGI and becomes unavailable until completed
-	if(pid == 0) // child process
+	int error = 0;
+	try
 	{
-		// Handle pipes
-		if (dup2(pipes.in[0], STDIN_FILENO) == -1)
+		// None of the pipes should leak into other CGIs, dup2() clears the flag for stdin/stdout
+		if (open_in)
 		{
-			std::cerr << strerror(errno) << std::endl;
-			std::string status = "status: 500 Internal Server Error\r\n";
-			std::cout << status << std::endl;
-			exit(1);
+			set_cloexec(pipes.in[0]);
+			set_cloexec(pipes.in[1]);
 		}
-		close(pipes.in[0]);
-		close(pipes.in[1]);
-		
-		if (dup2(pipes.out[1], STDOUT_FILENO) == -1)
-		{
-			std::cerr << strerror(errno) << std::endl;
-			std::string status = "status: 500 Internal Server Error\r\n";
-			std::cout << status << std::endl;
-			exit(1);
+		set_cloexec(pipes.out[0]);
+		set_cloexec(pipes.out[1]);
+
+		if(open_in && fcntl(pipes.in[1], F_SETFL, O_NONBLOCK) == -1){
+			throw std::runtime_error(std::string {"CGI failed to set the pipes to Non_block"} + strerror(errno));
+		}
+		if(fcntl(pipes.out[0], F_SETFL, O_NONBLOCK) == -1){
+			throw std::runtime_error(std::string {"CGI failed to set the pipes to Non_block"} + strerror(errno));
 		}
-		close(pipes.out[1]);
-		close(pipes.out[0]);
 
-		// Build char** out of array
-		char* env_array[env.size() + 1];
-		env::to_string_array(env_array, env);
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, open_in ? pipes.in[0] : stdin_fd, STDIN_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, pipes.out[1], STDOUT_FILENO);
 
-		// Build argv
+		std::string exec_path = cgi_exec;
 		std::vector<char*> exec_argv;
-
-		std::string cgi_path = server.get_root(loc) + server.get_cgi(loc, path).first;
-		std::string cgi_exec = cgi_path.substr(cgi_path.find_last_of('/') + 1);
-		cgi_path = cgi_path.substr(0, cgi_path.find_last_of('/'));
-
-		// Build argv
-		exec_argv.push_back(strdup(cgi_exec.c_str()));
+#ifdef CGI_SPAWN_TRAMPOLINE
+		// No posix_spawn_file_actions_addchdir_np(), let a shell change directory before the exec
+		std::string shell_command = "cd \"$0\" && exec \"./$1\"";
+		exec_path = "/bin/sh";
+		exec_argv.push_back(const_cast<char*>("sh"));
+		exec_argv.push_back(const_cast<char*>("-c"));
+		exec_argv.push_back(const_cast<char*>(shell_command.c_str()));
+		exec_argv.push_back(const_cast<char*>(cgi_path.c_str()));
+#else
+		posix_spawn_file_actions_addchdir_np(&actions, cgi_path.c_str());
+#endif
+		exec_argv.push_back(const_cast<char*>(cgi_exec.c_str()));
 		exec_argv.push_back(NULL);
 
-		// CHange directory
-		if (chdir(cgi_path.c_str()) != 0)
-		{
-			std::cerr << strerror(errno) << std::endl;
-			std::string status = "status: 500 Internal Server Error\r\n";
-			std::cout << status << std::endl;
-			exit(1);
-		}
-
-		// Actual execution
-		if(execve(exec_argv[0], exec_argv.data(), env_array) != 0)
-		{
-			std::string status = "status: 500 Internal Server Error\r\n";
-			std::cout << status << std::endl;
-			std::cerr << "CGI (" << pipes.in[1] << ", " << pipes.out[0] <<") execve error \"" << strerror(errno) << "\", sending internal server error" << std::endl;
-			for (auto* p : exec_argv)
-				free(p);
-			exit(1);
-		}
+		// The server blocks SIGCHLD (see Reaper), the CGI starts with no signals blocked
+		posix_spawnattr_t attributes;
+		posix_spawnattr_init(&attributes);
+		sigset_t mask;
+		sigemptyset(&mask);
+		posix_spawnattr_setsigmask(&attributes, &mask);
+		posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+		error = posix_spawn(&pid, exec_path.c_str(), &actions, &attributes, exec_argv.data(), env.data());
+		posix_spawn_file_actions_destroy(&actions);
+		posix_spawnattr_destroy(&attributes);
 	}
-	if (pid > 0) //parent process
+	catch (std::exception& e)
 	{
-		if(fcntl(pipes.in[1], F_SETFL, O_NONBLOCK) == -1){
-			throw std::runtime_error(std::string {"CGI failed to set the pipes to Non_block"} + strerror(errno));
-		}
-		if(fcntl(pipes.out[0], F_SETFL, O_NONBLOCK) == -1){
-			throw std::runtime_error(std::string {"CGI failed to set the pipes to Non_block"} + strerror(errno));
-		}
-	
-		close(pipes.in[0]);
-		close(pipes.out[1]);
+		close_pipe_ends();
+		throw ;
 	}
+
+	// The child has its own copies now
+	close(pipes.in[0]);
+	close(pipes.out[1]);
+
+	if (error != 0)
+	{
+		close(pipes.in[1]);
+		close(pipes.out[0]);
+		throw std::runtime_error(std::string {"CGI::CGI() failed to spawn "} + cgi_exec + ": " + strerror(error));
+	}
+	Reaper::watch(pid);
+	start_time = std::chrono::steady_clock::now();
+	++Metrics::get().cgi_spawns;
+}
+
+void CGI::close_pipe_ends(void)
+{
+	close(pipes.in[0]);
+	close(pipes.in[1]);
+	close(pipes.out[0]);
+	close(pipes.out[1]);
 }
 
 CGI::~CGI()
 {
-	std::cerr << "deleting CGI (" << pipes.in[1] << ", " << pipes.out[0] << ')' << std::endl;
+	LOG_DEBUG("deleting CGI (" << pipes.in[1] << ", " << pipes.out[0] << ')');
 	if (open_in)
 		close(pipes.in[1]);
 	if (open_out)
 		close(pipes.out[0]);
+	Reaper::forget(pid);
 }
 
 sockfd_t CGI::get_fd(void) const
@@ -185,9 +224,9 @@ int CGI::get_out_fd(void) const
 short CGI::get_events(sockfd_t fd) const
 {
 	short events = POLLHUP;
-	if (fd == pipes.out[0] && open_out && buffer_out.empty())
+	if (fd == pipes.out[0] && open_out && buffer_out.empty() && !splicing_out)
 		events |= POLLIN;
-	else if (fd == pipes.in[1] && open_in && !buffer_in.empty())
+	else if (fd == pipes.in[1] && open_in && (!buffer_in.empty() || in_blocked))
 		events |= POLLOUT;
 	return (events);
 }
@@ -196,15 +235,13 @@ short CGI::get_events(sockfd_t fd) const
 void CGI::on_pollin(pollable_map_t& fd_map)
 {
 	(void)fd_map;
-#ifdef DEBUG
-	std::cout << "CGI::on_pollin (" << pipes.in[1] << ", " << pipes.out[0] << ')' << std::endl;
-#endif
+	LOG_DEBUG("CGI::on_pollin (" << pipes.in[1] << ", " << pipes.out[0] << ')');
 
 	buffer_out.resize(MAX_SEND_BUFFER_SIZE);
 	ssize_t read_size = read(pipes.out[0], buffer_out.data(), MAX_SEND_BUFFER_SIZE);
-	if (read_size < 0)
+	if (read_size <= 0)
 		buffer_out.clear();
-	else if (read_size == 0)
+	if (read_size == 0)
 		close_out(fd_map);
 	else if (static_cast<size_t>(read_size) != MAX_SEND_BUFFER_SIZE)
 		buffer_out.resize(read_size);
@@ -214,28 +251,31 @@ void CGI::on_pollin(pollable_map_t& fd_map)
 void CGI::on_pollout(pollable_map_t& fd_map)
 {
 	(void)fd_map;
-#ifdef DEBUG
-	std::cout << "CGI::on_pollout (" << pipes.in[1] << ", " << pipes.out[0] << ')' << std::endl;
-#endif
+	LOG_DEBUG("CGI::on_pollout (" << pipes.in[1] << ", " << pipes.out[0] << ')');
+
+	// The pipe has room again for the spliced body
+	if (in_blocked && pending_in_size() == 0)
+	{
+		in_blocked = false;
+		return ;
+	}
 
 	// Write body buffer to CGI
-	ssize_t write_size = write(pipes.in[1], buffer_in.data(), buffer_in.size());
+	ssize_t write_size = write(pipes.in[1], pending_in(), pending_in_size());
 	if (write_size == 0)
 		close_in(fd_map);
 	else if (write_size < 0)
 		return ;
 
 	if (write_size > 0)
-		buffer_in.erase(buffer_in.begin(), buffer_in.begin() + write_size);
+		consume_in(write_size);
 }
 
 void CGI::close_in(pollable_map_t& fd_map)
 {
 	if (!open_in)
 		return;
-#ifdef DEBUG
-	std::cout << "CGI::close_in (" << pipes.in[1] << ", " << pipes.out[0] << ") closing IN" << std::endl;
-#endif
+	LOG_DEBUG("CGI::close_in (" << pipes.in[1] << ", " << pipes.out[0] << ") closing IN");
 	fd_map.erase(pipes.in[1]);
 	close(pipes.in[1]);
 	open_in = false;
@@ -245,9 +285,7 @@ void CGI::close_out(pollable_map_t& fd_map)
 {
 	if (!open_out)
 		return;
-#ifdef DEBUG
-	std::cout << "CGI::close_out (" << pipes.in[1] << ", " << pipes.out[0] << ") closing OUT" << std::endl;
-#endif
+	LOG_DEBUG("CGI::close_out (" << pipes.in[1] << ", " << pipes.out[0] << ") closing OUT");
 	fd_map.erase(pipes.out[0]);
 	close(pipes.out[0]);
 	open_out = false;
@@ -261,19 +299,98 @@ void CGI::close_pipes(pollable_map_t& fd_map)
 
 void CGI::on_pollhup(pollable_map_t& fd_map, sockfd_t fd)
 {
-#ifdef DEBUG
-	std::cout << "CGI::on_pollhup (" << pipes.in[1] << ", " << pipes.out[0] << ')' << std::endl;
-#endif
+	LOG_DEBUG("CGI::on_pollhup (" << pipes.in[1] << ", " << pipes.out[0] << ')');
 
 	if (fd == pipes.in[1])
 		close_in(fd_map);
-	if (fd == pipes.out[0])
+	// The CGI may have exited with output still in the pipe, read it before closing
+	if (fd == pipes.out[0] && buffer_out.empty() && !splicing_out)
+		on_pollin(fd_map);
+}
+
+#ifdef __linux__
+
+bool CGI::can_splice(void) const
+{
+	return (true);
+}
+
+// Move request body from the client socket straight into the stdin pipe of the CGI
+ssize_t CGI::splice_from(sockfd_t fd, size_t size)
+{
+	if (!open_in)
+	{
+		errno = EPIPE;
+		return (-1);
+	}
+	ssize_t result = ::splice(fd, NULL, pipes.in[1], NULL, std::min(size, static_cast<size_t>(CGI_SPLICE_SIZE)),
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	in_blocked = (result < 0 && errno == EAGAIN);
+	return (result);
+}
+
+// Move CGI output from the stdout pipe straight into the client socket.
+// From here on the pipe isn't read into buffer_out anymore.
+ssize_t CGI::splice_to(sockfd_t fd, pollable_map_t& fd_map)
+{
+	if (!open_out)
+		return (0);
+	splicing_out = true;
+	ssize_t size = ::splice(pipes.out[0], NULL, fd, NULL, CGI_SPLICE_SIZE,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+	if (size == 0)
 		close_out(fd_map);
+	return (size);
+}
+
+bool CGI::is_input_blocked(void) const
+{
+	return (open_in && in_blocked);
 }
 
+#endif
+
 bool CGI::should_destroy(void) const
 {
 	return (false);
 }
 
+bool CGI::is_output_closed(void) const
+{
+	return (!open_out);
+}
+
+// The exit of the child is collected by the Reaper
+bool CGI::finish(pollable_map_t& fd_map)
+{
+	int wstatus;
+	if (!Reaper::has_exited(pid, wstatus))
+	{
+		// The CGI ignored SIGTERM
+		if (abort_time != 0 && std::time(nullptr) - abort_time >= CGI_KILL_TIMEOUT)
+			::kill(pid, SIGKILL);
+		return (false);
+	}
+	close_pipes(fd_map);
+	Metrics& metrics = Metrics::get();
+	metrics.cgi_duration.record(std::chrono::steady_clock::now() - start_time);
+	if (WIFSIGNALED(wstatus) || WEXITSTATUS(wstatus) != 0)
+		++metrics.cgi_failures;
+	if (WIFSIGNALED(wstatus))
+		LOG_DEBUG("CGI finished execution, killed by signal: " << WTERMSIG(wstatus));
+	else
+		LOG_DEBUG("CGI finished execution, exitcode: " << WEXITSTATUS(wstatus));
+	return (true);
+}
+
+void CGI::abort(pollable_map_t& fd_map)
+{
+	close_pipes(fd_map);
+	if (abort_time != 0)
+		return ;
+	// Kill with SIGTERM because otherwise some CGI's will take too long (or get stuck on cgi.FieldStorage())
+	::kill(pid, SIGTERM);
+	abort_time = std::time(nullptr);
+}
+
 } // namespace webserv
@@ -0,0 +1,394 @@
+#include "CGICache.h"
+#include "Connection.h"
+#include "Core.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#ifdef __linux__
+# include <sys/sendfile.h>
+#endif
+
+namespace webserv {
+
+namespace
+{
+	std::unordered_map<std::string, std::shared_ptr<CacheEntry const>> s_entries;
+	size_t s_memory_size = 0; // Size of the bodies in memory
+
+	// Keys with a CGI run that's being collected, and the connections waiting for it
+	std::unordered_map<std::string, std::vector<Connection*>> s_filling;
+	std::unordered_map<std::string, time_t> s_pass; // Keys with uncacheable responses, until when
+
+	void erase_entry(std::unordered_map<std::string, cache_entry_t>::iterator it)
+	{
+		if (it->second->file.empty())
+			s_memory_size -= it->second->body_size;
+		s_entries.erase(it);
+	}
+
+	// Make room for an entry: expired entries go first, then the ones closest to expiring
+	void evict(size_t memory_size)
+	{
+		time_t now = std::time(nullptr);
+		if (s_entries.size() >= CGI_CACHE_SIZE || s_memory_size + memory_size > CGI_CACHE_MEMORY_SIZE)
+		{
+			for (auto it = s_entries.begin(); it != s_entries.end();)
+			{
+				auto next = std::next(it);
+				if (it->second->expires <= now)
+					erase_entry(it);
+				it = next;
+			}
+		}
+		while (s_entries.size() >= CGI_CACHE_SIZE || s_memory_size + memory_size > CGI_CACHE_MEMORY_SIZE)
+		{
+			// When only the memory is short, spilled bodies don't free any
+			bool memory_only = s_entries.size() < CGI_CACHE_SIZE;
+			auto victim = s_entries.end();
+			for (auto it = s_entries.begin(); it != s_entries.end(); ++it)
+			{
+				if (memory_only && !it->second->file.empty())
+					continue ;
+				if (victim == s_entries.end() || it->second->expires < victim->second->expires)
+					victim = it;
+			}
+			if (victim == s_entries.end())
+				break ;
+			erase_entry(victim);
+		}
+	}
+
+	// Bounded like the entries, expired keys go first, then the ones closest to expiring
+	void add_pass(std::string const& key, time_t until)
+	{
+		if (s_pass.size() >= CGI_CACHE_SIZE && s_pass.count(key) == 0)
+		{
+			time_t now = std::time(nullptr);
+			for (auto it = s_pass.begin(); it != s_pass.end();)
+				it = (it->second <= now) ? s_pass.erase(it) : std::next(it);
+			if (s_pass.size() >= CGI_CACHE_SIZE)
+				s_pass.erase(std::min_element(s_pass.begin(), s_pass.end(),
+					[](std::pair<std::string const, time_t> const& a, std::pair<std::string const, time_t> const& b)
+					{ return (a.second < b.second); }));
+		}
+		s_pass[key] = until;
+	}
+
+	// Returns the ttl from the Cache-Control of the CGI, 0 when it may not be stored
+	size_t parse_cache_control(std::string value, size_t ttl)
+	{
+		std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+		std::stringstream stream(value);
+		std::string directive;
+		bool shared_age = false;
+
+		while (std::getline(stream, directive, ','))
+		{
+			directive.erase(0, directive.find_first_not_of(" \t"));
+			directive.erase(directive.find_last_not_of(" \t") + 1);
+
+			if (directive == "no-store" || directive == "no-cache" || directive == "private")
+				return (0);
+			bool is_shared = (directive.compare(0, 9, "s-maxage=") == 0);
+			if ((directive.compare(0, 8, "max-age=") == 0 && !shared_age) || is_shared)
+			{
+				try { ttl = std::stoul(directive.substr(directive.find('=') + 1)); }
+				catch (std::exception& e) { return (0); }
+				shared_age = shared_age || is_shared; // s-maxage wins for a shared cache
+			}
+		}
+		return (ttl);
+	}
+}
+
+CacheEntry::CacheEntry() : body_size(0), expires(0) {}
+
+CacheEntry::~CacheEntry()
+{
+	if (!file.empty())
+		(void)unlink(file.c_str());
+}
+
+// FILL
+
+CacheFill::CacheFill(std::string const& key, Location const& loc)
+:	key(key),
+	directory(loc.cgi_cache_directory),
+	ttl(loc.cgi_cache),
+	entry(new CacheEntry()),
+	content_length(SIZE_MAX),
+	file_fd(-1),
+	ready(false),
+	failed(false),
+	filling(true) {}
+
+CacheFill::~CacheFill()
+{
+	if (file_fd >= 0)
+		close(file_fd);
+	release();
+}
+
+// The waiting connections look the key up again once they're polled
+void CacheFill::release(void)
+{
+	if (!filling)
+		return ;
+	filling = false;
+	auto it = s_filling.find(key);
+	if (it == s_filling.end())
+		return ;
+	std::vector<Connection*> waiting;
+	waiting.swap(it->second);
+	s_filling.erase(it);
+	for (Connection* connection : waiting)
+		connection->cache_filled();
+}
+
+bool CacheFill::set_header(std::unordered_map<std::string, std::string> const& fields)
+{
+	auto status = fields.find("status");
+	auto cache_control = fields.find("cache-control");
+	size_t entry_ttl = (cache_control == fields.end()) ? ttl : parse_cache_control(cache_control->second, ttl);
+
+	// Errors, responses for one client only and ones the CGI doesn't want stored.
+	// Requests for the key won't wait on each other until the ttl of the location has passed.
+	if ((status != fields.end() && status->second.compare(0, 3, "200") != 0)
+		|| fields.count("set-cookie") != 0
+		|| entry_ttl == 0)
+	{
+		add_pass(key, std::time(nullptr) + ttl);
+		return (false);
+	}
+	ttl = entry_ttl;
+
+	auto it = fields.find("content-length");
+	if (it != fields.end())
+	{
+		try { content_length = std::stoul(it->second); }
+		catch (std::exception& e)
+		{
+			add_pass(key, std::time(nullptr) + ttl);
+			return (false);
+		}
+	}
+
+	it = fields.find("content-type");
+	entry->content_type = (it != fields.end()) ? it->second : "text/plain";
+	if (status != fields.end())
+		entry->status = status->second;
+
+	// Replayed like the CGI sent them, the framing is up to the response
+	static std::set<std::string> const framing_fields {
+		"status", "content-type", "content-length", "connection", "keep-alive", "transfer-encoding", "server", "date"
+	};
+	for (auto const& field : fields)
+	{
+		if (framing_fields.count(field.first) == 0)
+			entry->fields.push_back(field);
+	}
+	ready = true;
+	return (true);
+}
+
+// Move the body into a file in the cache directory
+bool CacheFill::spill(void)
+{
+	if (directory.empty())
+		return (false);
+
+	std::string path = directory + "/webserv-cache-XXXXXX";
+	file_fd = mkstemp(&path[0]);
+	if (file_fd < 0)
+	{
+		std::cerr << "CacheFill::spill(): " << strerror(errno) << std::endl;
+		return (false);
+	}
+	entry->file = path; // The entry removes the file from now on
+	if (write(file_fd, entry->body.data(), entry->body.size()) != static_cast<ssize_t>(entry->body.size()))
+		return (false);
+	std::string().swap(entry->body);
+	return (true);
+}
+
+void CacheFill::append(char const* data, size_t size)
+{
+	if (!ready || failed)
+		return ;
+
+	entry->body_size += size;
+	if (file_fd < 0 && entry->body_size > CGI_CACHE_SPILL_SIZE && !spill())
+		failed = true;
+	else if (file_fd < 0)
+		entry->body.append(data, size);
+	else if (write(file_fd, data, size) != static_cast<ssize_t>(size))
+		failed = true;
+	// Too large without a cache directory, or a write error: the key isn't waited for anymore
+	if (failed)
+		add_pass(key, std::time(nullptr) + ttl);
+}
+
+void CacheFill::commit(void)
+{
+	if (!ready || failed)
+		return ;
+	if (content_length != SIZE_MAX && content_length != entry->body_size)
+	{
+		add_pass(key, std::time(nullptr) + ttl);
+		return ;
+	}
+
+	entry->expires = std::time(nullptr) + ttl;
+	evict(entry->file.empty() ? entry->body_size : 0);
+	if (entry->file.empty())
+		s_memory_size += entry->body_size;
+	s_entries[key] = entry;
+	s_pass.erase(key);
+	ready = false;
+	release();
+}
+
+// CACHED RESPONSE
+
+CachedResponse::CachedResponse(cache_entry_t const& entry)
+:	entry(entry),
+	file_fd(-1),
+	offset(0)
+{
+	if (!entry->file.empty())
+	{
+		file_fd = open(entry->file.c_str(), O_RDONLY | O_CLOEXEC);
+		if (file_fd < 0)
+			throw std::runtime_error(std::string("CachedResponse(): ") + strerror(errno));
+	}
+
+	std::string header;
+	if (!entry->status.empty())
+		header += "Status: " + entry->status + "\r\n";
+	for (auto const& field : entry->fields)
+		header += field.first + ": " + field.second + "\r\n";
+	header += "Content-Type: " + entry->content_type + "\r\n"
+		+ "Content-Length: " + std::to_string(entry->body_size) + "\r\n\r\n";
+	buffer_out.assign(header.begin(), header.end());
+}
+
+CachedResponse::~CachedResponse()
+{
+	if (file_fd >= 0)
+		close(file_fd);
+}
+
+CachedResponse::CachedResponse() : file_fd(-1), offset(0) {}
+CachedResponse::CachedResponse(CachedResponse const& other) : Gateway(), file_fd(-1), offset(0) { (void)other; }
+CachedResponse& CachedResponse::operator=(CachedResponse const& other) { (void)other; return *this; }
+
+bool CachedResponse::is_output_closed(void) const { return (offset >= entry->body_size); }
+
+bool CachedResponse::finish(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	return (true);
+}
+
+void CachedResponse::abort(pollable_map_t& fd_map) { (void)fd_map; }
+
+bool CachedResponse::can_splice(void) const { return (true); }
+
+ssize_t CachedResponse::splice_to(sockfd_t fd, pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	size_t size = std::min(entry->body_size - offset, static_cast<size_t>(MAX_SEND_BUFFER_SIZE));
+	if (size == 0)
+		return (0);
+
+	ssize_t moved;
+	if (file_fd < 0)
+		moved = ::send(fd, entry->body.data() + offset, size, 0);
+	else
+	{
+#ifdef __linux__
+		off_t file_offset = offset;
+		moved = sendfile(fd, file_fd, &file_offset, size);
+#else
+		char buffer[MAX_SEND_BUFFER_SIZE];
+		moved = pread(file_fd, buffer, size, offset);
+		if (moved > 0)
+			moved = ::send(fd, buffer, moved, 0);
+#endif
+	}
+	if (moved <= 0)
+		return (-1);
+	offset += moved;
+	return (moved);
+}
+
+// CACHE
+
+std::string cgi_cache::make_key(Request const& request, Location const& loc)
+{
+	std::string key = get_request_string(request.type);
+	auto host = request.fields.find("host");
+	key += '\n';
+	if (host != request.fields.end())
+		key += host->second;
+	key += '\n' + request.path + '?' + request.path_arguments;
+	for (std::string const& name : loc.cgi_cache_key_headers)
+	{
+		auto it = request.fields.find(name);
+		key += '\n' + name + ':';
+		if (it != request.fields.end())
+			key += it->second;
+	}
+	return (key);
+}
+
+cache_entry_t cgi_cache::find(std::string const& key)
+{
+	auto it = s_entries.find(key);
+	if (it == s_entries.end())
+		return (nullptr);
+	if (it->second->expires <= std::time(nullptr))
+	{
+		erase_entry(it);
+		return (nullptr);
+	}
+	return (it->second);
+}
+
+bool cgi_cache::is_pass(std::string const& key)
+{
+	auto it = s_pass.find(key);
+	if (it == s_pass.end())
+		return (false);
+	if (it->second <= std::time(nullptr))
+	{
+		s_pass.erase(it);
+		return (false);
+	}
+	return (true);
+}
+
+CacheFill* cgi_cache::begin_fill(std::string const& key, Location const& loc)
+{
+	if (!s_filling.emplace(key, std::vector<Connection*>()).second)
+		return (nullptr);
+	return (new CacheFill(key, loc));
+}
+
+void cgi_cache::wait(std::string const& key, Connection* connection)
+{
+	s_filling[key].push_back(connection);
+}
+
+void cgi_cache::cancel_wait(std::string const& key, Connection* connection)
+{
+	auto it = s_filling.find(key);
+	if (it == s_filling.end())
+		return ;
+	auto waiting = std::find(it->second.begin(), it->second.end(), connection);
+	if (waiting != it->second.end())
+		it->second.erase(waiting);
+}
+
+} // namespace webserv
@@ -0,0 +1,80 @@
+#include "CGIQueue.h"
+#include "Connection.h"
+#include "Core.h"
+
+#include <algorithm>
+
+namespace webserv {
+
+static std::map<std::string, std::unique_ptr<CGIQueue>> s_queues;
+
+CGIQueue::CGIQueue(std::string const& name, size_t max_concurrent, size_t queue_size)
+:	name(name),
+	max_concurrent(max_concurrent),
+	queue_size(queue_size),
+	running(0),
+	rejected(0) {}
+
+CGIQueue::CGIQueue(CGIQueue const& other) { (void)other; }
+CGIQueue& CGIQueue::operator=(CGIQueue const& other) { (void)other; return *this; }
+
+// One queue per location of a server, named after the listen address and the location
+CGIQueue& CGIQueue::get(Server const& server, Location const& loc)
+{
+	std::string name = server.host + ':' + std::to_string(server.port) + loc.name;
+	if (!server.server_names.empty())
+		name = server.server_names.front() + '@' + name;
+
+	auto it = s_queues.find(name);
+	if (it == s_queues.end())
+		it = s_queues.emplace(name, std::unique_ptr<CGIQueue>(
+			new CGIQueue(name, loc.cgi_max_concurrent, loc.cgi_queue_size))).first;
+	// A reload may have changed the limits, the running CGIs and the waiting requests are kept
+	it->second->max_concurrent = loc.cgi_max_concurrent;
+	it->second->queue_size = loc.cgi_queue_size;
+	return (*it->second);
+}
+
+std::map<std::string, std::unique_ptr<CGIQueue>> const& CGIQueue::get_all(void) { return (s_queues); }
+
+CGIQueue::Admission CGIQueue::admit(Connection* connection)
+{
+	if (running < max_concurrent)
+	{
+		++running;
+		return (RUN);
+	}
+	if (waiting.size() < queue_size)
+	{
+		waiting.push_back(connection);
+		return (QUEUED);
+	}
+	++rejected;
+	return (REJECTED);
+}
+
+void CGIQueue::release(void)
+{
+	if (waiting.empty())
+	{
+		--running;
+		return ;
+	}
+	Connection* next = waiting.front();
+	waiting.pop_front();
+	next->admit_cgi();
+}
+
+void CGIQueue::cancel(Connection* connection)
+{
+	auto it = std::find(waiting.begin(), waiting.end(), connection);
+	if (it != waiting.end())
+		waiting.erase(it);
+}
+
+std::string const& CGIQueue::get_name(void) const { return (name); }
+size_t CGIQueue::get_running(void) const { return (running); }
+size_t CGIQueue::get_queued(void) const { return (waiting.size()); }
+size_t CGIQueue::get_rejected(void) const { return (rejected); }
+
+} // namespace webserv
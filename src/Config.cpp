@@ -0,0 +1,12 @@
+#include "Config.h"
+
+namespace webserv {
+
+Config::Config()
+:	generation(0),
+	access_log_format(AccessLog::COMBINED),
+	access_log_buffer_size(ACCESS_LOG_DEFAULT_BUFFER_SIZE),
+	slow_request_threshold(0),
+	server_timing(false) {}
+
+} // namespace webserv
@@ -1,26 +1,59 @@
 #include "Connection.h"
 #include "CGI.h"
 #include "Core.h"
+#include "Log.h"
+#include "AccessLog.h"
+#include "CGIQueue.h"
+#include "FastCGI.h"
+#include "Handler.h"
+#include "Metrics.h"
+#include "Spool.h"
+#include "Upload.h"
+#include "Proxy.h"
 #include "Request.h"
 #include "Socket.h"
 #include "data.h"
 #include "html.h"
 
 #include <csignal>
+#include <cstdio>
+#include <sys/uio.h>
 
 namespace webserv {
 
+// Requests since the start, each one gets the next as its id
+static uint64_t s_request_count = 0;
+
 // CONSTRUCTORS
 Connection::Connection(sockfd_t connection_fd, addr_t address, Socket* parent)
 :	socket_fd(connection_fd),
 	address(address),
 	parent(parent),
-	state(READY_TO_READ) { reset_time_remaining(); }
+	state(READY_TO_READ),
+	idle_start(std::chrono::steady_clock::now()),
+	requests(0)
+{
+	parent->add_connection();
+	++Metrics::get().connections_accepted;
+	reset_time_remaining();
+}
 
 // Unused
 Connection::~Connection()
 {
-	std::cout << '(' << socket_fd << "): " << "Connection closed and destroyed." << std::endl;
+	LOG_DEBUG('(' << socket_fd << "): " << "Connection closed and destroyed.");
+	// Give up the place in (or the slot of) the CGI queue
+	if (handler_data.cgi_queued)
+		handler_data.cgi_queue->cancel(this);
+	else
+		release_cgi_slot();
+	if (handler_data.cache_waiting)
+		cgi_cache::cancel_wait(handler_data.cache_key, this);
+	report_upstream(Upstream::CANCELLED);
+	Metrics& metrics = Metrics::get();
+	++metrics.connections_closed;
+	metrics.bytes_sent += handler_data.body_sent; // Of a response that wasn't finished
+	parent->remove_connection();
 	close(socket_fd);
 }
 
@@ -30,37 +63,179 @@ Connection& Connection::operator=(Connection const& other) { (void)other; return
 //END
 
 Connection::HandlerData::HandlerData()
-:	content_size(0),
+:	custom_page_offset(0),
+	content_size(0),
 	received_size(0),
-	cgi(nullptr) {}
+	gateway(nullptr),
+	splice(false),
+	splicing_out(false),
+	chunked(false),
+	cache_waiting(false),
+	cache_woken(false),
+	server(nullptr),
+	location(nullptr),
+	cgi_queue(nullptr),
+	cgi_queued(false),
+	cgi_admitted(false),
+	spooling(false),
+	gateway_deadline(0),
+	expect_continue(false),
+	linger(false),
+	linger_deadline(0),
+	lingered(0),
+	pass_error_body(false),
+	upstream(nullptr),
+	upstream_member(nullptr),
+	upstream_tries(0),
+	body_sent(0),
+	request_id(0),
+	phases() {}
+
+Connection::Chunk::Chunk()
+:	head_size(0),
+	head_left(0),
+	data_left(0),
+	tail_left(0),
+	last(false) {}
 
 void Connection::reset_time_remaining(void)
 {
 	last_time = std::time(nullptr);
 }
 
+// Called by the CGIQueue when a slot is free for this queued request
+void Connection::admit_cgi(void)
+{
+	handler_data.cgi_queued = false;
+	handler_data.cgi_admitted = true;
+}
+
+// Called by the CacheFill this request waits for, once its response is cached or the CGI run is over
+void Connection::cache_filled(void)
+{
+	handler_data.cache_waiting = false;
+	handler_data.cache_woken = true;
+}
+
+// Delete the gateway once it has finished, its CGI slot goes to the next request
+void Connection::release_gateway(pollable_map_t& fd_map)
+{
+	if (!handler_data.gateway->finish(fd_map))
+		return ;
+	// The client can't tell a cut off response from a complete one (chunked), so it's closed
+	if (handler_data.gateway->is_truncated() && state == WRITING)
+		state = CLOSE;
+	delete handler_data.gateway;
+	handler_data.gateway = nullptr;
+	release_cgi_slot();
+	report_upstream(Upstream::CANCELLED);
+}
+
+void Connection::release_cgi_slot(void)
+{
+	if (handler_data.cgi_queue == nullptr)
+		return ;
+	handler_data.cgi_queue->release();
+	handler_data.cgi_queue = nullptr;
+}
+
+// The address of a member when address names an upstream
+std::string const& Connection::pick_upstream(std::string const& address)
+{
+	std::shared_ptr<Upstream> upstream = Upstream::find(address);
+	if (upstream == nullptr)
+		return (address);
+
+	Request const& request = handler_data.current_request;
+	std::string uri = request.path_arguments.empty() ? request.path : request.path + '?' + request.path_arguments;
+	UpstreamMember* member = upstream->pick(uri, get_ip());
+	if (member == nullptr)
+		throw (std::runtime_error("No servers in upstream " + address));
+
+	handler_data.upstream = upstream;
+	handler_data.upstream_member = member;
+	handler_data.upstream_start = std::chrono::steady_clock::now();
+	return (member->address);
+}
+
+// Tell the upstream how its member did, once per picked member
+void Connection::report_upstream(Upstream::Result result)
+{
+	if (handler_data.upstream_member == nullptr)
+		return ;
+	std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - handler_data.upstream_start;
+	handler_data.upstream->report(handler_data.upstream_member, result, latency.count());
+	handler_data.upstream_member = nullptr;
+}
+
+// The member ended without a response, a request without a body can go to another member.
+// Returns true when the request runs again.
+bool Connection::retry_upstream(pollable_map_t& fd_map)
+{
+	if (handler_data.upstream_member == nullptr || handler_data.content_size != 0
+		|| !handler_data.current_response.status_code.empty()
+		|| ++handler_data.upstream_tries >= handler_data.upstream->get_members().size())
+		return (false);
+
+	LOG_INFO('(' << socket_fd << "): " << "Upstream " << handler_data.upstream->get_name()
+		<< ": no response from " << handler_data.upstream_member->address << ", trying another server");
+	report_upstream(Upstream::FAILURE);
+	(void)handler_data.gateway->finish(fd_map);
+	delete handler_data.gateway;
+	handler_data.gateway = nullptr;
+
+	new_request_cgi(fd_map);
+	return (handler_data.gateway != nullptr);
+}
+
 void Connection::on_post_poll(pollable_map_t& fd_map)
 {
-	if (handler_data.cgi != nullptr 
-		&& ((handler_data.cgi->get_out_fd() == -1 && handler_data.cgi->buffer_out.empty()) || state == CLOSE))
+	size_t curr_time = std::time(nullptr);
+
+	// Handler modules run here, they have no descriptors to be polled for
+	if (handler_data.gateway != nullptr && state != CLOSE)
+		handler_data.gateway->on_post_poll(fd_map);
+
+	// The CGI ran into cgi_timeout, answer 504 unless part of the response has been sent
+	if (handler_data.gateway != nullptr && handler_data.gateway_deadline != 0
+		&& static_cast<time_t>(curr_time) >= handler_data.gateway_deadline)
 	{
-		int wstatus;
-		int rpid = waitpid(handler_data.cgi->get_pid(), &wstatus, WNOHANG);
-		if (rpid > 0)
+		LOG_INFO('(' << socket_fd << "): " << "CGI timed out");
+		handler_data.gateway_deadline = 0;
+		report_upstream(Upstream::FAILURE);
+		handler_data.gateway->abort(fd_map);
+		handler_data.gateway->buffer_out.clear();
+		if (state == READING || state == READY_TO_WRITE)
 		{
-			handler_data.cgi->close_pipes(fd_map);
-			delete handler_data.cgi;
-			handler_data.cgi = nullptr;
-			std::cout << "CGI finished execution, exitcode: " << WEXITSTATUS(wstatus) << std::endl;
+			if (state == READING)
+			{
+				handler_data.current_request.fields["connection"] = "close"; // The rest of the body isn't read
+				handler_data.linger = true;
+			}
+			handler_data.cache_fill.reset();
+			handler_data.current_response.set_status_code("504");
+			state = READY_TO_WRITE;
 		}
+		else
+			state = CLOSE;
 	}
 
+	if (handler_data.gateway != nullptr && state == CLOSE)
+		handler_data.gateway->abort(fd_map);
+
+	// The gateway is only released once its output has been turned into a response
+	if (handler_data.gateway != nullptr 
+		&& ((handler_data.gateway->is_output_closed() && handler_data.gateway->buffer_out.empty() && state == WRITING)
+			|| state == CLOSE))
+		release_gateway(fd_map);
+
 	if (state == CLOSE) return ;
 
-	size_t curr_time = std::time(nullptr);
-	if (curr_time - last_time >= CONNECTION_LIFETIME)
+	if (state == LINGERING && static_cast<time_t>(curr_time) >= handler_data.linger_deadline)
+		state = CLOSE;
+	else if (curr_time - last_time >= CONNECTION_LIFETIME)
 	{
-		std::cout << '(' << socket_fd << "): " << "Connection closing due to timeout" << std::endl;
+		LOG_DEBUG('(' << socket_fd << "): " << "Connection closing due to timeout");
 		state = CLOSE;
 	}
 }
@@ -68,19 +243,10 @@ void Connection::on_post_poll(pollable_map_t& fd_map)
 void Connection::on_pollhup(pollable_map_t& fd_map, sockfd_t fd)
 {
 	(void)fd_map; (void)fd;
-	if (handler_data.cgi != nullptr)
-	{
-		handler_data.cgi->close_pipes(fd_map);
-		// Kill with SIGTERM because otherwise some CGI's will take too long (or get stuck on cgi.FieldStorage())
-		::kill(handler_data.cgi->get_pid(), SIGTERM);
-		int wstatus;
-		int rpid = waitpid(handler_data.cgi->get_pid(), &wstatus, WNOHANG);
-		if (rpid > 0)
-		{
-			delete handler_data.cgi;
-			handler_data.cgi = nullptr;
-			std::cout << '(' << socket_fd << "): " << "CGI SIGTERM exit, exitcode: " << WEXITSTATUS(wstatus) << std::endl;
-		}
+	if (handler_data.gateway != nullptr)
+	{
+		handler_data.gateway->abort(fd_map);
+		release_gateway(fd_map);
 	}
 	// Set self to close, so the connection can be closed by an external observer
 	state = CLOSE;
@@ -93,6 +259,7 @@ void Connection::on_pollin(pollable_map_t& fd_map)
 	{
 		case READY_TO_READ: new_request(fd_map); break;
 		case READING: continue_request(); break;
+		case LINGERING: linger(); break;
 		default: return;
 	}
 }
@@ -102,7 +269,7 @@ void Connection::on_pollout(pollable_map_t& fd_map)
 	// Send response OR continue sending response
 	switch (state)
 	{
-		case READY_TO_WRITE: new_response(); break;
+		case READY_TO_WRITE: new_response(fd_map); break;
 		case WRITING: continue_response(fd_map); break;
 		default: return;
 	}
@@ -112,46 +279,63 @@ short Connection::get_events(sockfd_t fd) const
 {
 	(void)fd;
 	short events = POLLHUP;
+	// Nothing to do until the CGIQueue admits the request, or the CacheFill it waits for is done
+	if (handler_data.cgi_queued || handler_data.cache_waiting)
+		return (events);
 	if (state == READY_TO_WRITE || state == WRITING)
 		events |= POLLOUT;
-	else if (state == READING || state == READY_TO_READ)
+	// The gateway polls for room for the body instead
+	else if (state == READING && handler_data.gateway != nullptr && handler_data.gateway->is_input_blocked())
+		return (events);
+	else if (state == READING || state == READY_TO_READ || state == LINGERING)
 		events |= POLLIN;
 	return (events);
 }
 
-// Build cgi-environment and lauch the cgi
-void Connection::new_request_cgi(pollable_map_t& fd_map)
+// Build the cgi-environment, shared by CGI and FastCGI.
+// The arena is reused for every request, it's consumed right away by the spawn or the FastCGI params.
+env::Arena& Connection::build_cgi_env(Server const& serv, Location const& loc)
 {
-	std::cout << '(' << socket_fd << "): " << "New CGI request" << std::endl;
-
-	Server& serv = parent->get_server(handler_data.current_request.fields["host"]);
-	Location loc = serv.get_location(handler_data.current_request.path);
+	static env::Arena env;
+	env.clear();
 
 	auto cgi_pair = serv.get_cgi(loc, handler_data.current_request.path);
+	// Without CGI extensions the whole path is the script of a FastCGI application
+	if (cgi_pair.first.empty())
+		cgi_pair.first = handler_data.current_request.path;
+
+	auto const& fields = handler_data.current_request.fields;
+	auto content_length = fields.find("content-length");
+	auto content_type = fields.find("content-type");
+
+	env.set_value("AUTH_TYPE", "");
+	env.set_value("CONTENT_LENGTH", content_length != fields.end() ? content_length->second : "");
+	env.set_value("CONTENT_TYPE", content_type != fields.end() ? content_type->second : "");
+	env.set_value("GATEWAY_INTERFACE", "CGI/1.1");
+	env.set_value("PATH_INFO", cgi_pair.second);
+	env.set_value("PATH_TRANSLATED",  serv.get_root(loc) + cgi_pair.second);
+	env.set_value("QUERY_STRING", handler_data.current_request.path_arguments);
+	env.set_value("REMOTE_ADDR", get_ip());
+	env.set_value("REMOTE_HOST", get_ip());
+	env.set_value("REMOTE_IDENT", ""); // UNUSED
+	env.set_value("REMOTE_USER", ""); // UNUSED
+	env.set_value("REQUEST_METHOD", get_request_string(handler_data.current_request.type));
+	env.set_value("SCRIPT_FILENAME", serv.get_root(loc) + cgi_pair.first);
+	env.set_value("SCRIPT_NAME", cgi_pair.first);
+	env.set_value("SERVER_NAME", "webserv");
+	env.set_value("SERVER_PROTOCOL", "HTTP/1.1");
+	env.set_value("SERVER_SOFTWARE", "webserv");
+	env.set_value("UPLOAD_DIRECTORY", serv.get_upload_dir(loc));
+	return (env);
+}
 
-	std::vector<std::string> env = env::initialize();
-	auto it = handler_data.current_request.fields.find("content-length");
-	if (it != handler_data.current_request.fields.end())
-		env::set_value(env, "CONTENT_LENGTH", it->second);
+// Build cgi-environment and lauch the cgi (or hand the request to the FastCGI application, upstream or handler module)
+void Connection::new_request_cgi(pollable_map_t& fd_map)
+{
+	LOG_DEBUG('(' << socket_fd << "): " << "New CGI request");
 
-	if (handler_data.current_request.fields.find("content-type") != handler_data.current_request.fields.end())
-		env::set_value(env, "CONTENT_TYPE", handler_data.current_request.fields["content-type"]);
-	
-	env::set_value(env, "GATEWAY_INTERFACE", "CGI/1.1");
-	env::set_value(env, "SERVER_NAME", "webserv");
-	env::set_value(env, "SERVER_PROTOCOL", "HTTP/1.1");
-	env::set_value(env, "SERVER_SOFTWARE", "webserv");
-	env::set_value(env, "REQUEST_METHOD", get_request_string(handler_data.current_request.type));
-	env::set_value(env, "UPLOAD_DIRECTORY", serv.get_upload_dir(loc));
-	env::set_value(env, "REMOTE_ADDR", get_ip());
-	env::set_value(env, "REMOTE_HOST", get_ip());
-	env::set_value(env, "SCRIPT_NAME", cgi_pair.first);
-	env::set_value(env, "PATH_INFO", cgi_pair.second);
-	env::set_value(env, "PATH_TRANSLATED",  serv.get_root(loc) + cgi_pair.second);
-	env::set_value(env, "QUERY_STRING", handler_data.current_request.path_arguments);
-
-	// env::set_value(env, "REMOTE_USER", "TeamWebserv"); // UNUSED
-	// env::set_value(env, "REMOTE_IDENT", "TeamWebserv"); // UNUSED
+	Server& serv = *handler_data.server;
+	Location const& loc = *handler_data.location;
 
 	// No content length means no body to send to the CGI
 	if (handler_data.current_request.fields.find("content-length") == handler_data.current_request.fields.end())
@@ -168,25 +352,130 @@ void Connection::new_request_cgi(pollable_map_t& fd_map)
 		}
 	}
 
-	try { handler_data.cgi = new CGI(env, serv, loc, handler_data.current_request.path); }
-	catch (std::exception& e)
+	// Locations with cgi_max_concurrent need a slot first, or a place in line for one
+	if (loc.cgi_max_concurrent != 0 && handler_data.cgi_queue == nullptr)
 	{
-		std::cerr << '(' << socket_fd << "): " << "Connection::new_request_cgi(): " << e.what() << std::endl;
-		// delete handler_data.cgi;
-		handler_data.current_response.set_status_code("500");
-		return ;
+		CGIQueue& queue = CGIQueue::get(serv, loc);
+		CGIQueue::Admission admission = queue.admit(this);
+		if (admission == CGIQueue::REJECTED)
+		{
+			LOG_INFO('(' << socket_fd << "): " << "CGI queue of " << queue.get_name() << " is full");
+			handler_data.current_response.set_status_code("503");
+			handler_data.current_request.fields["connection"] = "close"; // The body isn't read
+			state = READY_TO_WRITE;
+			return ;
+		}
+		handler_data.cgi_queue = &queue;
+		if (admission == CGIQueue::QUEUED)
+		{
+			handler_data.cgi_queued = true;
+			state = READY_TO_WRITE;
+			return ;
+		}
 	}
 
-	handler_data.cgi->buffer_in = handler_data.buffer; // Push leftover buffer into the CGI buffer
-	handler_data.cgi->buffer_in.pop_back();
+	if (!serv.get_handler(loc).empty())
+	{
+		try
+		{
+			handler_data.gateway = new HandlerRequest(HandlerModule::get(serv.get_handler(loc)),
+				handler_data.current_request, loc, get_ip(), handler_data.content_size);
+		}
+		catch (std::exception& e)
+		{
+			std::cerr << '(' << socket_fd << "): " << "Connection::new_request_cgi(): " << e.what() << std::endl;
+			handler_data.current_response.set_status_code("500");
+			state = READY_TO_WRITE;
+			release_cgi_slot();
+			return ;
+		}
+	}
+	else if (!serv.get_proxy_pass(loc).empty())
+	{
+		try
+		{
+			std::string address, uri;
+			(void)proxy::parse_url(serv.get_proxy_pass(loc), address, uri);
+			handler_data.gateway = ProxyPool::get(pick_upstream(address)).new_request(
+				fd_map, proxy::build_head(handler_data.current_request, loc, get_ip()), loc.proxy_connections);
+		}
+		catch (std::exception& e)
+		{
+			std::cerr << '(' << socket_fd << "): " << "Connection::new_request_cgi(): " << e.what() << std::endl;
+			report_upstream(Upstream::FAILURE);
+			handler_data.current_response.set_status_code("502");
+			state = READY_TO_WRITE;
+			release_cgi_slot();
+			return ;
+		}
+	}
+	else if (!serv.get_fastcgi(loc).empty())
+	{
+		try
+		{
+			env::Arena& env = build_cgi_env(serv, loc);
+			handler_data.gateway = FastCGIPool::get(pick_upstream(serv.get_fastcgi(loc))).new_request(
+				fd_map, env, handler_data.content_size, loc.fastcgi_connections);
+		}
+		catch (std::exception& e)
+		{
+			std::cerr << '(' << socket_fd << "): " << "Connection::new_request_cgi(): " << e.what() << std::endl;
+			report_upstream(Upstream::FAILURE);
+			handler_data.current_response.set_status_code("502");
+			state = READY_TO_WRITE;
+			release_cgi_slot();
+			return ;
+		}
+	}
+	else if (loc.cgi_spool_threshold != 0 && handler_data.content_size > loc.cgi_spool_threshold)
+	{
+		// The body is read into a file first, the CGI is started by start_spooled_cgi()
+		std::string directory = loc.cgi_spool_directory.empty() ? P_tmpdir : loc.cgi_spool_directory;
+		try { handler_data.gateway = new Spool(directory, handler_data.content_size); }
+		catch (std::exception& e)
+		{
+			std::cerr << '(' << socket_fd << "): " << "Connection::new_request_cgi(): " << e.what() << std::endl;
+			handler_data.current_response.set_status_code("500");
+			state = READY_TO_WRITE;
+			release_cgi_slot();
+			return ;
+		}
+		handler_data.spooling = true;
+	}
+	else
+	{
+		CGI* cgi;
+		try { cgi = new CGI(build_cgi_env(serv, loc), serv, loc, handler_data.current_request.path); }
+		catch (std::exception& e)
+		{
+			std::cerr << '(' << socket_fd << "): " << "Connection::new_request_cgi(): " << e.what() << std::endl;
+			++Metrics::get().cgi_failures;
+			handler_data.current_response.set_status_code("500");
+			state = READY_TO_WRITE;
+			release_cgi_slot();
+			return ;
+		}
+
+		// Add fds to map for polling
+		fd_map.insert({cgi->get_in_fd(), cgi});
+		fd_map.insert({cgi->get_out_fd(), cgi});
+		handler_data.gateway = cgi;
+	}
 
-	// Add fds to map for polling
-	fd_map.insert({handler_data.cgi->get_in_fd(), handler_data.cgi});
-	fd_map.insert({handler_data.cgi->get_out_fd(), handler_data.cgi});
+	if (!handler_data.spooling)
+		mark_phase(PHASE_GATEWAY);
+	if (loc.cgi_timeout != 0 && !handler_data.spooling)
+		handler_data.gateway_deadline = std::time(nullptr) + loc.cgi_timeout;
+
+	handler_data.gateway->buffer_in = handler_data.buffer; // Push leftover buffer into the CGI buffer
+	handler_data.gateway->buffer_in.pop_back();
+	// The response has to pass through the buffers to be collected for the cache
+	handler_data.splice = handler_data.spooling
+		|| (loc.cgi_splice && handler_data.gateway->can_splice() && !handler_data.cache_fill);
 
 	// Amount of data already received
-	handler_data.received_size = handler_data.cgi->buffer_in.size();
-	std::cout << '(' << socket_fd << "): " << "received data " << handler_data.received_size << '/' << handler_data.content_size << " - ";
+	handler_data.received_size = handler_data.gateway->buffer_in.size();
+	LOG_DEBUG('(' << socket_fd << "): " << "received data " << handler_data.received_size << '/' << handler_data.content_size);
 
 	// We received everything already, no need to continue READING
 	if (handler_data.received_size >= handler_data.content_size)
@@ -194,31 +483,180 @@ void Connection::new_request_cgi(pollable_map_t& fd_map)
 		state = READY_TO_WRITE;
 }
 
+// The whole body is in the spool file, it becomes the stdin of the CGI and the Spool goes away.
+// The client is done sending, however slowly the CGI reads it.
+void Connection::start_spooled_cgi(pollable_map_t& fd_map)
+{
+	Server& serv = *handler_data.server;
+	Location const& loc = *handler_data.location;
+	Spool* spool = static_cast<Spool*>(handler_data.gateway);
+
+	handler_data.spooling = false;
+	spool->on_post_poll(fd_map); // The part of the body that came with the header may still be in buffer_in
+	CGI* cgi = nullptr;
+	if (!spool->is_complete())
+		handler_data.current_response.set_status_code("500");
+	else
+	{
+		LOG_DEBUG('(' << socket_fd << "): " << "Body spooled, starting the CGI");
+		try { cgi = new CGI(build_cgi_env(serv, loc), serv, loc, handler_data.current_request.path, spool->get_fd()); }
+		catch (std::exception& e)
+		{
+			std::cerr << '(' << socket_fd << "): " << "Connection::start_spooled_cgi(): " << e.what() << std::endl;
+			++Metrics::get().cgi_failures;
+			handler_data.current_response.set_status_code("500");
+		}
+	}
+	delete spool; // The CGI has its own descriptor of the file
+	handler_data.gateway = cgi;
+	if (cgi == nullptr)
+	{
+		release_cgi_slot();
+		return ;
+	}
+
+	fd_map.insert({cgi->get_out_fd(), cgi});
+	mark_phase(PHASE_GATEWAY);
+	if (loc.cgi_timeout != 0)
+		handler_data.gateway_deadline = std::time(nullptr) + loc.cgi_timeout;
+	handler_data.splice = loc.cgi_splice && cgi->can_splice() && !handler_data.cache_fill;
+}
+
+// The request is accepted and its body is about to be read, a client that sent "Expect: 100-continue"
+// is told to go ahead. Nothing is sent when part of the body came without waiting for it.
+void Connection::send_continue(void)
+{
+	if (!handler_data.expect_continue || state != READING || handler_data.received_size != 0)
+		return ;
+	handler_data.expect_continue = false;
+
+	static char const response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+	if (send(socket_fd, response, sizeof(response) - 1, MSG_NOSIGNAL) < 0)
+		state = CLOSE;
+}
+
+// Discard what the client still sends of a rejected body, it has the response already.
+// Closing with unread data would reset the connection, possibly before the client read the response.
+void Connection::linger(void)
+{
+	char buffer[HTTP_HEADER_BUFFER_SIZE];
+	ssize_t size = recv(socket_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+	if (size > 0)
+	{
+		handler_data.lingered += size;
+		Metrics::get().bytes_received += size;
+	}
+	if (size == 0 || (size < 0 && errno != EAGAIN) || handler_data.lingered >= LINGER_MAX_SIZE)
+		state = CLOSE;
+}
+
+// Store the body in the upload_directory of the location, it's read straight from the socket.
+// A relative upload_directory is relative to the directory of the location, like it is for CGIs.
+void Connection::new_request_upload(Location const& loc)
+{
+	LOG_DEBUG('(' << socket_fd << "): " << "New upload");
+
+	if (handler_data.current_request.fields.count("content-length") == 0)
+	{
+		handler_data.current_response.set_status_code("411");
+		handler_data.current_request.fields["connection"] = "close"; // The body can't be told apart from the next request
+		state = READY_TO_WRITE;
+		return ;
+	}
+	handler_data.content_size = std::stoul(handler_data.current_request.fields["content-length"]);
+
+	std::string const& directory = loc.upload_path;
+
+	handler_data.gateway = new Upload(handler_data.current_request, loc, directory, handler_data.content_size);
+	handler_data.gateway->buffer_in = handler_data.buffer; // The part of the body that came with the header
+	handler_data.gateway->buffer_in.pop_back();
+	handler_data.splice = true;
+
+	handler_data.received_size = handler_data.gateway->buffer_in.size();
+	if (handler_data.received_size >= handler_data.content_size)
+		state = READY_TO_WRITE;
+}
+
+// Answer a GET for a CGI from the cgi_cache when possible. Returns false when the CGI has to run,
+// its response is then collected for the cache unless another request is already doing so.
+bool Connection::new_request_cached(Location const& loc)
+{
+	if (loc.cgi_cache == 0 || handler_data.current_request.type != GET)
+		return (false);
+
+	std::string key = cgi_cache::make_key(handler_data.current_request, loc);
+	cache_entry_t entry = cgi_cache::find(key);
+	if (entry)
+	{
+		try { handler_data.gateway = new CachedResponse(entry); }
+		catch (std::exception& e)
+		{
+			std::cerr << '(' << socket_fd << "): " << "Connection::new_request_cached(): " << e.what() << std::endl;
+			return (false);
+		}
+		LOG_DEBUG('(' << socket_fd << "): " << "CGI response from cache");
+		handler_data.splice = true;
+		state = READY_TO_WRITE;
+		return (true);
+	}
+	if (cgi_cache::is_pass(key))
+		return (false);
+
+	handler_data.cache_fill.reset(cgi_cache::begin_fill(key, loc));
+	if (handler_data.cache_fill)
+		return (false);
+
+	// Wait for the response of the other request instead of running the CGI again
+	handler_data.cache_waiting = true;
+	handler_data.cache_key = key;
+	cgi_cache::wait(key, this);
+	state = READY_TO_WRITE;
+	return (true);
+}
+
 // Request building
 void Connection::new_request(pollable_map_t& fd_map)
 {
 	reset_time_remaining();
-	// Initial request and response conditions
+	// Initial request and response conditions, with the newest config
 	state = READING;
 	handler_data = HandlerData();
 	handler_data.current_response = Response();
+	handler_data.config = parent->get_config();
+	handler_data.request_start = std::chrono::steady_clock::now();
+	handler_data.request_id = ++s_request_count;
+	++requests;
 
 	// receive the HTTP header
 	handler_data.buffer = data::receive(socket_fd, HTTP_HEADER_BUFFER_SIZE, [&]{
 		this->state = CLOSE;
 	});
+	Metrics& metrics = Metrics::get();
+	metrics.bytes_received += handler_data.buffer.size();
 	handler_data.current_request = request_build(handler_data.buffer);
+	++metrics.requests[handler_data.current_request.type];
+	handler_data.uri = handler_data.current_request.path;
+	mark_phase(PHASE_HEADER);
 
 	Server& server = parent->get_server(handler_data.current_request.fields["host"]);
-	Location loc = server.get_location(handler_data.current_request.path);
-
-	// Check for index page and alter path
-	if (handler_data.current_request.path.back() == '/')
+	Location const& loc = server.get_location(handler_data.current_request.path);
+
+	// Check for index page and alter path, the upstream of a proxy has its own.
+	// An upload to a directory gets a generated name instead.
+	handler_data.server = &server;
+	handler_data.location = &loc;
+	bool upload = (handler_data.current_request.type == POST || handler_data.current_request.type == PUT)
+		&& !server.get_upload_dir(loc).empty();
+	if (handler_data.current_request.path.back() == '/' && server.get_proxy_pass(loc).empty() && !upload)
 	{
 		std::string const& indexp = server.get_index_page(loc);
 		if (!indexp.empty())
+		{
 			handler_data.current_request.path += indexp;
+			handler_data.location = &server.get_location(handler_data.current_request.path);
+		}
 	}
+	mark_phase(PHASE_ROUTED);
 
 	// Get the content length for validation check
 	size_t content_length = 0;
@@ -230,19 +668,42 @@ void Connection::new_request(pollable_map_t& fd_map)
 
 	// Initial request validations
 	if (handler_data.current_request.validity == INVALID) handler_data.current_response.set_status_code("400");
-	else if (!server.is_http_command_allowed(get_request_string(handler_data.current_request.type), loc))
+	else if (!server.is_method_allowed(handler_data.current_request.type, loc))
 		handler_data.current_response.set_status_code("405");
 	else if ( std::set<std::string>{"HTTP/0.9", "HTTP/1.0", "HTTP/1.1"}.count(handler_data.current_request.http_version) == 0)
 		handler_data.current_response.set_status_code("505");
 	else if (server.get_client_max_body_size(loc) != 0 && content_length > server.get_client_max_body_size(loc))
 		handler_data.current_response.set_status_code("413");
 
+	// "100 Continue" is only sent once the request is accepted, HTTP/1.0 clients don't expect anything
+	auto expect = handler_data.current_request.fields.find("expect");
+	if (expect != handler_data.current_request.fields.end() && handler_data.current_request.http_version == "HTTP/1.1"
+		&& handler_data.current_response.status_code.empty())
+	{
+		if (strcasecmp(expect->second.c_str(), "100-continue") == 0)
+			handler_data.expect_continue = true;
+		else
+			handler_data.current_response.set_status_code("417");
+	}
+
 	// When there is no status response code
 	if (handler_data.current_response.status_code.empty())
 	{
 		// Build the CGI
 		auto cgi_pair = server.get_cgi(loc, handler_data.current_request.path);
-		if (!cgi_pair.first.empty())
+		// The counters of the server, answered by new_response_metrics()
+		if (handler_data.location->metrics)
+		{
+			state = READY_TO_WRITE;
+			if (handler_data.current_request.type != GET)
+				handler_data.current_response.set_status_code("405");
+		}
+		else if (!server.get_fastcgi(loc).empty() || !server.get_proxy_pass(loc).empty() || !server.get_handler(loc).empty())
+		{
+			if (!new_request_cached(loc))
+				new_request_cgi(fd_map);
+		}
+		else if (!cgi_pair.first.empty())
 		{
 			std::string cgi = server.get_root(loc) + cgi_pair.first;
 			if (data::get_file_size(cgi) == 0)
@@ -250,9 +711,12 @@ void Connection::new_request(pollable_map_t& fd_map)
 				handler_data.current_response.set_status_code("404");
 				state = READY_TO_WRITE;
 			}
-			else
+			else if (!new_request_cached(loc))
 				new_request_cgi(fd_map);
 		}
+		else if ((handler_data.current_request.type == POST || handler_data.current_request.type == PUT)
+			&& !server.get_upload_dir(loc).empty())
+			new_request_upload(loc);
 		else
 		{
 			state = READY_TO_WRITE;
@@ -260,7 +724,7 @@ void Connection::new_request(pollable_map_t& fd_map)
 			{
 				// Remove file
 				std::string to_remove = server.get_root(loc) + handler_data.current_request.path;
-				std::cout << "removing file: " << to_remove << std::endl;
+				LOG_DEBUG("removing file: " << to_remove);
 				if( ::remove(to_remove.c_str()) != 0 )
 				{
 					std::cerr << "Can't delete file: " << strerror(errno) << std::endl;
@@ -271,34 +735,63 @@ void Connection::new_request(pollable_map_t& fd_map)
 	}
 	else state = READY_TO_WRITE;
 
+	// Answered without reading the body, it can't be told apart from the next request
+	if (state == READY_TO_WRITE && handler_data.gateway == nullptr && !handler_data.cgi_queued
+		&& content_length > handler_data.buffer.size() - 1)
+	{
+		handler_data.current_request.fields["connection"] = "close";
+		handler_data.linger = true;
+	}
+	send_continue();
+
 	// Set last_request for debugging purposes
 	last_request = handler_data.current_request;
+	metrics.header_duration.record(std::chrono::steady_clock::now() - handler_data.request_start);
 
-	std::cout << '(' << socket_fd << "): "
+	LOG_DEBUG('(' << socket_fd << "): "
 		<< get_request_string(handler_data.current_request.type)
-		<< " request for: " << handler_data.current_request.path
-		<< std::endl;
+		<< " request for: " << handler_data.current_request.path);
 }
 
 void Connection::continue_request(void)
 {
-	if (handler_data.cgi == nullptr)
+	if (handler_data.gateway == nullptr)
 	{
-#ifdef DEBUG
-		std::cout << '(' << socket_fd << "): " << "CGI no longer exists." << std::endl;
-#endif
+		LOG_DEBUG('(' << socket_fd << "): " << "CGI no longer exists.");
 		state = CLOSE;
 		return ;
 	}
 
-	if (!handler_data.cgi->buffer_in.empty())
+	if (!handler_data.gateway->buffer_in.empty())
 		return ;
 
-	handler_data.cgi->buffer_in = data::receive(socket_fd, HTTP_HEADER_BUFFER_SIZE, [&](){
-		this->state = CLOSE;
-	});
+	if (handler_data.splice)
+	{
+		ssize_t size = handler_data.gateway->splice_from(socket_fd, handler_data.content_size - handler_data.received_size);
+		if (size < 0 && errno == EPIPE)
+		{
+			// The CGI closed its input or exited, the rest of the body isn't read
+			handler_data.current_request.fields["connection"] = "close";
+			handler_data.linger = true;
+			state = READY_TO_WRITE;
+			return ;
+		}
+		if (size == 0 || (size < 0 && errno != EAGAIN))
+			state = CLOSE;
+		if (size <= 0)
+			return ;
+		handler_data.received_size += size;
+		Metrics::get().bytes_received += size;
+	}
+	else
+	{
+		handler_data.gateway->buffer_in = data::receive(socket_fd, HTTP_HEADER_BUFFER_SIZE, [&](){
+			this->state = CLOSE;
+		});
 
-	handler_data.received_size += handler_data.cgi->buffer_in.size();
+		handler_data.received_size += handler_data.gateway->buffer_in.size();
+		Metrics::get().bytes_received += handler_data.gateway->buffer_in.size();
+	}
 
 	if (state == CLOSE)
 		return ;
@@ -343,48 +836,83 @@ std::string build_default_error_page(Response const& response)
 }
 
 // Response building
-void Connection::new_response(void)
+void Connection::new_response(pollable_map_t& fd_map)
 {
-	state = WRITING;
+	// Server and location were looked up by new_request()
+	Server& server = *handler_data.server;
+	Location const& loc = *handler_data.location;
+
+	// A CGI slot became free for this queued request
+	if (handler_data.cgi_admitted)
+	{
+		handler_data.cgi_admitted = false;
+		state = READING;
+		new_request_cgi(fd_map);
+		if (state != READY_TO_WRITE)
+		{
+			send_continue();
+			return ;
+		}
+	}
+
+	if (handler_data.spooling)
+		start_spooled_cgi(fd_map);
+
+	// Another request runs the CGI, once it's done the response is cached (or it has to run again)
+	if (handler_data.cache_woken)
+	{
+		handler_data.cache_woken = false;
+		if (!new_request_cached(loc))
+			new_request_cgi(fd_map);
+		if (state != READY_TO_WRITE || handler_data.cache_waiting)
+			return ;
+	}
+
+	if (handler_data.gateway != nullptr && handler_data.gateway->buffer_out.empty())
+	{
+		// Wait for the (rest of the) CGI header
+		if (!handler_data.gateway->is_output_closed())
+			return ;
+		// The gateway ended without a response, another server of the upstream may have one
+		if (retry_upstream(fd_map))
+			return ;
+		report_upstream(Upstream::FAILURE);
+		if (handler_data.current_response.status_code.empty())
+			handler_data.current_response.set_status_code("502");
+	}
+	report_upstream(Upstream::SUCCESS);
 
-	// Get the Server from host
-	Socket& socket = *parent;
-	Server& server = socket.get_server(handler_data.current_request.fields["host"]);
-	Location loc = server.get_location(handler_data.current_request.path);
+	state = WRITING;
 	
 	if (handler_data.current_response.status_code.empty() || handler_data.current_response.status_code == "200" || handler_data.current_response.status_code == "201")
 	{
 		if (!server.get_redirection(loc).empty())
 			new_response_redirect(server, loc);
+		else if (loc.metrics)
+			new_response_metrics(fd_map);
 		else if (handler_data.current_request.type == DELETE)
 			new_response_delete(server, loc);
 		else
 		{
-			if (handler_data.cgi != nullptr)
+			if (handler_data.gateway != nullptr)
 				new_response_cgi(server, loc);
 			else
 				new_response_get(server, loc);
 		}
 	}
 
-	if (handler_data.cgi != nullptr && handler_data.cgi->buffer_out.empty())
-	{
-		state = READY_TO_WRITE;
-		return ;
-	}
-
 	reset_time_remaining();
 
 	// In case of error-code
-	if (!handler_data.current_response.status_code.empty()
+	if (!handler_data.current_response.status_code.empty() && !handler_data.pass_error_body
 		&& handler_data.current_response.status_code.front() != '2' // Codes starting with 2 are OK etc
 		&& handler_data.current_response.status_code.front() != '3') // Codes starting with 3 are redirects
 	{
 		std::string error_path = server.get_error_page(std::stoi(handler_data.current_response.status_code), loc);
 		
-		std::cout << '(' << socket_fd << "): "
+		LOG_DEBUG('(' << socket_fd << "): "
 			<< "STATUS " << handler_data.current_response.status_code
-			<< " getting error page: {" + error_path << '}' << std::endl;
+			<< " getting error page: {" + error_path << '}');
 
 		handler_data.current_response.content_length = "0";
 		if (!error_path.empty())
@@ -422,11 +950,19 @@ void Connection::new_response(void)
 	if (!handler_data.current_response.content_type.empty())
 		handler_data.current_response.add_http_header("content-type", handler_data.current_response.content_type);
 
-	std::cout << '(' << socket_fd << "): "
-		<< "sending new response (" << handler_data.current_response.status_code << ')' << std::endl;
+	mark_phase(PHASE_RESPONSE_HEADER);
+	if (handler_data.config->server_timing)
+		handler_data.current_response.add_http_header("server-timing", format_phases(true));
+
+	LOG_DEBUG('(' << socket_fd << "): "
+		<< "sending new response (" << handler_data.current_response.status_code << ')');
 
 	// Send the response header
-	data::send(socket_fd, handler_data.current_response.get_response());
+	ssize_t header_sent = data::send(socket_fd, handler_data.current_response.get_response());
+	Metrics& metrics = Metrics::get();
+	if (header_sent > 0)
+		metrics.bytes_sent += header_sent;
+	metrics.first_byte_duration.record(std::chrono::microseconds(handler_data.phases[PHASE_RESPONSE_HEADER]));
 
 	// Set last_response for debugging purposes
 	last_response = handler_data.current_response;
@@ -438,22 +974,21 @@ void Connection::new_response_get(Server const& server, Location const& loc)
 	std::string const& root = server.get_root(loc);
 	std::string fpath = root + handler_data.current_request.path;
 
-#ifdef DEBUG
-	std::cout << "Connection::new_response_get" << std::endl;
-#endif
+	LOG_DEBUG("Connection::new_response_get");
 
 	// path is a directory
 	if (fpath.back() == '/')
 	{
 		if (server.is_auto_index_on(loc))
 		{
-			handler_data.custom_page = build_index(root + handler_data.current_request.path, handler_data.current_request.path);
+			IndexOptions options = parse_index_options(handler_data.current_request.path_arguments);
+			handler_data.custom_page = build_index(root + handler_data.current_request.path, handler_data.current_request.path, options);
 			if (handler_data.custom_page.empty())
 				handler_data.current_response.set_status_code("500");
 			else
 			{
 				handler_data.current_response.content_length = std::to_string(handler_data.custom_page.size());
-				handler_data.current_response.content_type = "text/html";
+				handler_data.current_response.content_type = options.json ? "application/json" : "text/html";
 			}
 		}
 		else
@@ -487,21 +1022,20 @@ void Connection::new_response_get(Server const& server, Location const& loc)
 void Connection::new_response_cgi(Server const& server, Location const& loc)
 {
 	(void)server; (void)loc;
-	if (handler_data.cgi->buffer_out.empty())
+	if (handler_data.gateway->buffer_out.empty())
 		return ;
 
-#ifdef DEBUG
-	std::cout << "Connection::new_response_cgi" << std::endl;
-#endif
+	LOG_DEBUG("Connection::new_response_cgi");
 
 	handler_data.current_response.content_type = "text/plain";
 
 	// parse into request
 	std::unordered_map<std::string, std::string> fields;
 
-	handler_data.cgi->buffer_out.push_back('\0');
-	std::stringstream buffer_stream(handler_data.cgi->buffer_out.data());
-	parse_header_fields(fields, handler_data.cgi->buffer_out, buffer_stream);
+	handler_data.gateway->buffer_out.push_back('\0');
+	std::stringstream buffer_stream(handler_data.gateway->buffer_out.data());
+	parse_header_fields(fields, handler_data.gateway->buffer_out, buffer_stream);
+	handler_data.gateway->buffer_out.pop_back(); // The null-termination is no part of the body
 
 	auto it= fields.find("status");
 	if (it != fields.end()) handler_data.current_response.set_status_code(it->second.substr(0, it->second.find_first_of(' ')));
@@ -509,16 +1043,61 @@ void Connection::new_response_cgi(Server const& server, Location const& loc)
 	it = fields.find("content-type");
 	if (it != fields.end()) handler_data.current_response.content_type = it->second;
 
+	// Error statuses get the error page instead of the CGI output, unless the gateway passes them on
+	std::string const& status = handler_data.current_response.status_code;
+	bool error_status = !status.empty() && status.front() != '2' && status.front() != '3';
+	if (error_status && !handler_data.gateway->intercept_errors())
+	{
+		handler_data.pass_error_body = true;
+		error_status = false;
+	}
+
+	// The other header fields go to the client, the server takes care of the framing itself
+	static std::set<std::string> const own_fields {
+		"status", "content-type", "content-length", "connection", "keep-alive", "transfer-encoding", "server", "date"
+	};
+	for (auto const& field : fields)
+	{
+		if (own_fields.count(field.first) == 0)
+			handler_data.current_response.add_http_header(field.first, field.second);
+	}
+
+	if (handler_data.cache_fill && !handler_data.cache_fill->set_header(fields))
+		handler_data.cache_fill.reset();
+
 	it = fields.find("content-length");
 	if (it != fields.end()) handler_data.current_response.content_length = it->second;
 	else
 	{
-		handler_data.current_request.fields["connection"] = "close";
 		handler_data.current_response.content_length.clear();
+		// Without a length the end of the body has to be marked by chunks, or else by closing
+		if (!error_status && handler_data.current_request.http_version == "HTTP/1.1")
+		{
+			handler_data.chunked = true;
+			handler_data.splice = false;
+			handler_data.current_response.add_http_header("transfer-encoding", "chunked");
+		}
+		else
+			handler_data.current_request.fields["connection"] = "close";
 	}
 
-	if (!handler_data.current_response.status_code.empty())
-		handler_data.cgi->buffer_out.clear();
+	if (error_status)
+		handler_data.gateway->buffer_out.clear();
+}
+
+// Builder for the counters of the server: JSON with ?format=json or when the client accepts it,
+// else the Prometheus text format
+void Connection::new_response_metrics(pollable_map_t const& fd_map)
+{
+	LOG_DEBUG("Connection::new_response_metrics");
+
+	auto accept = handler_data.current_request.fields.find("accept");
+	bool json = handler_data.current_request.path_arguments.find("format=json") != std::string::npos
+		|| (accept != handler_data.current_request.fields.end() && accept->second.find("application/json") != std::string::npos);
+	handler_data.custom_page = json ? Metrics::render_json(fd_map) : Metrics::render_prometheus(fd_map);
+	handler_data.current_response.content_length = std::to_string(handler_data.custom_page.size());
+	handler_data.current_response.content_type = json ? "application/json" : "text/plain; version=0.0.4";
+	handler_data.current_response.add_http_header("cache-control", "no-store");
 }
 
 // Builder for redirection responses
@@ -526,9 +1105,7 @@ void Connection::new_response_redirect(Server const& server, Location const& loc
 {
 	(void)server;
 	(void)loc;
-#ifdef DEBUG
-	std::cout << "Connection::new_response_redirect" << std::endl;
-#endif
+	LOG_DEBUG("Connection::new_response_redirect");
 
 	handler_data.current_response.add_http_header("location", server.get_redirection(loc));
 	handler_data.current_response.set_status_code("301");
@@ -540,9 +1117,7 @@ void Connection::new_response_delete(Server const& server, Location const& loc)
 {
 	(void)server;
 	(void)loc;
-#ifdef DEBUG
-	std::cout << "Connection::new_response_delete" << std::endl;
-#endif
+	LOG_DEBUG("Connection::new_response_delete");
 	
 	if (!handler_data.current_response.status_code.empty())
 		return;
@@ -556,46 +1131,213 @@ void Connection::new_response_delete(Server const& server, Location const& loc)
 void Connection::continue_response(pollable_map_t& fd_map)
 {
 	(void)fd_map;
-	if (handler_data.cgi != nullptr)
+	if (handler_data.chunked)
+	{
+		send_chunk();
+		return ;
+	}
+
+	if (handler_data.gateway != nullptr)
 	{
-		if (!handler_data.cgi->buffer_out.empty())
+		if (!handler_data.gateway->buffer_out.empty())
+		{
+			ssize_t send_data = ::send(socket_fd, handler_data.gateway->pending_out(),
+				handler_data.gateway->pending_out_size(), 0);
+			if (send_data > 0)
+			{
+				if (handler_data.cache_fill)
+					handler_data.cache_fill->append(handler_data.gateway->pending_out(), send_data);
+				handler_data.gateway->consume_out(send_data);
+				handler_data.body_sent += send_data;
+			}
+			LOG_DEBUG('(' << socket_fd << "): "
+				<< "sending " << send_data << " bytes to client");
+		}
+		else if (handler_data.splice)
 		{
-			ssize_t send_data = data::send(socket_fd, handler_data.cgi->buffer_out);
-			if (send_data == static_cast<ssize_t>(handler_data.cgi->buffer_out.size()))
-				handler_data.cgi->buffer_out.clear();
-			std::cout << '(' << socket_fd << "): "
-				<< "sending " << send_data << " bytes to client" << std::endl;
+			// The socket is non-blocking while splicing so a full send buffer can't stall the server
+			if (!handler_data.splicing_out)
+			{
+				(void)fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK);
+				handler_data.splicing_out = true;
+			}
+			ssize_t send_data = handler_data.gateway->splice_to(socket_fd, fd_map);
+			if (send_data > 0)
+			{
+				handler_data.body_sent += send_data;
+				reset_time_remaining();
+			}
 		}
 		return ;
 	}
 
 	if (!handler_data.custom_page.empty())
 	{
-		ssize_t send_data = data::send(socket_fd, handler_data.custom_page);
-		if (static_cast<size_t>(send_data) != handler_data.custom_page.size())
-			std::cerr << "send_data of custom_page == " << send_data << std::endl;
-		state = CLOSE; // Close is default unless keep-alive
-		if (handler_data.current_request.fields["connection"] == "keep-alive")
-			state = READY_TO_READ;
+		// Large pages (directory listings) are sent in parts
+		size_t remaining = handler_data.custom_page.size() - handler_data.custom_page_offset;
+		ssize_t send_data = ::send(socket_fd, handler_data.custom_page.data() + handler_data.custom_page_offset,
+			std::min(remaining, static_cast<size_t>(MAX_SEND_BUFFER_SIZE)), 0);
+		if (send_data < 0)
+			return ;
+		handler_data.custom_page_offset += send_data;
+		handler_data.body_sent += send_data;
+		reset_time_remaining();
+		if (handler_data.custom_page_offset < handler_data.custom_page.size())
+			return ;
 		handler_data.custom_page.clear();
+		handler_data.custom_page_offset = 0;
+		end_response();
 		return ;
 	}
 	if (!handler_data.file)
 	{
-		if (handler_data.cgi == nullptr)
-			state = CLOSE;
+		if (handler_data.gateway == nullptr)
+			end_response();
 		return ;
 	}
 
-	if (!data::send_file(socket_fd, handler_data.file, MAX_SEND_BUFFER_SIZE))
+	if (!data::send_file(socket_fd, handler_data.file, MAX_SEND_BUFFER_SIZE, handler_data.body_sent))
 	{
 		handler_data.file.close();
 		handler_data.file.clear();
-		state = CLOSE; // Close is default unless keep-alive
-		if (handler_data.current_request.fields["connection"] == "keep-alive")
-			state = READY_TO_READ;
+		end_response();
+	}
+	reset_time_remaining();
+}
+
+void Connection::end_response(void)
+{
+	std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - handler_data.request_start;
+	std::chrono::duration<double, std::milli> duration = elapsed;
+	AccessLog::log({get_ip(), handler_data.current_request, handler_data.uri, handler_data.current_response.status_code,
+		handler_data.body_sent, duration.count()});
+
+	Metrics& metrics = Metrics::get();
+	metrics.request_duration.record(elapsed);
+	int status = std::atoi(handler_data.current_response.status_code.c_str());
+	if (status > 0 && status < 600)
+		++metrics.responses[status];
+	metrics.bytes_sent += handler_data.body_sent;
+	handler_data.body_sent = 0;
+
+	mark_phase(PHASE_LAST_BYTE);
+	size_t threshold = handler_data.config->slow_request_threshold;
+	if (threshold != 0 && elapsed >= std::chrono::milliseconds(threshold))
+		LOG_INFO("Slow request " << getpid() << '-' << handler_data.request_id << " (" << socket_fd << "): "
+			<< get_request_string(handler_data.current_request.type) << ' ' << handler_data.uri << ' '
+			<< handler_data.current_response.status_code << ", " << format_phases(false));
+	idle_start = std::chrono::steady_clock::now();
+
+	// The CGI response is complete, hand it to the cache
+	if (handler_data.cache_fill)
+	{
+		handler_data.cache_fill->commit();
+		handler_data.cache_fill.reset();
+	}
+	// The next request is read with blocking receives again
+	if (handler_data.splicing_out)
+	{
+		(void)fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) & ~O_NONBLOCK);
+		handler_data.splicing_out = false;
+	}
+	state = CLOSE; // Close is default unless keep-alive
+	// The address of a retired socket isn't in the config anymore
+	if (handler_data.current_request.fields["connection"] == "keep-alive" && !parent->is_retired())
+		state = READY_TO_READ;
+	// The client may still be sending the body, only its side is left open for a while
+	else if (handler_data.linger && shutdown(socket_fd, SHUT_WR) == 0)
+	{
+		state = LINGERING;
+		handler_data.linger_deadline = std::time(nullptr) + LINGER_TIMEOUT;
+	}
+}
+
+void Connection::mark_phase(Phase phase)
+{
+	int64_t microseconds = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - handler_data.request_start).count();
+	handler_data.phases[phase] = static_cast<uint32_t>(std::min<int64_t>(std::max<int64_t>(microseconds, 1), UINT32_MAX));
+}
+
+// Every phase that was reached with the time since the one before it, in milliseconds. Before the
+// first byte the connection was waiting for the request: since it was accepted, or idle since the
+// previous response. "name;dur=1.234, ..." for Server-Timing, "name=1.234ms ..." for the log.
+std::string Connection::format_phases(bool server_timing) const
+{
+	static char const* const names[] = {"header", "route", "gateway", "response", "body"};
+	std::string out;
+	char buffer[64];
+	auto add = [&](char const* name, double milliseconds) {
+		snprintf(buffer, sizeof(buffer), server_timing ? "%s%s;dur=%.3f" : "%s%s=%.3fms",
+			out.empty() ? "" : (server_timing ? ", " : " "), name, milliseconds);
+		out += buffer;
+	};
+
+	add(requests == 1 ? "accept" : "idle",
+		std::chrono::duration<double, std::milli>(handler_data.request_start - idle_start).count());
+	uint32_t previous = 0;
+	for (size_t phase = 0; phase < PHASE_COUNT; ++phase)
+	{
+		if (handler_data.phases[phase] == 0)
+			continue ;
+		add(names[phase], (handler_data.phases[phase] - previous) / 1000.0);
+		previous = handler_data.phases[phase];
 	}
+	add("total", previous / 1000.0);
+	return (out);
+}
+
+// Send gateway output as chunks of "size CRLF data CRLF", every chunk with one writev().
+// A chunk that's only partially sent is finished first, its data is still at the front of buffer_out.
+// The last chunk (size 0) is sent once the gateway is gone, so the connection can be reused.
+void Connection::send_chunk(void)
+{
+	Chunk& chunk = handler_data.chunk;
+	if (chunk.head_left == 0 && chunk.data_left == 0 && chunk.tail_left == 0)
+	{
+		if (handler_data.gateway != nullptr && handler_data.gateway->pending_out_size() == 0)
+			return ;
+		chunk.data_left = (handler_data.gateway == nullptr) ? 0 : handler_data.gateway->pending_out_size();
+		chunk.head_size = snprintf(chunk.head, sizeof(chunk.head), "%zx\r\n", chunk.data_left);
+		chunk.head_left = chunk.head_size;
+		chunk.tail_left = 2;
+		chunk.last = (chunk.data_left == 0);
+	}
+
+	struct iovec iov[3];
+	int count = 0;
+	if (chunk.head_left > 0)
+		iov[count++] = {chunk.head + chunk.head_size - chunk.head_left, chunk.head_left};
+	if (chunk.data_left > 0)
+		iov[count++] = {const_cast<char*>(handler_data.gateway->pending_out()), chunk.data_left};
+	iov[count++] = {const_cast<char*>("\r\n") + 2 - chunk.tail_left, chunk.tail_left};
+
+	ssize_t send_size = writev(socket_fd, iov, count);
+	if (send_size <= 0)
+		return ;
 	reset_time_remaining();
+
+	size_t sent = send_size;
+	size_t part = std::min(sent, chunk.head_left);
+	chunk.head_left -= part;
+	sent -= part;
+	part = std::min(sent, chunk.data_left);
+	if (part > 0)
+	{
+		if (handler_data.cache_fill)
+			handler_data.cache_fill->append(handler_data.gateway->pending_out(), part);
+		handler_data.gateway->consume_out(part);
+		handler_data.body_sent += part;
+	}
+	chunk.data_left -= part;
+	sent -= part;
+	chunk.tail_left -= std::min(sent, chunk.tail_left);
+
+	if (chunk.last && chunk.tail_left == 0)
+	{
+		handler_data.chunked = false;
+		end_response();
+	}
 }
 
 // GETTERS
@@ -603,12 +1345,18 @@ Request const& Connection::get_last_request(void) const { return last_request; }
 Response const& Connection::get_last_response(void) const { return last_response; }
 Connection::State Connection::get_state(void) const { return state; }
 
+char const* Connection::get_state_name(State state)
+{
+	static char const* const names[] = {"ready_to_read", "reading", "ready_to_write", "writing", "lingering", "close"};
+	return (names[state]);
+}
+
 sockfd_t Connection::get_fd(void) const
 {
 	return (socket_fd);
 }
 
-bool Connection::should_destroy(void) const { return state == CLOSE && handler_data.cgi == nullptr; }
+bool Connection::should_destroy(void) const { return state == CLOSE && handler_data.gateway == nullptr; }
 
 std::string Connection::get_ip(void) const
 {
@@ -0,0 +1,549 @@
+#include "FastCGI.h"
+#include "Address.h"
+#include "Core.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <ctime>
+#include <stdexcept>
+
+namespace webserv {
+
+namespace fcgi
+{
+	static void append_header(std::vector<char>& out, RecordType type, uint16_t id, size_t size)
+	{
+		out.push_back(1); // FCGI_VERSION_1
+		out.push_back(static_cast<char>(type));
+		out.push_back(static_cast<char>(id >> 8));
+		out.push_back(static_cast<char>(id & 0xff));
+		out.push_back(static_cast<char>(size >> 8));
+		out.push_back(static_cast<char>(size & 0xff));
+		out.push_back(0); // padding length
+		out.push_back(0); // reserved
+	}
+
+	// Append a stream record, split into several records when it's too large (size 0 ends the stream)
+	void append_record(std::vector<char>& out, RecordType type, uint16_t id, char const* data, size_t size)
+	{
+		do
+		{
+			size_t part = std::min(size, static_cast<size_t>(FASTCGI_MAX_RECORD));
+			append_header(out, type, id, part);
+			out.insert(out.end(), data, data + part);
+			data += part;
+			size -= part;
+		} while (size > 0);
+	}
+
+	static void append_length(std::vector<char>& out, size_t length)
+	{
+		if (length < 128)
+		{
+			out.push_back(static_cast<char>(length));
+			return ;
+		}
+		out.push_back(static_cast<char>((length >> 24) | 0x80));
+		out.push_back(static_cast<char>(length >> 16));
+		out.push_back(static_cast<char>(length >> 8));
+		out.push_back(static_cast<char>(length));
+	}
+
+	static void append_pair(std::vector<char>& out, char const* name, size_t name_size, char const* value, size_t value_size)
+	{
+		append_length(out, name_size);
+		append_length(out, value_size);
+		out.insert(out.end(), name, name + name_size);
+		out.insert(out.end(), value, value + value_size);
+	}
+
+	static bool read_length(char const* content, size_t size, size_t& pos, size_t& length)
+	{
+		if (pos >= size)
+			return (false);
+		unsigned char const* bytes = reinterpret_cast<unsigned char const*>(content + pos);
+		if (bytes[0] < 128)
+		{
+			length = bytes[0];
+			pos += 1;
+			return (true);
+		}
+		if (size - pos < 4)
+			return (false);
+		length = (static_cast<size_t>(bytes[0] & 0x7f) << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+		pos += 4;
+		return (true);
+	}
+
+	// The value of a name in name-value pairs, empty when it isn't there
+	static std::string find_value(char const* content, size_t size, std::string const& name)
+	{
+		size_t pos = 0;
+		size_t name_size, value_size;
+		while (read_length(content, size, pos, name_size) && read_length(content, size, pos, value_size)
+			&& size - pos >= name_size + value_size)
+		{
+			if (std::string(content + pos, name_size) == name)
+				return (std::string(content + pos + name_size, value_size));
+			pos += name_size + value_size;
+		}
+		return (std::string());
+	}
+
+	void encode_params(std::vector<char>& out, env::Arena const& env)
+	{
+		for (size_t i = 0; i < env.size(); ++i)
+		{
+			char const* var = env.get(i);
+			char const* value = std::strchr(var, '=');
+			size_t name_size = value - var;
+			++value;
+			append_pair(out, var, name_size, value, std::strlen(value));
+		}
+	}
+
+	void append_params(std::vector<char>& out, uint16_t id, std::vector<char> const& params)
+	{
+		if (!params.empty())
+			append_record(out, PARAMS, id, params.data(), params.size());
+		append_record(out, PARAMS, id, nullptr, 0);
+	}
+
+} // namespace fcgi
+
+//==============================================================================
+// FastCGIRequest
+//==============================================================================
+
+// The environment is encoded right away, the arena is reused by the next request
+FastCGIRequest::FastCGIRequest(FastCGIPool* pool, env::Arena const& env, size_t content_length)
+:	pool(pool),
+	connection(nullptr),
+	id(0),
+	queued(false),
+	stdin_remaining(content_length),
+	ended(false)
+{
+	fcgi::encode_params(params, env);
+}
+
+FastCGIRequest::~FastCGIRequest()
+{
+	if (queued)
+		pool->cancel(this);
+	if (connection != nullptr)
+		connection->release_request(this);
+}
+
+// Unused
+FastCGIRequest::FastCGIRequest() {}
+FastCGIRequest::FastCGIRequest(FastCGIRequest const& other) : Gateway() { (void)other; }
+FastCGIRequest& FastCGIRequest::operator=(FastCGIRequest const& other) { (void)other; return *this; }
+//END
+
+bool FastCGIRequest::is_output_closed(void) const
+{
+	return (ended);
+}
+
+bool FastCGIRequest::finish(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	return (true);
+}
+
+void FastCGIRequest::abort(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	if (queued)
+		pool->cancel(this);
+	queued = false;
+	if (connection != nullptr)
+		connection->release_request(this);
+	connection = nullptr;
+	ended = true;
+}
+
+void FastCGIRequest::on_post_poll(pollable_map_t& fd_map)
+{
+	if (queued)
+		pool->start_queued(fd_map);
+}
+
+//==============================================================================
+// FastCGIConnection
+//==============================================================================
+
+FastCGIConnection::FastCGIConnection(sockfd_t fd, FastCGIPool* pool, bool connecting)
+:	socket_fd(fd),
+	pool(pool),
+	connecting(connecting),
+	closed(false),
+	last_time(std::time(nullptr)),
+	next_id(1) {}
+
+FastCGIConnection::~FastCGIConnection()
+{
+	LOG_DEBUG("FastCGI connection (" << socket_fd << ") to " << pool->get_address() << " closed.");
+	for (auto& pair : requests)
+	{
+		if (pair.second == nullptr)
+			continue ;
+		pair.second->connection = nullptr;
+		pair.second->ended = true;
+	}
+	pool->remove_connection(this);
+	close(socket_fd);
+}
+
+// Unused
+FastCGIConnection::FastCGIConnection() : socket_fd(-1) {}
+FastCGIConnection::FastCGIConnection(FastCGIConnection const& other) : Pollable() { (void)other; }
+FastCGIConnection& FastCGIConnection::operator=(FastCGIConnection const& other) { (void)other; return *this; }
+//END
+
+sockfd_t FastCGIConnection::get_fd(void) const { return (socket_fd); }
+
+bool FastCGIConnection::should_destroy(void) const { return (closed); }
+
+bool FastCGIConnection::is_closed(void) const { return (closed); }
+
+size_t FastCGIConnection::get_active_requests(void) const { return (requests.size()); }
+
+short FastCGIConnection::get_events(sockfd_t fd) const
+{
+	(void)fd;
+	if (connecting)
+		return (POLLOUT);
+
+	short events = POLLIN;
+	if (!buffer_out.empty())
+		return (events | POLLOUT);
+	for (auto const& pair : requests)
+	{
+		if (pair.second != nullptr && pair.second->stdin_remaining > 0 && !pair.second->buffer_in.empty())
+			return (events | POLLOUT);
+	}
+	return (events);
+}
+
+void FastCGIConnection::begin_request(FastCGIRequest* request)
+{
+	while (requests.count(next_id) != 0 || next_id == 0)
+		++next_id;
+	uint16_t id = next_id++;
+
+	request->connection = this;
+	request->id = id;
+	requests[id] = request;
+
+	char const begin_body[8] = {0, fcgi::RESPONDER, fcgi::KEEP_CONN, 0, 0, 0, 0, 0};
+	fcgi::append_record(buffer_out, fcgi::BEGIN_REQUEST, id, begin_body, sizeof(begin_body));
+	fcgi::append_params(buffer_out, id, request->params);
+	std::vector<char>().swap(request->params);
+	if (request->stdin_remaining == 0)
+		fcgi::append_record(buffer_out, fcgi::STDIN, id, nullptr, 0);
+
+	last_time = std::time(nullptr);
+}
+
+// Ask whether the application takes several requests on a connection, the answer is a FCGI_GET_VALUES_RESULT
+void FastCGIConnection::ask_values(void)
+{
+	std::vector<char> names;
+	fcgi::append_pair(names, "FCGI_MPXS_CONNS", 15, "", 0);
+	fcgi::append_record(buffer_out, fcgi::GET_VALUES, 0, names.data(), names.size());
+}
+
+// Detach a request that's being deleted, the application is told to abort it when it's still running
+void FastCGIConnection::release_request(FastCGIRequest* request)
+{
+	auto it = requests.find(request->id);
+	if (it == requests.end() || it->second != request)
+		return ;
+
+	if (request->ended)
+	{
+		requests.erase(it);
+		return ;
+	}
+	// Keep the id reserved until the application sends its FCGI_END_REQUEST
+	it->second = nullptr;
+	fcgi::append_record(buffer_out, fcgi::ABORT_REQUEST, request->id, nullptr, 0);
+}
+
+// Wrap pending request bodies into FCGI_STDIN records
+void FastCGIConnection::fill_stdin(void)
+{
+	for (auto& pair : requests)
+	{
+		FastCGIRequest* request = pair.second;
+		if (request == nullptr || request->stdin_remaining == 0 || request->buffer_in.empty())
+			continue ;
+
+		size_t size = std::min(request->buffer_in.size(), request->stdin_remaining);
+		fcgi::append_record(buffer_out, fcgi::STDIN, request->id, request->buffer_in.data(), size);
+		request->buffer_in.clear();
+		request->stdin_remaining -= size;
+		if (request->stdin_remaining == 0)
+			fcgi::append_record(buffer_out, fcgi::STDIN, request->id, nullptr, 0);
+	}
+}
+
+void FastCGIConnection::on_pollout(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	if (connecting)
+	{
+		int error = 0;
+		socklen_t length = sizeof(error);
+		if (getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)
+		{
+			std::cerr << "FastCGI connect to " << pool->get_address() << " failed: " << strerror(error) << std::endl;
+			close_connection();
+			return ;
+		}
+		connecting = false;
+	}
+
+	if (buffer_out.size() < MAX_SEND_BUFFER_SIZE)
+		fill_stdin();
+	if (buffer_out.empty())
+		return ;
+
+	ssize_t send_size = ::send(socket_fd, buffer_out.data(), buffer_out.size(), 0);
+	if (send_size < 0)
+		return ;
+	buffer_out.erase(buffer_out.begin(), buffer_out.begin() + send_size);
+	last_time = std::time(nullptr);
+}
+
+void FastCGIConnection::on_pollin(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	size_t old_size = buffer_in.size();
+	buffer_in.resize(old_size + MAX_SEND_BUFFER_SIZE);
+	ssize_t read_size = recv(socket_fd, buffer_in.data() + old_size, MAX_SEND_BUFFER_SIZE, 0);
+	if (read_size <= 0)
+	{
+		buffer_in.resize(old_size);
+		if (read_size == 0)
+			close_connection();
+		return ;
+	}
+	buffer_in.resize(old_size + read_size);
+	last_time = std::time(nullptr);
+
+	// Handle all complete records, keep the rest for the next read
+	size_t pos = 0;
+	while (buffer_in.size() - pos >= 8)
+	{
+		unsigned char const* header = reinterpret_cast<unsigned char const*>(buffer_in.data() + pos);
+		uint16_t id = (header[2] << 8) | header[3];
+		size_t content_size = (header[4] << 8) | header[5];
+		size_t record_size = 8 + content_size + header[6];
+		if (buffer_in.size() - pos < record_size)
+			break ;
+		handle_record(header[1], id, buffer_in.data() + pos + 8, content_size);
+		pos += record_size;
+	}
+	buffer_in.erase(buffer_in.begin(), buffer_in.begin() + pos);
+}
+
+// Output is buffered for the request regardless of how fast its client reads,
+// the connection is shared so it can't stop reading for one slow request.
+void FastCGIConnection::handle_record(unsigned char type, uint16_t id, char const* content, size_t size)
+{
+	if (type == fcgi::GET_VALUES_RESULT)
+	{
+		pool->set_multiplexing(fcgi::find_value(content, size, "FCGI_MPXS_CONNS") == "1");
+		return ;
+	}
+
+	auto it = requests.find(id);
+	if (it == requests.end())
+		return ;
+	FastCGIRequest* request = it->second;
+
+	switch (type)
+	{
+		case fcgi::STDOUT:
+			if (request != nullptr)
+				request->buffer_out.insert(request->buffer_out.end(), content, content + size);
+			break ;
+		case fcgi::STDERR:
+			if (size > 0)
+				std::cerr << "FastCGI (" << id << "): " << std::string(content, size) << std::endl;
+			break ;
+		case fcgi::END_REQUEST:
+			if (request != nullptr)
+			{
+				request->ended = true;
+				request->connection = nullptr;
+			}
+			requests.erase(it);
+			break ;
+		default: break;
+	}
+}
+
+void FastCGIConnection::on_pollhup(pollable_map_t& fd_map, sockfd_t fd)
+{
+	(void)fd;
+	// Read what the application still sent before hanging up
+	if (!connecting)
+		on_pollin(fd_map);
+	close_connection();
+}
+
+void FastCGIConnection::on_post_poll(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	if (!closed && requests.empty() && std::time(nullptr) - last_time >= FASTCGI_IDLE_TIMEOUT)
+		close_connection();
+}
+
+void FastCGIConnection::close_connection(void)
+{
+	closed = true;
+	for (auto& pair : requests)
+	{
+		if (pair.second == nullptr)
+			continue ;
+		pair.second->connection = nullptr;
+		pair.second->ended = true;
+	}
+	requests.clear();
+	pool->remove_connection(this);
+}
+
+//==============================================================================
+// FastCGIPool
+//==============================================================================
+
+FastCGIPool::FastCGIPool(std::string const& address)
+:	address(address),
+	max_connections(FASTCGI_DEFAULT_CONNECTIONS),
+	values_asked(false),
+	multiplexing(false) {}
+
+static bool set_nonblocking(sockfd_t fd)
+{
+	return (fcntl(fd, F_SETFL, O_NONBLOCK) == 0);
+}
+
+FastCGIPool& FastCGIPool::get(std::string const& address)
+{
+	static std::unordered_map<std::string, std::unique_ptr<FastCGIPool>> pools;
+
+	auto it = pools.find(address);
+	if (it == pools.end())
+		it = pools.emplace(address, std::unique_ptr<FastCGIPool>(new FastCGIPool(address))).first;
+	return (*it->second);
+}
+
+std::string const& FastCGIPool::get_address(void) const { return (address); }
+
+void FastCGIPool::set_multiplexing(bool multiplexing)
+{
+	LOG_DEBUG("FastCGI " << address << (multiplexing ? " multiplexes" : " doesn't multiplex") << " connections.");
+	this->multiplexing = multiplexing;
+}
+
+FastCGIRequest* FastCGIPool::new_request(pollable_map_t& fd_map, env::Arena const& env,
+	size_t content_length, size_t max_connections)
+{
+	this->max_connections = max_connections;
+	std::unique_ptr<FastCGIRequest> request(new FastCGIRequest(this, env, content_length));
+	FastCGIConnection* connection = queue.empty() ? find_connection(fd_map) : nullptr;
+	if (connection != nullptr)
+		connection->begin_request(request.get());
+	else
+	{
+		request->queued = true;
+		queue.push_back(request.get());
+	}
+	return (request.release());
+}
+
+void FastCGIPool::start_queued(pollable_map_t& fd_map)
+{
+	while (!queue.empty())
+	{
+		FastCGIRequest* request = queue.front();
+		FastCGIConnection* connection;
+		try { connection = find_connection(fd_map); }
+		catch (std::exception& e)
+		{
+			// Ends without output, the Connection answers it with a 502
+			std::cerr << "FastCGIPool::start_queued(): " << e.what() << std::endl;
+			queue.pop_front();
+			request->queued = false;
+			request->ended = true;
+			continue ;
+		}
+		if (connection == nullptr)
+			return ;
+		queue.pop_front();
+		request->queued = false;
+		connection->begin_request(request);
+	}
+}
+
+void FastCGIPool::cancel(FastCGIRequest* request)
+{
+	auto it = std::find(queue.begin(), queue.end(), request);
+	if (it != queue.end())
+		queue.erase(it);
+}
+
+FastCGIConnection* FastCGIPool::find_connection(pollable_map_t& fd_map)
+{
+	FastCGIConnection* best = nullptr;
+	for (auto* c : connections)
+	{
+		if (best == nullptr || c->get_active_requests() < best->get_active_requests())
+			best = c;
+	}
+	if (best != nullptr && best->get_active_requests() == 0)
+		return (best);
+	if (connections.size() < max_connections)
+		return (open_connection(fd_map));
+	return (multiplexing ? best : nullptr);
+}
+
+void FastCGIPool::remove_connection(FastCGIConnection* connection)
+{
+	auto it = std::find(connections.begin(), connections.end(), connection);
+	if (it != connections.end())
+		connections.erase(it);
+}
+
+FastCGIConnection* FastCGIPool::open_connection(pollable_map_t& fd_map)
+{
+	Address const& target = Address::get(address);
+	sockfd_t fd = socket(target.get_family(), SOCK_STREAM, 0);
+	if (fd < 0)
+		throw (std::runtime_error(std::string("FastCGI socket: ") + strerror(errno)));
+	int result = set_nonblocking(fd) ? connect(fd, target.get_addr(), target.length) : -1;
+
+	if (result < 0 && errno != EINPROGRESS)
+	{
+		std::string error = strerror(errno);
+		close(fd);
+		throw (std::runtime_error("FastCGI connect to " + address + " failed: " + error));
+	}
+
+	FastCGIConnection* connection = new FastCGIConnection(fd, this, result < 0);
+	if (!values_asked)
+	{
+		connection->ask_values();
+		values_asked = true;
+	}
+	connections.push_back(connection);
+	fd_map.insert({fd, connection});
+	LOG_DEBUG("FastCGI connection (" << fd << ") to " << address << " opened.");
+	return (connection);
+}
+
+} // namespace webserv
@@ -0,0 +1,53 @@
+#include "Gateway.h"
+#include "Core.h"
+
+namespace webserv {
+
+Gateway::Gateway() : truncated(false), in_offset(0), out_offset(0) {}
+
+void Gateway::on_post_poll(pollable_map_t& fd_map) { (void)fd_map; }
+
+bool Gateway::intercept_errors(void) const { return (true); }
+
+bool Gateway::is_truncated(void) const { return (truncated); }
+
+bool Gateway::can_splice(void) const { return (false); }
+
+bool Gateway::is_input_blocked(void) const { return (false); }
+
+ssize_t Gateway::splice_from(sockfd_t fd, size_t size)
+{
+	(void)fd; (void)size;
+	return (-1);
+}
+
+ssize_t Gateway::splice_to(sockfd_t fd, pollable_map_t& fd_map)
+{
+	(void)fd; (void)fd_map;
+	return (-1);
+}
+
+char const* Gateway::pending_in(void) const { return (buffer_in.data() + in_offset); }
+size_t Gateway::pending_in_size(void) const { return (buffer_in.size() - in_offset); }
+char const* Gateway::pending_out(void) const { return (buffer_out.data() + out_offset); }
+size_t Gateway::pending_out_size(void) const { return (buffer_out.size() - out_offset); }
+
+static void consume(std::vector<char>& buffer, size_t& offset, size_t size)
+{
+	offset += size;
+	if (offset >= buffer.size())
+	{
+		buffer.clear();
+		offset = 0;
+	}
+	else if (offset >= buffer.size() / 2)
+	{
+		buffer.erase(buffer.begin(), buffer.begin() + offset);
+		offset = 0;
+	}
+}
+
+void Gateway::consume_in(size_t size) { consume(buffer_in, in_offset, size); }
+void Gateway::consume_out(size_t size) { consume(buffer_out, out_offset, size); }
+
+} // namespace webserv
@@ -0,0 +1,177 @@
+#include "Handler.h"
+#include "Core.h"
+#include "Log.h"
+
+#include <dlfcn.h>
+#include <stdexcept>
+
+namespace webserv {
+
+//==============================================================================
+// MODULE
+//==============================================================================
+
+HandlerModule& HandlerModule::get(std::string const& path)
+{
+	static std::unordered_map<std::string, std::unique_ptr<HandlerModule>> modules;
+
+	auto it = modules.find(path);
+	if (it == modules.end())
+		it = modules.emplace(path, std::unique_ptr<HandlerModule>(new HandlerModule(path))).first;
+	return (*it->second);
+}
+
+HandlerModule::HandlerModule(std::string const& path)
+:	path(path),
+	library(nullptr),
+	handler(nullptr)
+{
+	library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (library == nullptr)
+		throw (std::runtime_error(std::string("Handler module: ") + dlerror()));
+
+	typedef webserv_handler const* (*get_handler_t)(void);
+	get_handler_t get_handler = reinterpret_cast<get_handler_t>(dlsym(library, WEBSERV_HANDLER_SYMBOL));
+	if (get_handler != nullptr)
+		handler = get_handler();
+
+	if (handler == nullptr || handler->abi_version != WEBSERV_HANDLER_ABI_VERSION
+		|| handler->begin == nullptr || handler->body == nullptr || handler->end == nullptr)
+	{
+		dlclose(library);
+		throw (std::runtime_error("Handler module " + path + " doesn't provide a webserv_handler of ABI version "
+			+ std::to_string(WEBSERV_HANDLER_ABI_VERSION)));
+	}
+	if (handler->init != nullptr && handler->init() != 0)
+	{
+		dlclose(library);
+		throw (std::runtime_error("Handler module " + path + " failed to initialize"));
+	}
+	LOG_INFO("Handler module " << (handler->name ? handler->name : path) << " loaded.");
+}
+
+// Unused
+HandlerModule::HandlerModule(HandlerModule const& other) : library(nullptr), handler(nullptr) { (void)other; }
+HandlerModule& HandlerModule::operator=(HandlerModule const& other) { (void)other; return *this; }
+//END
+
+webserv_handler const& HandlerModule::get_handler(void) const { return (*handler); }
+
+//==============================================================================
+// REQUEST
+//==============================================================================
+
+HandlerRequest::HandlerRequest(HandlerModule& module, Request const& request, Location const& loc,
+	std::string const& client_ip, size_t content_length)
+:	handler(&module.get_handler()),
+	state(nullptr),
+	method(get_request_string(request.type)),
+	path(request.path),
+	query(request.path_arguments),
+	http_version(request.http_version),
+	client_ip(client_ip),
+	location(loc.name),
+	fields(request.fields.begin(), request.fields.end()),
+	content_length(content_length),
+	received(0),
+	written(false),
+	body_done(false),
+	ended(false)
+{
+	for (auto const& field : fields)
+		headers.push_back({field.first.c_str(), field.second.c_str()});
+
+	view.method = method.c_str();
+	view.path = path.c_str();
+	view.query = query.c_str();
+	view.http_version = http_version.c_str();
+	view.client_ip = this->client_ip.c_str();
+	view.location = location.c_str();
+	view.headers = headers.data();
+	view.header_count = headers.size();
+	view.content_length = content_length;
+
+	output.context = this;
+	output.write = &HandlerRequest::write;
+
+	state = handler->begin(&view, &output);
+}
+
+HandlerRequest::~HandlerRequest()
+{
+	if (handler != nullptr)
+		handler->end(state);
+}
+
+// Unused
+HandlerRequest::HandlerRequest() : handler(nullptr) {}
+HandlerRequest::HandlerRequest(HandlerRequest const& other) : Gateway(), handler(nullptr) { (void)other; }
+HandlerRequest& HandlerRequest::operator=(HandlerRequest const& other) { (void)other; return *this; }
+//END
+
+void HandlerRequest::write(void* context, char const* data, size_t size)
+{
+	HandlerRequest* request = static_cast<HandlerRequest*>(context);
+	if (request->ended)
+		return ;
+	request->buffer_out.insert(request->buffer_out.end(), data, data + size);
+	request->written = request->written || size != 0;
+}
+
+bool HandlerRequest::is_output_closed(void) const { return (ended); }
+
+bool HandlerRequest::finish(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	return (true);
+}
+
+void HandlerRequest::abort(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	ended = true;
+}
+
+// Hands the received body to the module, then lets it finish the response
+void HandlerRequest::on_post_poll(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	if (ended)
+		return ;
+
+	// Anything past content_length is dropped
+	size_t size = std::min(pending_in_size(), content_length - received);
+	if (size > 0)
+	{
+		int result = handler->body(state, pending_in(), size, &output);
+		received += size;
+		handle_result(result);
+	}
+	consume_in(pending_in_size());
+	if (!ended && !body_done && received >= content_length)
+	{
+		body_done = true;
+		handle_result(handler->body(state, nullptr, 0, &output));
+	}
+	else if (!ended && body_done)
+		handle_result(handler->resume != nullptr ? handler->resume(state, &output) : WEBSERV_HANDLER_DONE);
+}
+
+void HandlerRequest::handle_result(int result)
+{
+	if (result == WEBSERV_HANDLER_DONE)
+		ended = true;
+	else if (result == WEBSERV_HANDLER_ERROR)
+	{
+		if (!written)
+		{
+			std::string const status = "Status: 500 Internal Server Error\r\n\r\n";
+			buffer_out.assign(status.begin(), status.end());
+		}
+		else
+			truncated = true;
+		ended = true;
+	}
+}
+
+} // namespace webserv
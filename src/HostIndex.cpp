@@ -0,0 +1,111 @@
+#include "HostIndex.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace webserv {
+
+HostIndex::HostIndex(void) {}
+
+HostIndex::LabelTrie::LabelTrie(void)
+{
+	nodes.push_back({nullptr, {}});
+}
+
+void HostIndex::LabelTrie::insert(std::vector<std::string> const& labels, Server* server)
+{
+	size_t node = 0;
+	for (std::string const& label : labels)
+	{
+		auto child = nodes[node].children.find(label);
+		if (child == nodes[node].children.end())
+		{
+			nodes[node].children[label] = nodes.size();
+			node = nodes.size();
+			nodes.push_back({nullptr, {}});
+		}
+		else
+			node = child->second;
+	}
+	if (nodes[node].server == nullptr)
+		nodes[node].server = server;
+}
+
+Server* HostIndex::LabelTrie::find(std::vector<std::string> const& labels) const
+{
+	Server* result = nullptr;
+	size_t node = 0;
+	// The last label is left for the wildcard
+	for (size_t i = 0; i + 1 < labels.size(); ++i)
+	{
+		auto child = nodes[node].children.find(labels[i]);
+		if (child == nodes[node].children.end())
+			break ;
+		node = child->second;
+		if (nodes[node].server != nullptr)
+			result = nodes[node].server;
+	}
+	return (result);
+}
+
+bool HostIndex::LabelTrie::empty(void) const { return (nodes.size() == 1); }
+
+std::vector<std::string> HostIndex::split_labels(std::string const& name)
+{
+	std::vector<std::string> labels;
+	size_t start = 0;
+	while (start <= name.size())
+	{
+		size_t end = std::min(name.find('.', start), name.size());
+		labels.push_back(name.substr(start, end - start));
+		start = end + 1;
+	}
+	return (labels);
+}
+
+// Lowercased, without the port ("host:port", "[v6]:port") and the dot of a fully qualified name
+std::string HostIndex::normalize(std::string const& hostname)
+{
+	std::string result = hostname;
+	size_t pos = result.find_last_of(':');
+	if (pos != std::string::npos && result.find(']', pos) == std::string::npos
+		&& (result[0] == '[' || result.find(':') == pos))
+		result.erase(pos);
+	if (!result.empty() && result.back() == '.')
+		result.pop_back();
+	std::transform(result.begin(), result.end(), result.begin(), ::tolower);
+	return (result);
+}
+
+void HostIndex::add(std::string const& name, Server* server)
+{
+	std::string host = normalize(name);
+	if (host.compare(0, 2, "*.") == 0)
+	{
+		std::vector<std::string> labels = split_labels(host.substr(2));
+		std::reverse(labels.begin(), labels.end());
+		leading.insert(labels, server);
+	}
+	else if (host.size() > 2 && host.compare(host.size() - 2, 2, ".*") == 0)
+		trailing.insert(split_labels(host.substr(0, host.size() - 2)), server);
+	else
+		names.emplace(host, server);
+}
+
+Server* HostIndex::find(std::string const& hostname) const
+{
+	std::string host = normalize(hostname);
+	auto it = names.find(host);
+	if (it != names.end())
+		return (it->second);
+	if (leading.empty() && trailing.empty())
+		return (nullptr);
+
+	std::vector<std::string> labels = split_labels(host);
+	Server* server = trailing.find(labels);
+	std::reverse(labels.begin(), labels.end());
+	Server* wildcard = leading.find(labels);
+	return (wildcard != nullptr ? wildcard : server);
+}
+
+} // namespace webserv
@@ -0,0 +1,77 @@
+#include "LocationTree.h"
+
+#include <algorithm>
+
+namespace webserv {
+
+LocationTree::LocationTree(void)
+{
+	nodes.push_back({std::string(), npos, {}});
+}
+
+size_t LocationTree::find_child(size_t node, char c) const
+{
+	for (size_t child : nodes[node].children)
+	{
+		if (nodes[child].label[0] == c)
+			return (child);
+	}
+	return (npos);
+}
+
+void LocationTree::insert(std::string const& path, size_t value)
+{
+	size_t node = 0;
+	size_t pos = 0;
+	while (pos < path.size())
+	{
+		size_t child = find_child(node, path[pos]);
+		if (child == npos)
+		{
+			nodes[node].children.push_back(nodes.size());
+			nodes.push_back({path.substr(pos), value, {}});
+			return ;
+		}
+
+		std::string const& label = nodes[child].label;
+		size_t common = 1;
+		while (common < label.size() && pos + common < path.size() && label[common] == path[pos + common])
+			++common;
+
+		// The path leaves the edge halfway, the edge is split at that point
+		if (common < label.size())
+		{
+			Node middle {label.substr(0, common), npos, {child}};
+			nodes[child].label.erase(0, common);
+			std::replace(nodes[node].children.begin(), nodes[node].children.end(), child, nodes.size());
+			child = nodes.size();
+			nodes.push_back(middle);
+		}
+		node = child;
+		pos += common;
+	}
+	if (nodes[node].value == npos)
+		nodes[node].value = value;
+}
+
+size_t LocationTree::find(std::string const& path) const
+{
+	size_t result = nodes[0].value;
+	size_t node = 0;
+	size_t pos = 0;
+	while (pos < path.size())
+	{
+		node = find_child(node, path[pos]);
+		if (node == npos)
+			break ;
+		std::string const& label = nodes[node].label;
+		if (path.compare(pos, label.size(), label) != 0)
+			break ;
+		pos += label.size();
+		if (nodes[node].value != npos)
+			result = nodes[node].value;
+	}
+	return (result);
+}
+
+} // namespace webserv
@@ -0,0 +1,198 @@
+#include "LoopProfile.h"
+#include "Connection.h"
+#include "Log.h"
+
+#include <cstdio>
+#include <cxxabi.h>
+
+namespace webserv {
+
+LoopProfile::LoopProfile(void)
+:	iterations(0),
+	ready(0),
+	max_ready(0),
+	slow_iterations(),
+	next_slow_iteration(0),
+	iteration_ready(0),
+	iteration_slowest()
+{}
+
+// Unused
+LoopProfile::LoopProfile(LoopProfile const& other) { (void)other; }
+LoopProfile& LoopProfile::operator=(LoopProfile const& other) { (void)other; return *this; }
+//END
+
+LoopProfile& LoopProfile::get(void)
+{
+	static LoopProfile profile;
+	return (profile);
+}
+
+// "Connection" for webserv::Connection
+static std::string type_name(std::type_info const& type)
+{
+	int status = 0;
+	char* demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+	std::string name = (status == 0 && demangled != nullptr) ? demangled : type.name();
+	free(demangled);
+	if (name.compare(0, 9, "webserv::") == 0)
+		name.erase(0, 9);
+	return (name);
+}
+
+void LoopProfile::start_poll(void)
+{
+	poll_start = std::chrono::steady_clock::now();
+}
+
+void LoopProfile::end_poll(int ready_count)
+{
+	iteration_start = std::chrono::steady_clock::now();
+	poll_duration.record(iteration_start - poll_start);
+	iteration_ready = ready_count < 0 ? 0 : static_cast<size_t>(ready_count);
+	iteration_slowest = Call();
+}
+
+LoopProfile::Call LoopProfile::start_call(Pollable const* pollable, sockfd_t fd, short revents, Phase phase)
+{
+	Call call = Call();
+	std::type_index type(typeid(*pollable));
+	auto it = types.find(type);
+	if (it == types.end())
+		it = types.insert({type, TypeStats {type_name(typeid(*pollable)), Histogram(), 0, std::chrono::steady_clock::duration::zero()}}).first;
+	call.type = &it->second;
+	Connection const* connection = dynamic_cast<Connection const*>(pollable);
+	if (connection != nullptr)
+		call.state = Connection::get_state_name(connection->get_state());
+	call.phase = phase;
+	call.fd = fd;
+	call.revents = revents;
+	call.start = std::chrono::steady_clock::now();
+	return (call);
+}
+
+void LoopProfile::end_call(Call& call)
+{
+	call.duration = std::chrono::steady_clock::now() - call.start;
+	TypeStats& stats = *call.type;
+	if (call.phase == NOTIFY)
+		stats.dispatch.record(call.duration);
+	else
+	{
+		++stats.post_poll_calls;
+		stats.post_poll_time += call.duration;
+	}
+	if (call.duration <= iteration_slowest.duration)
+		return ;
+	call.time = std::time(nullptr);
+	iteration_slowest = call;
+
+	if (slowest_calls.size() == LOOP_SLOWEST_CALLS && call.duration <= slowest_calls.back().duration)
+		return ;
+	auto position = std::find_if(slowest_calls.begin(), slowest_calls.end(),
+		[&](Call const& other) { return (other.duration < call.duration); });
+	slowest_calls.insert(position, call);
+	if (slowest_calls.size() > LOOP_SLOWEST_CALLS)
+		slowest_calls.pop_back();
+}
+
+void LoopProfile::end_iteration(void)
+{
+	std::chrono::steady_clock::duration busy = std::chrono::steady_clock::now() - iteration_start;
+	busy_duration.record(busy);
+	++iterations;
+	ready += iteration_ready;
+	max_ready = std::max(max_ready, iteration_ready);
+
+	if (busy < std::chrono::milliseconds(LOOP_SLOW_ITERATION))
+		return ;
+	SlowIteration slow = {std::time(nullptr), busy, iteration_ready, iteration_slowest};
+	if (slow_iterations.size() < LOOP_SLOW_ITERATIONS)
+		slow_iterations.push_back(slow);
+	else
+		slow_iterations[next_slow_iteration] = slow;
+	next_slow_iteration = (next_slow_iteration + 1) % LOOP_SLOW_ITERATIONS;
+}
+
+static std::string format_ms(std::chrono::steady_clock::duration duration)
+{
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.3fms", std::chrono::duration<double, std::milli>(duration).count());
+	return (buffer);
+}
+
+static std::string format_ms(double seconds)
+{
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.3fms", seconds * 1000);
+	return (buffer);
+}
+
+static std::string format_time(time_t time)
+{
+	char buffer[32];
+	struct tm local;
+	localtime_r(&time, &local);
+	strftime(buffer, sizeof(buffer), "%H:%M:%S", &local);
+	return (buffer);
+}
+
+static std::string format_histogram(Histogram const& histogram)
+{
+	return (std::to_string(histogram.get_count()) + " calls, p50 " + format_ms(histogram.percentile(0.5))
+		+ ", p99 " + format_ms(histogram.percentile(0.99)) + ", max " + format_ms(histogram.get_max()));
+}
+
+static std::string format_call(LoopProfile::Call const& call)
+{
+	if (call.type == nullptr)
+		return ("none");
+	std::string text = format_ms(call.duration) + ' ' + call.type->name + " fd " + std::to_string(call.fd)
+		+ (call.phase == LoopProfile::NOTIFY ? " notify" : " on_post_poll");
+	if (call.state != nullptr)
+		text += std::string(" (") + call.state + ')';
+	if (call.revents != 0)
+	{
+		char revents[32];
+		snprintf(revents, sizeof(revents), " revents 0x%x", static_cast<unsigned>(call.revents));
+		text += revents;
+	}
+	return (text);
+}
+
+void LoopProfile::dump(void) const
+{
+	char average[32];
+	snprintf(average, sizeof(average), "%.2f", iterations == 0 ? 0.0 : static_cast<double>(ready) / iterations);
+	LOG_INFO("Event loop: " << iterations << " iterations, " << average
+		<< " ready descriptors on average, " << max_ready << " at most");
+	LOG_INFO("  poll(): p50 " << format_ms(poll_duration.percentile(0.5)) << ", p99 " << format_ms(poll_duration.percentile(0.99)));
+	LOG_INFO("  after poll(): p50 " << format_ms(busy_duration.percentile(0.5)) << ", p99 " << format_ms(busy_duration.percentile(0.99))
+		<< ", max " << format_ms(busy_duration.get_max()));
+	for (auto const& pair : types)
+	{
+		TypeStats const& stats = pair.second;
+		LOG_INFO("  " << stats.name << ": notify() " << format_histogram(stats.dispatch)
+			<< "; on_post_poll() " << stats.post_poll_calls << " calls, " << format_ms(stats.post_poll_time) << " in total");
+	}
+	LOG_INFO("  Slowest calls:");
+	for (Call const& call : slowest_calls)
+		LOG_INFO("    " << format_time(call.time) << ' ' << format_call(call));
+	LOG_INFO("  Iterations over " << LOOP_SLOW_ITERATION << "ms (oldest first):");
+	for (size_t i = 0; i < slow_iterations.size(); ++i)
+	{
+		// Once the ring is full the oldest is the next one to be overwritten
+		SlowIteration const& slow = slow_iterations[(slow_iterations.size() < LOOP_SLOW_ITERATIONS ? i : (next_slow_iteration + i) % LOOP_SLOW_ITERATIONS)];
+		LOG_INFO("    " << format_time(slow.time) << ' ' << format_ms(slow.busy) << ", " << slow.ready
+			<< " ready, slowest: " << format_call(slow.slowest));
+	}
+}
+
+uint64_t LoopProfile::get_iterations(void) const { return (iterations); }
+uint64_t LoopProfile::get_ready(void) const { return (ready); }
+size_t LoopProfile::get_max_ready(void) const { return (max_ready); }
+Histogram const& LoopProfile::get_poll_duration(void) const { return (poll_duration); }
+Histogram const& LoopProfile::get_busy_duration(void) const { return (busy_duration); }
+std::unordered_map<std::type_index, LoopProfile::TypeStats> const& LoopProfile::get_types(void) const { return (types); }
+
+} // namespace webserv
@@ -0,0 +1,365 @@
+#include "Metrics.h"
+#include "AccessLog.h"
+#include "CGIQueue.h"
+#include "Connection.h"
+#include "LoopProfile.h"
+#include "Upstream.h"
+
+#include <cstdio>
+
+namespace webserv {
+
+// Values below 8µs have a bucket each, then every power of two has HISTOGRAM_SUB_BUCKETS
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + (HISTOGRAM_MAX_EXPONENT - 3) * HISTOGRAM_SUB_BUCKETS)
+// Bounds of the Prometheus buckets: powers of two of microseconds, 64µs up to 134s
+#define PROMETHEUS_FIRST_EXPONENT 6
+#define PROMETHEUS_LAST_EXPONENT 27
+
+Histogram::Histogram(void) : buckets(HISTOGRAM_BUCKETS, 0), count(0), sum(0), max(0) {}
+
+size_t Histogram::bucket_of(uint64_t microseconds)
+{
+	if (microseconds < HISTOGRAM_SUB_BUCKETS)
+		return (microseconds);
+	size_t exponent = 63 - __builtin_clzll(microseconds);
+	if (exponent >= HISTOGRAM_MAX_EXPONENT)
+		return (HISTOGRAM_BUCKETS - 1);
+	size_t sub_bucket = (microseconds >> (exponent - 3)) & (HISTOGRAM_SUB_BUCKETS - 1);
+	return (HISTOGRAM_SUB_BUCKETS + (exponent - 3) * HISTOGRAM_SUB_BUCKETS + sub_bucket);
+}
+
+// First value after the bucket
+uint64_t Histogram::bucket_end(size_t bucket)
+{
+	if (bucket < HISTOGRAM_SUB_BUCKETS)
+		return (bucket + 1);
+	size_t exponent = (bucket - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS + 3;
+	size_t sub_bucket = (bucket - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS;
+	return (static_cast<uint64_t>(HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << (exponent - 3));
+}
+
+void Histogram::record(std::chrono::steady_clock::duration duration)
+{
+	int64_t microseconds = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+	uint64_t value = microseconds < 0 ? 0 : static_cast<uint64_t>(microseconds);
+	++buckets[bucket_of(value)];
+	++count;
+	sum += value;
+	max = std::max(max, value);
+}
+
+uint64_t Histogram::get_count(void) const { return (count); }
+double Histogram::get_sum(void) const { return (sum / 1e6); }
+double Histogram::get_max(void) const { return (max / 1e6); }
+
+double Histogram::percentile(double fraction) const
+{
+	if (count == 0)
+		return (0);
+	uint64_t rank = static_cast<uint64_t>(fraction * count + 0.5);
+	rank = std::max<uint64_t>(rank, 1);
+	uint64_t seen = 0;
+	for (size_t bucket = 0; bucket < buckets.size(); ++bucket)
+	{
+		seen += buckets[bucket];
+		if (seen >= rank)
+			return (std::min(bucket_end(bucket) - 1, max) / 1e6);
+	}
+	return (max / 1e6);
+}
+
+uint64_t Histogram::count_below(uint64_t microseconds) const
+{
+	uint64_t below = 0;
+	for (size_t bucket = 0; bucket < buckets.size() && bucket_end(bucket) <= microseconds; ++bucket)
+		below += buckets[bucket];
+	return (below);
+}
+
+Metrics::Metrics(void)
+:	start_time(std::time(nullptr)),
+	connections_accepted(0),
+	connections_closed(0),
+	requests(),
+	responses(),
+	bytes_received(0),
+	bytes_sent(0),
+	cgi_spawns(0),
+	cgi_failures(0)
+{}
+
+// Unused
+Metrics::Metrics(Metrics const& other) { (void)other; }
+Metrics& Metrics::operator=(Metrics const& other) { (void)other; return *this; }
+//END
+
+Metrics& Metrics::get(void)
+{
+	static Metrics metrics;
+	return (metrics);
+}
+
+#define STATE_COUNT (Connection::CLOSE + 1)
+
+// Open connections by State, read off the event loop when scraped
+static void count_connections(pollable_map_t const& fd_map, size_t (&connections)[STATE_COUNT])
+{
+	for (auto const& pair : fd_map)
+	{
+		Connection const* connection = dynamic_cast<Connection const*>(pair.second);
+		// Connections are in the map once, under their own fd
+		if (connection != nullptr && connection->get_fd() == pair.first)
+			++connections[connection->get_state()];
+	}
+}
+
+static std::string format_number(double value)
+{
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.9g", value);
+	return (buffer);
+}
+
+// Names of upstreams and CGI queues come from the config, they're escaped for both formats
+static std::string escape(std::string const& value)
+{
+	std::string escaped;
+	for (unsigned char c : value)
+	{
+		if (c == '"' || c == '\\')
+			escaped += '\\';
+		if (c == '\n')
+			escaped += "\\n";
+		else if (c >= 0x20 && c != 0x7f)
+			escaped += static_cast<char>(c);
+	}
+	return (escaped);
+}
+
+static void prometheus_header(std::string& out, char const* name, char const* type, char const* help)
+{
+	out += "# HELP ";
+	out += name;
+	out += ' ';
+	out += help;
+	out += "\n# TYPE ";
+	out += name;
+	out += ' ';
+	out += type;
+	out += '\n';
+}
+
+static void prometheus_metric(std::string& out, char const* name, char const* type, char const* help, uint64_t value)
+{
+	prometheus_header(out, name, type, help);
+	out += name;
+	out += ' ';
+	out += std::to_string(value);
+	out += '\n';
+}
+
+// One histogram of a metric, labels is empty or like "type=\"Connection\","
+static void prometheus_buckets(std::string& out, char const* name, std::string const& labels, Histogram const& histogram)
+{
+	std::string prefix(name);
+	for (size_t exponent = PROMETHEUS_FIRST_EXPONENT; exponent <= PROMETHEUS_LAST_EXPONENT; ++exponent)
+	{
+		uint64_t bound = static_cast<uint64_t>(1) << exponent;
+		out += prefix + "_bucket{" + labels + "le=\"" + format_number(bound / 1e6) + "\"} ";
+		out += std::to_string(histogram.count_below(bound)) + '\n';
+	}
+	out += prefix + "_bucket{" + labels + "le=\"+Inf\"} " + std::to_string(histogram.get_count()) + '\n';
+	std::string braces = labels.empty() ? "" : '{' + labels.substr(0, labels.size() - 1) + '}';
+	out += prefix + "_sum" + braces + ' ' + format_number(histogram.get_sum()) + '\n';
+	out += prefix + "_count" + braces + ' ' + std::to_string(histogram.get_count()) + '\n';
+}
+
+static void prometheus_histogram(std::string& out, char const* name, char const* help, Histogram const& histogram)
+{
+	prometheus_header(out, name, "histogram", help);
+	prometheus_buckets(out, name, "", histogram);
+}
+
+std::string Metrics::render_prometheus(pollable_map_t const& fd_map)
+{
+	Metrics const& metrics = get();
+	std::string out;
+
+	size_t connections[STATE_COUNT] = {};
+	count_connections(fd_map, connections);
+	prometheus_header(out, "webserv_connections", "gauge", "Open client connections by state.");
+	for (size_t state = 0; state < STATE_COUNT; ++state)
+		out += std::string("webserv_connections{state=\"") + Connection::get_state_name(static_cast<Connection::State>(state)) + "\"} " + std::to_string(connections[state]) + '\n';
+	prometheus_metric(out, "webserv_connections_accepted_total", "counter", "Accepted client connections.", metrics.connections_accepted);
+	prometheus_metric(out, "webserv_connections_closed_total", "counter", "Closed client connections.", metrics.connections_closed);
+
+	prometheus_header(out, "webserv_requests_total", "counter", "Requests by method.");
+	for (size_t type = UNKNOWN; type <= PUT; ++type)
+		out += std::string("webserv_requests_total{method=\"") + get_request_string(static_cast<RequestType>(type)) + "\"} " + std::to_string(metrics.requests[type]) + '\n';
+	prometheus_header(out, "webserv_responses_total", "counter", "Responses by status code.");
+	for (size_t status = 0; status < 600; ++status)
+	{
+		if (metrics.responses[status] != 0)
+			out += "webserv_responses_total{status=\"" + std::to_string(status) + "\"} " + std::to_string(metrics.responses[status]) + '\n';
+	}
+	prometheus_metric(out, "webserv_received_bytes_total", "counter", "Bytes received from clients.", metrics.bytes_received);
+	prometheus_metric(out, "webserv_sent_bytes_total", "counter", "Bytes sent to clients.", metrics.bytes_sent);
+
+	prometheus_histogram(out, "webserv_header_duration_seconds", "Time from the first byte of a request to the end of its header.", metrics.header_duration);
+	prometheus_histogram(out, "webserv_first_byte_duration_seconds", "Time from the first byte of a request to the response header.", metrics.first_byte_duration);
+	prometheus_histogram(out, "webserv_request_duration_seconds", "Time from the first byte of a request to the end of the response.", metrics.request_duration);
+
+	prometheus_metric(out, "webserv_cgi_spawns_total", "counter", "Started CGI processes.", metrics.cgi_spawns);
+	prometheus_metric(out, "webserv_cgi_failures_total", "counter", "CGI processes that couldn't start, failed or were killed.", metrics.cgi_failures);
+	prometheus_histogram(out, "webserv_cgi_duration_seconds", "Run time of CGI processes.", metrics.cgi_duration);
+
+	auto const& queues = CGIQueue::get_all();
+	prometheus_header(out, "webserv_cgi_running", "gauge", "Running CGI processes by queue.");
+	for (auto const& pair : queues)
+		out += "webserv_cgi_running{queue=\"" + escape(pair.first) + "\"} " + std::to_string(pair.second->get_running()) + '\n';
+	prometheus_header(out, "webserv_cgi_queued", "gauge", "Requests waiting for a CGI process by queue.");
+	for (auto const& pair : queues)
+		out += "webserv_cgi_queued{queue=\"" + escape(pair.first) + "\"} " + std::to_string(pair.second->get_queued()) + '\n';
+	prometheus_header(out, "webserv_cgi_rejected_total", "counter", "Requests rejected by a full CGI queue.");
+	for (auto const& pair : queues)
+		out += "webserv_cgi_rejected_total{queue=\"" + escape(pair.first) + "\"} " + std::to_string(pair.second->get_rejected()) + '\n';
+
+	auto const& upstreams = Upstream::get_all();
+	char const* const upstream_names[] = {"webserv_upstream_requests_total", "webserv_upstream_failures_total", "webserv_upstream_active", "webserv_upstream_healthy", "webserv_upstream_latency_seconds"};
+	char const* const upstream_types[] = {"counter", "counter", "gauge", "gauge", "gauge"};
+	char const* const upstream_help[] = {"Requests sent to an upstream member.", "Failed requests to an upstream member.", "Requests in flight to an upstream member.",
+		"Whether the last health probe of an upstream member succeeded.", "Moving average of the time until the response header of an upstream member."};
+	for (size_t i = 0; i < 5; ++i)
+	{
+		prometheus_header(out, upstream_names[i], upstream_types[i], upstream_help[i]);
+		for (auto const& pair : upstreams)
+		{
+			for (UpstreamMember const& member : pair.second->get_members())
+			{
+				out += std::string(upstream_names[i]) + "{upstream=\"" + escape(pair.first) + "\",member=\"" + escape(member.address) + "\"} ";
+				switch (i)
+				{
+					case 0: out += std::to_string(member.requests); break;
+					case 1: out += std::to_string(member.failures); break;
+					case 2: out += std::to_string(member.active); break;
+					case 3: out += member.healthy ? "1" : "0"; break;
+					default: out += format_number(member.latency / 1000); break;
+				}
+				out += '\n';
+			}
+		}
+	}
+
+	LoopProfile const& profile = LoopProfile::get();
+	prometheus_metric(out, "webserv_loop_iterations_total", "counter", "Iterations of the event loop.", profile.get_iterations());
+	prometheus_metric(out, "webserv_loop_ready_total", "counter", "Descriptors poll() returned as ready.", profile.get_ready());
+	prometheus_histogram(out, "webserv_loop_poll_duration_seconds", "Time spent waiting in poll().", profile.get_poll_duration());
+	prometheus_histogram(out, "webserv_loop_busy_duration_seconds", "Time of an event loop iteration after poll() returned.", profile.get_busy_duration());
+	prometheus_header(out, "webserv_loop_dispatch_duration_seconds", "histogram", "Time of handling the events of a descriptor by type.");
+	for (auto const& pair : profile.get_types())
+		prometheus_buckets(out, "webserv_loop_dispatch_duration_seconds", "type=\"" + escape(pair.second.name) + "\",", pair.second.dispatch);
+
+	prometheus_metric(out, "webserv_access_log_dropped_total", "counter", "Access log lines dropped because the buffer was full.", AccessLog::get_dropped());
+	prometheus_metric(out, "webserv_start_time_seconds", "gauge", "Start time of the server since the epoch.", static_cast<uint64_t>(metrics.start_time));
+	return (out);
+}
+
+static void json_histogram(std::string& out, char const* name, Histogram const& histogram)
+{
+	out += std::string("\"") + name + "\":{\"count\":" + std::to_string(histogram.get_count());
+	out += ",\"sum\":" + format_number(histogram.get_sum());
+	out += ",\"p50\":" + format_number(histogram.percentile(0.5));
+	out += ",\"p90\":" + format_number(histogram.percentile(0.9));
+	out += ",\"p99\":" + format_number(histogram.percentile(0.99));
+	out += ",\"p999\":" + format_number(histogram.percentile(0.999));
+	out += ",\"max\":" + format_number(histogram.get_max()) + '}';
+}
+
+// Durations are in seconds, like the Prometheus format
+std::string Metrics::render_json(pollable_map_t const& fd_map)
+{
+	Metrics const& metrics = get();
+	std::string out = "{\"start_time\":" + std::to_string(metrics.start_time);
+
+	size_t connections[STATE_COUNT] = {};
+	count_connections(fd_map, connections);
+	out += ",\"connections\":{";
+	for (size_t state = 0; state < STATE_COUNT; ++state)
+		out += std::string(state == 0 ? "\"" : ",\"") + Connection::get_state_name(static_cast<Connection::State>(state)) + "\":" + std::to_string(connections[state]);
+	out += "},\"connections_accepted\":" + std::to_string(metrics.connections_accepted);
+	out += ",\"connections_closed\":" + std::to_string(metrics.connections_closed);
+
+	out += ",\"requests\":{";
+	for (size_t type = UNKNOWN; type <= PUT; ++type)
+		out += std::string(type == UNKNOWN ? "\"" : ",\"") + get_request_string(static_cast<RequestType>(type)) + "\":" + std::to_string(metrics.requests[type]);
+	out += "},\"responses\":{";
+	bool first = true;
+	for (size_t status = 0; status < 600; ++status)
+	{
+		if (metrics.responses[status] == 0)
+			continue ;
+		out += (first ? "\"" : ",\"") + std::to_string(status) + "\":" + std::to_string(metrics.responses[status]);
+		first = false;
+	}
+	out += "},\"bytes_received\":" + std::to_string(metrics.bytes_received);
+	out += ",\"bytes_sent\":" + std::to_string(metrics.bytes_sent);
+
+	out += ",\"latency\":{";
+	json_histogram(out, "header", metrics.header_duration);
+	out += ',';
+	json_histogram(out, "first_byte", metrics.first_byte_duration);
+	out += ',';
+	json_histogram(out, "request", metrics.request_duration);
+
+	out += "},\"cgi\":{\"spawns\":" + std::to_string(metrics.cgi_spawns);
+	out += ",\"failures\":" + std::to_string(metrics.cgi_failures) + ',';
+	json_histogram(out, "duration", metrics.cgi_duration);
+	out += ",\"queues\":{";
+	first = true;
+	for (auto const& pair : CGIQueue::get_all())
+	{
+		out += (first ? "\"" : ",\"") + escape(pair.first) + "\":{\"running\":" + std::to_string(pair.second->get_running());
+		out += ",\"queued\":" + std::to_string(pair.second->get_queued());
+		out += ",\"rejected\":" + std::to_string(pair.second->get_rejected()) + '}';
+		first = false;
+	}
+
+	out += "}},\"upstreams\":{";
+	first = true;
+	for (auto const& pair : Upstream::get_all())
+	{
+		out += (first ? "\"" : ",\"") + escape(pair.first) + "\":{";
+		bool first_member = true;
+		for (UpstreamMember const& member : pair.second->get_members())
+		{
+			out += (first_member ? "\"" : ",\"") + escape(member.address) + "\":{\"requests\":" + std::to_string(member.requests);
+			out += ",\"failures\":" + std::to_string(member.failures);
+			out += ",\"active\":" + std::to_string(member.active);
+			out += std::string(",\"healthy\":") + (member.healthy ? "true" : "false");
+			out += ",\"latency\":" + format_number(member.latency / 1000) + '}';
+			first_member = false;
+		}
+		out += '}';
+		first = false;
+	}
+	LoopProfile const& profile = LoopProfile::get();
+	out += "},\"loop\":{\"iterations\":" + std::to_string(profile.get_iterations());
+	out += ",\"ready\":" + std::to_string(profile.get_ready());
+	out += ",\"max_ready\":" + std::to_string(profile.get_max_ready()) + ',';
+	json_histogram(out, "poll", profile.get_poll_duration());
+	out += ',';
+	json_histogram(out, "busy", profile.get_busy_duration());
+	out += ",\"dispatch\":{";
+	first = true;
+	for (auto const& pair : profile.get_types())
+	{
+		if (!first)
+			out += ',';
+		json_histogram(out, escape(pair.second.name).c_str(), pair.second.dispatch);
+		first = false;
+	}
+	out += "}},\"access_log_dropped\":" + std::to_string(AccessLog::get_dropped()) + "}\n";
+	return (out);
+}
+
+} // namespace webserv
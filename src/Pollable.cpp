@@ -1,12 +1,14 @@
 #include "Pollable.h"
 #include "Core.h"
+#include "Log.h"
 
 namespace webserv {
 
 void Pollable::notify(short revents, pollable_map_t& fd_map, sockfd_t fd)
 {
-	if (revents & POLLERR) {std::cout << "POLLERR on: " << this->get_fd() << std::endl; return; }
-	if (revents & POLLHUP) {this->on_pollhup(fd_map, fd); return ;}
+	if (revents & POLLERR) LOG_DEBUG("POLLERR on: " << this->get_fd());
+	// An error (like a refused non-blocking connect) ends the descriptor just like a hangup
+	if (revents & (POLLERR | POLLHUP)) {this->on_pollhup(fd_map, fd); return ;}
 	if (revents & POLLIN) {this->on_pollin(fd_map); return ;}
 	if (revents & POLLOUT) {this->on_pollout(fd_map); return ;}
 	if (revents & POLLNVAL)
@@ -14,7 +16,7 @@ void Pollable::notify(short revents, pollable_map_t& fd_map, sockfd_t fd)
 		this->on_pollnval(fd_map);
 		return;
 	}
-	std::cout << "Other event: " << revents << std::endl;
+	LOG_DEBUG("Other event: " << revents);
 }
 
 } // namespace webserv
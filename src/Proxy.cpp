@@ -0,0 +1,575 @@
+#include "Proxy.h"
+#include "Address.h"
+#include "Core.h"
+#include "Log.h"
+
+#include <algorithm>
+
+namespace webserv {
+
+//==============================================================================
+// proxy
+//==============================================================================
+
+bool proxy::parse_url(std::string const& url, std::string& address, std::string& uri)
+{
+	std::string rest = url;
+	if (rest.compare(0, 7, "http://") == 0)
+		rest = rest.substr(7);
+
+	size_t slash = rest.find('/');
+	address = rest.substr(0, slash);
+	uri = (slash == std::string::npos) ? std::string() : rest.substr(slash);
+
+	size_t colon = address.find_last_of(':');
+	if (colon == std::string::npos || colon == 0 || colon + 1 == address.size())
+		return (false);
+	return (address.find_first_not_of("0123456789", colon + 1) == std::string::npos);
+}
+
+// Hop-by-hop fields are about the connection to the client, they aren't forwarded
+static bool is_hop_by_hop(std::string const& field)
+{
+	static std::set<std::string> const fields {
+		"connection", "keep-alive", "proxy-connection", "te", "trailer", "transfer-encoding", "upgrade", "expect"
+	};
+	return (fields.count(field) != 0);
+}
+
+std::string proxy::build_head(Request const& request, Location const& loc, std::string const& client_ip)
+{
+	std::string address, uri;
+	(void)parse_url(loc.proxy_pass, address, uri);
+
+	std::string path = request.path;
+	if (!uri.empty())
+		path = uri + path.substr(std::min(loc.uri_prefix.size(), path.size()));
+	if (!request.path_arguments.empty())
+		path += '?' + request.path_arguments;
+
+	std::string head = std::string(get_request_string(request.type)) + ' ' + path + " HTTP/1.1\r\n";
+	for (auto const& pair : request.fields)
+	{
+		if (is_hop_by_hop(pair.first) || pair.first == "x-forwarded-for")
+			continue ;
+		head += pair.first + ": " + pair.second + "\r\n";
+	}
+	if (request.fields.count("host") == 0)
+		head += "host: " + address + "\r\n";
+
+	auto forwarded = request.fields.find("x-forwarded-for");
+	head += "x-forwarded-for: ";
+	if (forwarded != request.fields.end())
+		head += forwarded->second + ", ";
+	head += client_ip + "\r\n";
+	head += "connection: keep-alive\r\n\r\n";
+	return (head);
+}
+
+//==============================================================================
+// ProxyRequest
+//==============================================================================
+
+ProxyRequest::ProxyRequest(ProxyPool* pool, std::string const& head)
+:	pool(pool),
+	connection(nullptr),
+	head(head),
+	body_sent(0),
+	ended(false) {}
+
+ProxyRequest::~ProxyRequest()
+{
+	if (connection != nullptr)
+		connection->close_connection();
+}
+
+// Unused
+ProxyRequest::ProxyRequest() {}
+ProxyRequest::ProxyRequest(ProxyRequest const& other) : Gateway() { (void)other; }
+ProxyRequest& ProxyRequest::operator=(ProxyRequest const& other) { (void)other; return *this; }
+//END
+
+bool ProxyRequest::is_output_closed(void) const
+{
+	return (ended);
+}
+
+bool ProxyRequest::finish(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	if (connection != nullptr)
+		pool->release(connection);
+	return (true);
+}
+
+// The client is gone, a connection in the middle of a response can't be used again
+void ProxyRequest::abort(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	if (connection != nullptr && !ended)
+		connection->close_connection();
+	ended = true;
+}
+
+bool ProxyRequest::intercept_errors(void) const
+{
+	return (false);
+}
+
+//==============================================================================
+// UpstreamConnection
+//==============================================================================
+
+UpstreamConnection::UpstreamConnection(sockfd_t fd, ProxyPool* pool, bool connecting)
+:	socket_fd(fd),
+	pool(pool),
+	connecting(connecting),
+	closed(false),
+	reused(false),
+	last_time(std::time(nullptr)),
+	request(nullptr),
+	head_sent(0),
+	received(0),
+	parse(DONE),
+	remaining(0),
+	keep_alive(false) {}
+
+UpstreamConnection::~UpstreamConnection()
+{
+	LOG_DEBUG("Upstream connection (" << socket_fd << ") to " << pool->get_address() << " closed.");
+	close(socket_fd);
+}
+
+// Unused
+UpstreamConnection::UpstreamConnection() : socket_fd(-1) {}
+UpstreamConnection::UpstreamConnection(UpstreamConnection const& other) : Pollable() { (void)other; }
+UpstreamConnection& UpstreamConnection::operator=(UpstreamConnection const& other) { (void)other; return *this; }
+//END
+
+sockfd_t UpstreamConnection::get_fd(void) const { return (socket_fd); }
+
+bool UpstreamConnection::should_destroy(void) const { return (closed); }
+
+short UpstreamConnection::get_events(sockfd_t fd) const
+{
+	(void)fd;
+	if (connecting)
+		return (POLLOUT);
+	// Idle connections only wait for the upstream to close them
+	if (request == nullptr)
+		return (POLLIN);
+
+	short events = 0;
+	if (parse != DONE && request->pending_out_size() < PROXY_BUFFER_SIZE)
+		events |= POLLIN;
+	if (head_sent < request->head.size() || request->pending_in_size() > 0)
+		events |= POLLOUT;
+	return (events);
+}
+
+void UpstreamConnection::begin_request(ProxyRequest* request, bool reused)
+{
+	this->request = request;
+	this->reused = reused;
+	request->connection = this;
+	head_sent = 0;
+	received = 0;
+	buffer_in.clear();
+	parse = HEAD;
+	remaining = 0;
+	keep_alive = true;
+	last_time = std::time(nullptr);
+}
+
+void UpstreamConnection::detach(void)
+{
+	if (request != nullptr)
+		request->connection = nullptr;
+	request = nullptr;
+	last_time = std::time(nullptr);
+}
+
+bool UpstreamConnection::is_reusable(void) const
+{
+	return (!closed && !connecting && parse == DONE && keep_alive && buffer_in.empty());
+}
+
+bool UpstreamConnection::is_stale(void) const
+{
+	char c;
+	ssize_t size = recv(socket_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return (size >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK));
+}
+
+void UpstreamConnection::close_connection(void)
+{
+	if (closed)
+		return ;
+	closed = true;
+	if (request != nullptr)
+	{
+		// Part of the response went to the client already
+		request->truncated = (parse != HEAD && parse != DONE);
+		request->ended = true;
+		request->connection = nullptr;
+		request = nullptr;
+	}
+	pool->remove_connection(this);
+}
+
+void UpstreamConnection::on_pollout(pollable_map_t& fd_map)
+{
+	if (connecting)
+	{
+		int error = 0;
+		socklen_t length = sizeof(error);
+		if (getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)
+		{
+			std::cerr << "Upstream connect to " << pool->get_address() << " failed: " << strerror(error) << std::endl;
+			upstream_closed(fd_map);
+			return ;
+		}
+		connecting = false;
+	}
+	if (request == nullptr)
+		return ;
+
+	ssize_t send_size;
+	if (head_sent < request->head.size())
+	{
+		send_size = ::send(socket_fd, request->head.data() + head_sent, request->head.size() - head_sent, 0);
+		if (send_size > 0)
+			head_sent += send_size;
+	}
+	else
+	{
+		send_size = ::send(socket_fd, request->pending_in(), request->pending_in_size(), 0);
+		if (send_size > 0)
+		{
+			request->consume_in(send_size);
+			request->body_sent += send_size;
+		}
+	}
+	if (send_size > 0)
+		last_time = std::time(nullptr);
+}
+
+void UpstreamConnection::on_pollin(pollable_map_t& fd_map)
+{
+	char buffer[MAX_SEND_BUFFER_SIZE];
+	ssize_t read_size = recv(socket_fd, buffer, sizeof(buffer), 0);
+	if (read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return ;
+	if (read_size <= 0 || request == nullptr)
+	{
+		// Idle connections aren't supposed to receive anything
+		upstream_closed(fd_map);
+		return ;
+	}
+
+	buffer_in.insert(buffer_in.end(), buffer, buffer + read_size);
+	received += read_size;
+	last_time = std::time(nullptr);
+	parse_response();
+}
+
+void UpstreamConnection::on_pollhup(pollable_map_t& fd_map, sockfd_t fd)
+{
+	(void)fd;
+	// Read what the upstream still sent before hanging up
+	if (!connecting && request != nullptr && !closed)
+	{
+		on_pollin(fd_map);
+		if (closed)
+			return ;
+	}
+	upstream_closed(fd_map);
+}
+
+void UpstreamConnection::on_post_poll(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	if (!closed && request == nullptr && std::time(nullptr) - last_time >= PROXY_IDLE_TIMEOUT)
+		close_connection();
+}
+
+// A reused connection that closed before answering was closed by the upstream while it was idle.
+// The request is sent again on a new connection as long as none of its body is lost.
+void UpstreamConnection::upstream_closed(pollable_map_t& fd_map)
+{
+	if (request != nullptr && parse == BODY_UNTIL_CLOSE)
+	{
+		parse = DONE;
+		request->ended = true;
+	}
+	else if (request != nullptr && reused && received == 0 && request->body_sent == 0)
+	{
+		ProxyRequest* retry = request;
+		detach();
+		close_connection();
+		try { pool->start_request(fd_map, retry, false); }
+		catch (std::exception& e)
+		{
+			std::cerr << "UpstreamConnection::upstream_closed(): " << e.what() << std::endl;
+			retry->ended = true;
+		}
+		return ;
+	}
+	close_connection();
+}
+
+// Returns the size of the head, 0 when it isn't complete yet
+size_t UpstreamConnection::parse_head(char const* data, size_t size)
+{
+	static char const end[] = "\r\n\r\n";
+	char const* found = std::search(data, data + size, end, end + 4);
+	if (found == data + size)
+	{
+		if (size > PROXY_MAX_HEADER_SIZE)
+			close_connection();
+		return (0);
+	}
+	size_t head_size = found - data + 4;
+
+	std::stringstream stream(std::string(data, head_size));
+	std::string line;
+	std::getline(stream, line);
+	if (!line.empty() && line.back() == '\r')
+		line.pop_back();
+
+	// HTTP/1.x code reason
+	size_t space = line.find(' ');
+	std::string version = line.substr(0, space);
+	std::string status = (space == std::string::npos) ? std::string() : line.substr(space + 1);
+	if (version.compare(0, 5, "HTTP/") != 0 || status.size() < 3)
+	{
+		close_connection();
+		return (0);
+	}
+	// Interim responses (100 Continue) are dropped
+	if (status[0] == '1')
+		return (head_size);
+
+	keep_alive = (version != "HTTP/1.0");
+	bool chunked = false;
+	bool has_length = false;
+	std::string output = "Status: " + status + "\r\n";
+
+	while (std::getline(stream, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		size_t colon = line.find(':');
+		if (colon == std::string::npos)
+			continue ;
+		std::string field = line.substr(0, colon);
+		std::string value = line.substr(line.find_first_not_of(" \t", colon + 1) == std::string::npos
+			? line.size() : line.find_first_not_of(" \t", colon + 1));
+		std::transform(field.begin(), field.end(), field.begin(), ::tolower);
+
+		if (field == "connection")
+		{
+			std::string lower = value;
+			std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+			if (lower.find("close") != std::string::npos)
+				keep_alive = false;
+			else if (lower.find("keep-alive") != std::string::npos)
+				keep_alive = true;
+		}
+		else if (field == "transfer-encoding")
+			chunked = (value.find("chunked") != std::string::npos);
+		else if (field == "content-length")
+		{
+			try { remaining = std::stoul(value); }
+			catch (std::exception& e) { close_connection(); return (0); }
+			has_length = true;
+		}
+		if (!is_hop_by_hop(field) && field != "content-length")
+			output += field + ": " + value + "\r\n";
+	}
+
+	// The body is decoded, the client gets its own framing
+	std::string code = status.substr(0, 3);
+	if (code == "204" || code == "304")
+	{
+		remaining = 0;
+		parse = DONE;
+	}
+	else if (chunked)
+		parse = CHUNK_SIZE;
+	else if (has_length)
+		parse = (remaining == 0) ? DONE : BODY_LENGTH;
+	else
+	{
+		parse = BODY_UNTIL_CLOSE;
+		keep_alive = false;
+	}
+	if (has_length && !chunked)
+		output += "content-length: " + std::to_string(remaining) + "\r\n";
+	else if (parse == DONE)
+		output += "content-length: 0\r\n";
+	output += "\r\n";
+
+	request->buffer_out.insert(request->buffer_out.end(), output.begin(), output.end());
+	return (head_size);
+}
+
+void UpstreamConnection::parse_response(void)
+{
+	size_t pos = 0;
+	bool incomplete = false; // The rest of the buffer isn't a complete head or line
+	while (!incomplete && !closed && request != nullptr && parse != DONE && pos < buffer_in.size())
+	{
+		char const* data = buffer_in.data() + pos;
+		size_t size = buffer_in.size() - pos;
+		size_t used = 0;
+
+		switch (parse)
+		{
+			case HEAD:
+				used = parse_head(data, size);
+				incomplete = (used == 0);
+				break ;
+			case BODY_LENGTH:
+			case CHUNK_DATA:
+				used = std::min(size, remaining);
+				request->buffer_out.insert(request->buffer_out.end(), data, data + used);
+				remaining -= used;
+				if (remaining == 0)
+					parse = (parse == BODY_LENGTH) ? DONE : CHUNK_END;
+				break ;
+			case BODY_UNTIL_CLOSE:
+				used = size;
+				request->buffer_out.insert(request->buffer_out.end(), data, data + used);
+				break ;
+			case CHUNK_SIZE:
+			case CHUNK_END:
+			case TRAILER:
+			{
+				char const* eol = static_cast<char const*>(std::memchr(data, '\n', size));
+				if (eol == nullptr)
+				{
+					if (size > PROXY_MAX_HEADER_SIZE)
+						close_connection();
+					incomplete = true;
+					break ;
+				}
+				used = eol - data + 1;
+				std::string line(data, used);
+				if (parse == CHUNK_SIZE)
+				{
+					// Chunk extensions after ';' are ignored
+					try { remaining = std::stoul(line, nullptr, 16); }
+					catch (std::exception& e) { close_connection(); break ; }
+					parse = (remaining == 0) ? TRAILER : CHUNK_DATA;
+				}
+				else if (parse == CHUNK_END)
+					parse = CHUNK_SIZE;
+				else if (line == "\r\n" || line == "\n")
+					parse = DONE;
+				break ;
+			}
+			case DONE: break ;
+		}
+		pos += used;
+	}
+
+	buffer_in.erase(buffer_in.begin(), buffer_in.begin() + std::min(pos, buffer_in.size()));
+	if (parse == DONE && request != nullptr)
+	{
+		request->ended = true;
+		// Anything after the response means the upstream and us disagree on the framing
+		if (!buffer_in.empty())
+			keep_alive = false;
+	}
+}
+
+//==============================================================================
+// ProxyPool
+//==============================================================================
+
+ProxyPool::ProxyPool(std::string const& address) : address(address), max_idle(PROXY_DEFAULT_CONNECTIONS) {}
+
+ProxyPool& ProxyPool::get(std::string const& address)
+{
+	static std::unordered_map<std::string, std::unique_ptr<ProxyPool>> pools;
+
+	auto it = pools.find(address);
+	if (it == pools.end())
+		it = pools.emplace(address, std::unique_ptr<ProxyPool>(new ProxyPool(address))).first;
+	return (*it->second);
+}
+
+std::string const& ProxyPool::get_address(void) const { return (address); }
+
+ProxyRequest* ProxyPool::new_request(pollable_map_t& fd_map, std::string const& head, size_t max_idle)
+{
+	this->max_idle = max_idle;
+	ProxyRequest* request = new ProxyRequest(this, head);
+	try { start_request(fd_map, request, true); }
+	catch (std::exception& e)
+	{
+		delete request;
+		throw ;
+	}
+	return (request);
+}
+
+void ProxyPool::start_request(pollable_map_t& fd_map, ProxyRequest* request, bool allow_idle)
+{
+	while (allow_idle && !idle.empty())
+	{
+		UpstreamConnection* connection = idle.back();
+		idle.pop_back();
+		if (connection->is_stale())
+		{
+			connection->close_connection();
+			continue ;
+		}
+		connection->begin_request(request, true);
+		return ;
+	}
+	open_connection(fd_map)->begin_request(request, false);
+}
+
+void ProxyPool::release(UpstreamConnection* connection)
+{
+	bool reusable = connection->is_reusable();
+	connection->detach();
+	if (reusable && idle.size() < max_idle)
+		idle.push_back(connection);
+	else
+		connection->close_connection();
+}
+
+void ProxyPool::remove_connection(UpstreamConnection* connection)
+{
+	auto it = std::find(idle.begin(), idle.end(), connection);
+	if (it != idle.end())
+		idle.erase(it);
+}
+
+UpstreamConnection* ProxyPool::open_connection(pollable_map_t& fd_map)
+{
+	Address const& target = Address::get(address);
+	sockfd_t fd = socket(target.get_family(), SOCK_STREAM, 0);
+	if (fd < 0)
+		throw (std::runtime_error(std::string("Upstream socket: ") + strerror(errno)));
+	int connected = -1;
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == 0)
+		connected = connect(fd, target.get_addr(), target.length);
+
+	if (connected < 0 && errno != EINPROGRESS)
+	{
+		std::string message = strerror(errno);
+		close(fd);
+		throw (std::runtime_error("Upstream connect to " + address + " failed: " + message));
+	}
+
+	UpstreamConnection* connection = new UpstreamConnection(fd, this, connected < 0);
+	fd_map.insert({fd, connection});
+	LOG_DEBUG("Upstream connection (" << fd << ") to " << address << " opened.");
+	return (connection);
+}
+
+} // namespace webserv
@@ -0,0 +1,161 @@
+#include "Reaper.h"
+#include "Core.h"
+
+#include <csignal>
+#include <stdexcept>
+#ifdef __linux__
+# include <sys/signalfd.h>
+#endif
+
+namespace webserv {
+
+// The Reaper in the fd_map, without one children are waited for directly
+static Reaper* s_reaper = nullptr;
+
+#ifndef __linux__
+static sockfd_t s_signal_pipe = -1;
+
+static void on_sigchld(int signal)
+{
+	(void)signal;
+	int saved_errno = errno;
+	(void)write(s_signal_pipe, "", 1);
+	errno = saved_errno;
+}
+#endif
+
+#ifdef __linux__
+
+// SIGCHLD is blocked, so it's only seen through the signalfd.
+// The CGIs are spawned with an empty signal mask.
+Reaper::Reaper() : destroy(false)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+		throw std::runtime_error(std::string("Reaper::Reaper(): ") + strerror(errno));
+
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd == -1)
+		throw std::runtime_error(std::string("Reaper::Reaper(): ") + strerror(errno));
+	s_reaper = this;
+}
+
+Reaper::~Reaper()
+{
+	close(signal_fd);
+	s_reaper = nullptr;
+}
+
+#else
+
+Reaper::Reaper() : destroy(false)
+{
+	if (pipe(signal_pipe) == -1)
+		throw std::runtime_error(std::string("Reaper::Reaper(): ") + strerror(errno));
+	for (sockfd_t fd : signal_pipe)
+	{
+		(void)fcntl(fd, F_SETFL, O_NONBLOCK);
+		(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	signal_fd = signal_pipe[0];
+	s_signal_pipe = signal_pipe[1];
+
+	struct sigaction action = {};
+	action.sa_handler = on_sigchld;
+	action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGCHLD, &action, NULL) == -1)
+		throw std::runtime_error(std::string("Reaper::Reaper(): ") + strerror(errno));
+	s_reaper = this;
+}
+
+Reaper::~Reaper()
+{
+	(void)std::signal(SIGCHLD, SIG_DFL);
+	s_signal_pipe = -1;
+	close(signal_pipe[0]);
+	close(signal_pipe[1]);
+	s_reaper = nullptr;
+}
+
+#endif
+
+// Unused
+Reaper::Reaper(Reaper const& other) : Pollable() { (void)other; }
+Reaper& Reaper::operator=(Reaper const& other) { (void)other; return *this; }
+//END
+
+sockfd_t Reaper::get_fd(void) const { return (signal_fd); }
+
+bool Reaper::should_destroy(void) const { return (destroy); }
+
+short Reaper::get_events(sockfd_t fd) const
+{
+	(void)fd;
+	return (POLLIN);
+}
+
+void Reaper::on_pollin(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	// Several SIGCHLDs can be merged into one, so everything that exited is reaped
+	char buffer[256];
+	while (read(signal_fd, buffer, sizeof(buffer)) > 0)
+		;
+	reap();
+}
+
+void Reaper::on_pollout(pollable_map_t& fd_map) { (void)fd_map; }
+
+// Only happens when the server shuts down, from here on the children are waited for directly
+void Reaper::on_pollhup(pollable_map_t& fd_map, sockfd_t fd)
+{
+	(void)fd_map; (void)fd;
+	reap();
+	destroy = true;
+}
+
+void Reaper::reap(void)
+{
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+		auto it = children.find(pid);
+		if (it != children.end())
+			it->second = status;
+	}
+}
+
+void Reaper::watch(pid_t pid)
+{
+	if (s_reaper != nullptr)
+		s_reaper->children[pid] = -1;
+}
+
+void Reaper::forget(pid_t pid)
+{
+	if (s_reaper != nullptr)
+		s_reaper->children.erase(pid);
+}
+
+bool Reaper::has_exited(pid_t pid, int& status)
+{
+	if (s_reaper == nullptr)
+	{
+		status = 0;
+		pid_t rpid = waitpid(pid, &status, WNOHANG);
+		return (rpid > 0 || (rpid == -1 && errno == ECHILD)); // ECHILD: reaped already
+	}
+
+	auto it = s_reaper->children.find(pid);
+	if (it == s_reaper->children.end() || it->second == -1)
+		return (false);
+	status = it->second;
+	s_reaper->children.erase(it);
+	return (true);
+}
+
+} // namespace webserv
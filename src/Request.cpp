@@ -1,11 +1,12 @@
 #include "Request.h"
+#include "Log.h"
 #include <algorithm>
 #include <cctype>
 #include <unordered_map>
 
 namespace webserv {
 
-Request::Request() : validity(INVALID) {}
+Request::Request() : validity(INVALID), type(UNKNOWN) {}
 static char convert_hex_to_dec(char c){
 	if (c >= 'a' && c <= 'f'){
 		return c - 87;
@@ -25,7 +26,7 @@ static std::string convert_hex_in_url(std::string const & url_string){
 		}
 		int temp = convert_hex_to_dec(str[pos + 1]);
 		int temp2 = convert_hex_to_dec(str[pos + 2]);
-		std::cout << "temp " << temp << " " << temp2 << std::endl;
+		LOG_DEBUG("temp " << temp << " " << temp2);
 		if (temp == -1 || temp2 == -1){
 			pos = pos + 1;
 			continue;
@@ -42,6 +43,7 @@ RequestType get_request_type(std::string const& word)
 	if (word == "GET")		return GET;
 	if (word == "POST")		return POST;
 	if (word == "DELETE")	return DELETE;
+	if (word == "PUT")		return PUT;
 	return  UNKNOWN;
 }
 
@@ -52,6 +54,7 @@ char const* get_request_string(RequestType type)
 		case GET: return "GET";
 		case POST: return "POST";
 		case DELETE: return "DELETE";
+		case PUT: return "PUT";
 		default: break;
 	}
 	return "UNKNOWN";
@@ -127,7 +130,7 @@ void parse_header_fields(std::unordered_map<std::string, std::string>& fields, s
 	if (tg > 0)
 		buffer.erase(buffer.begin(), buffer.begin() + tg);
 	else
-		std::cout << "tg == " << tg << std::endl;
+		LOG_DEBUG("tg == " << tg);
 	
 	// std::cout << "Left over buffer {" << std::string(buffer.data(), buffer.size()) << '}' << std::endl;
 
@@ -6,30 +6,47 @@ std::unordered_map<std::string, std::string> const& Response::status_code_messag
 std::unordered_map<std::string, std::string> const& Response::init_status_messages(void){
 	static std::unordered_map<std::string , std::string> const messages
 	{
+		{"100", "Continue"},
 		{"200", "OK"},
 		{"201", "Created"},
+		{"202", "Accepted"},
+		{"203", "Non-Authoritative Information"},
+		{"204", "No Content"},
+		{"205", "Reset Content"},
+		{"206", "Partial Content"},
 		{"300", "Multiple Choices"},
 		{"301", "Moved Permanently"},
 		{"302", "Found"},
 		{"303", "See Other"},
+		{"304", "Not Modified"},
 		{"307", "Temporary Redirect"},
 		{"308", "Permanent Redirect"},
 		{"400", "Bad Request"},
+		{"401", "Unauthorized"},
 		{"403", "Forbidden"},
 		{"404", "Not Found"},
 		{"405", "Method Not Allowed"},
+		{"406", "Not Acceptable"},
 		{"408", "Request Timeout"},
+		{"409", "Conflict"},
+		{"410", "Gone"},
 		{"411", "Length Required"},
+		{"412", "Precondition Failed"},
 		{"413", "Payload Too Large"},
 		{"414", "URI Too Long"},
 		{"415", "Unsupported Media Type"},
+		{"416", "Range Not Satisfiable"},
+		{"417", "Expectation Failed"},
 		{"421", "Request Header Fields Too Large"},
+		{"422", "Unprocessable Entity"},
+		{"429", "Too Many Requests"},
 		{"500", "Internal Server Error"},
 		{"501", "Not Implemented"},
 		{"502", "Bad Gateway"},
 		{"503", "Service Unavailable"},
 		{"504", "Gateway Timeout"},
-		{"505", "HTTP Version Not Supported"}
+		{"505", "HTTP Version Not Supported"},
+		{"507", "Insufficient Storage"}
 	};
 	return messages;
 }
@@ -1,4 +1,8 @@
 #include "Server.h"
+#include "FastCGI.h"
+#include "Proxy.h"
+
+#include <map>
 
 namespace webserv{
 
@@ -6,9 +10,9 @@ namespace webserv{
 //Location class
 //==============================================================================
 
-Location::Location(void):autoindex(std::make_pair(false, false)), client_max_body_size(std::make_pair(false, 0)){}
+Location::Location(void):match(PREFIX), autoindex(std::make_pair(false, false)), client_max_body_size(std::make_pair(false, 0)), fastcgi_connections(FASTCGI_DEFAULT_CONNECTIONS), cgi_splice(false), cgi_cache(0), cgi_max_concurrent(0), cgi_queue_size(0), proxy_connections(PROXY_DEFAULT_CONNECTIONS), cgi_timeout(0), cgi_spool_threshold(0), metrics(false), effective_autoindex(false), effective_client_max_body_size(0), allowed_methods(0), error_page_base(0){}
 
-Location::Location(std::string const & loc_path):path(loc_path){}
+Location::Location(std::string const & loc_path):path(loc_path), match(PREFIX), fastcgi_connections(FASTCGI_DEFAULT_CONNECTIONS), cgi_splice(false), cgi_cache(0), cgi_max_concurrent(0), cgi_queue_size(0), proxy_connections(PROXY_DEFAULT_CONNECTIONS), cgi_timeout(0), cgi_spool_threshold(0), metrics(false), effective_autoindex(false), effective_client_max_body_size(0), allowed_methods(0), error_page_base(0){}
 
 Location::~Location(void){}
 
@@ -67,7 +71,7 @@ bool Location::is_http_command_allowed(std::string const & http_command) const{
 	}
 }
 
-std::string Location::get_cgi_path(std::string const & path) {
+std::string Location::get_cgi_path(std::string const & path) const{
 	if(cgi.empty() || (path.find('.',0) == std::string::npos)){
 		return std::string();
 	}
@@ -98,21 +102,6 @@ Server::Server(void):port(80),root("/var/www/html"), index(""),autoindex(false),
 
 Server::~Server(void){};
 
-
-//this function will compare the input_path with loc_block_path and return how much input_path match the loc_block_path.
-//return the amount of characters is matches from left to right. It will return 0 if it doesn't match.
-size_t Server::match_paths(std::string const & input_path, std::string const & loc_block_path){
-	
-	if(input_path.empty() || loc_block_path.empty() || input_path.size() < loc_block_path.size()){
-		return 0;
-	}
-	size_t size_loc_block_path = loc_block_path.size();
-	if(input_path.compare(0, size_loc_block_path, loc_block_path) == 0){
-		return size_loc_block_path;
-	}
-	return 0;
-}
-
 //setters
 void	Server::add_server_name(std::string const & server_name){
 	server_names.push_back(server_name);
@@ -126,26 +115,118 @@ void Server::add_allowed_http_command(std::string const & http_command){
 	allowed_http_commands.push_back(http_command);
 }
 
-void Server::add_location(Location const & location_block){
+static void regex_free(regex_t* regex){
+	regfree(regex);
+	delete regex;
+}
+
+bool Server::add_location(Location const & location_block){
+	if(location_block.match == Location::EXACT){
+		exact_locations.emplace(location_block.path, locations.size());
+	} else if(location_block.match == Location::REGEX || location_block.match == Location::REGEX_ICASE){
+		//compiled once, the regex is only run against request paths
+		int flags = REG_EXTENDED | REG_NOSUB | (location_block.match == Location::REGEX_ICASE ? REG_ICASE : 0);
+		regex_t* regex = new regex_t;
+		if(regcomp(regex, location_block.path.c_str(), flags) != 0){
+			delete regex;
+			return false;
+		}
+		regex_locations.push_back({std::shared_ptr<regex_t>(regex, regex_free), locations.size()});
+	} else if(!location_block.path.empty()){
+		//a location without a path never matches
+		location_tree.insert(location_block.path, locations.size());
+	}
 	locations.push_back(location_block);
+	return true;
 }
 
-//getters
+//resolves the inheritance of every location, and of the location used when none matches.
+//the getters below only read the result
+void	Server::compile(void){
+	for(size_t i = 0; i < locations.size(); ++i){
+		compile_location(locations[i]);
+	}
+	compile_location(no_location);
+
+	//the locations of the config have no order, the longest regex is tried first
+	std::sort(regex_locations.begin(), regex_locations.end(), [this](RegexLocation const & a, RegexLocation const & b){
+		std::string const & first = locations[a.index].path;
+		std::string const & second = locations[b.index].path;
+		return first.size() != second.size() ? first.size() > second.size() : first < second;
+	});
+}
+
+void	Server::compile_location(Location & location) const{
+	location.effective_root = location.root.empty() ? root : location.root;
+	location.effective_index = location.index.first ? location.index.second : index;
+	location.effective_autoindex = location.autoindex.first ? location.autoindex.second : autoindex;
+	location.effective_client_max_body_size = location.client_max_body_size.first ? location.client_max_body_size.second : client_max_body_size;
+	location.effective_redirect = location.redirect.empty() ? redirect : location.redirect;
+	switch(location.match){
+		case Location::EXACT: location.name = "= " + location.path; break;
+		case Location::REGEX: location.name = "~ " + location.path; break;
+		case Location::REGEX_ICASE: location.name = "~* " + location.path; break;
+		default: location.name = location.path; break;
+	}
+	bool regex = (location.match == Location::REGEX || location.match == Location::REGEX_ICASE);
+	location.uri_prefix = regex ? "/" : location.path;
+	location.upload_path = location.upload_directory;
+	if(!location.upload_path.empty() && location.upload_path[0] != '/'){
+		std::string base = location.uri_prefix;
+		if(base.back() != '/'){
+			base += '/';
+		}
+		location.upload_path = location.effective_root + base + location.upload_path;
+	}
 
-Location	Server::get_location(std::string const & loc_path){
-	
-	Location	current_match;
-	size_t		current_match_length = 0;
-	size_t		result = 0;
+	//no allowed methods anywhere allows all of them
+	std::vector<std::string> const & methods = location.allowed_http_commands.empty() ? allowed_http_commands : location.allowed_http_commands;
+	location.allowed_methods = methods.empty() ? ~0u : 0;
+	for(size_t i = 0; i < methods.size(); ++i){
+		RequestType type = get_request_type(methods[i]);
+		if(type != UNKNOWN){
+			location.allowed_methods |= 1u << type;
+		}
+	}
 
-	for(size_t i = 0; i < locations.size(); ++i){
-		result = match_paths(loc_path,locations[i].path);
-		if(result > current_match_length){
-			current_match = locations[i];
-			current_match_length = result;
+	//pages of the location are in its root, the ones of the server in the root of the server
+	std::map<int, std::string> pages;
+	for(auto const & page : error_pages){
+		pages[page.first] = root + "/" + page.second;
+	}
+	for(auto const & page : location.error_pages){
+		pages[page.first] = location.effective_root + "/" + page.second;
+	}
+	location.error_page_table.clear();
+	if(!pages.empty()){
+		location.error_page_base = pages.begin()->first;
+		location.error_page_table.resize(pages.rbegin()->first - location.error_page_base + 1);
+		for(auto const & page : pages){
+			location.error_page_table[page.first - location.error_page_base] = page.second;
+		}
+	}
+}
+
+//getters
+
+//an exact location is found without looking at the others, the regexes are only run when there is no exact match
+Location const &	Server::get_location(std::string const & loc_path) const{
+	if(!exact_locations.empty()){
+		std::unordered_map<std::string, size_t>::const_iterator exact = exact_locations.find(loc_path);
+		if(exact != exact_locations.end()){
+			return locations[exact->second];
+		}
+	}
+	size_t index = location_tree.find(loc_path);
+	for(size_t i = 0; i < regex_locations.size(); ++i){
+		if(regexec(regex_locations[i].regex.get(), loc_path.c_str(), 0, NULL, 0) == 0){
+			return locations[regex_locations[i].index];
 		}
 	}
-	return current_match;
+	if(index == LocationTree::npos){
+		return no_location;
+	}
+	return locations[index];
 }
 
 bool	Server::contain_server_name(std::string const & server_name) const{
@@ -157,84 +238,39 @@ bool	Server::contain_server_name(std::string const & server_name) const{
 	}
 }
 
-bool	Server::find_http_command(std::vector<std::string> const & http_commands, std::string const & http_command) const{
-	std::vector<std::string>::const_iterator it = std::find(http_commands.begin(), http_commands.end(), http_command);
-	if (it == http_commands.end()){
-		return false;
-	} else {
-		return true;
-	}
+bool Server::is_http_command_allowed(std::string const & http_command, Location const & location) const{
+	return (location.allowed_methods & (1u << get_request_type(http_command))) != 0;
 }
 
-bool Server::is_http_command_allowed(std::string const & http_command, Location const & location) const{
-	if(location.allowed_http_commands.empty()){
-		if(allowed_http_commands.empty()){
-			return true;
-		}
-		return find_http_command(allowed_http_commands, http_command);
-	} else {
-		return find_http_command(location.allowed_http_commands, http_command);
-	}
+bool Server::is_method_allowed(RequestType method, Location const & location) const{
+	return (location.allowed_methods & (1u << method)) != 0;
 }
 
 std::string	Server::get_error_page(int error_code, Location const & location) const{
-	std::unordered_map<int, std::string>::const_iterator it;
-
-	if(location.error_pages.empty() && error_pages.empty()){
+	size_t offset = static_cast<size_t>(error_code - location.error_page_base);
+	if(error_code < location.error_page_base || offset >= location.error_page_table.size()){
 		return std::string();
-	} else if (!location.error_pages.empty()){
-		it = location.error_pages.find(error_code);
-		if (it != location.error_pages.end()){
-			if (!location.root.empty()){
-				return (location.root + "/" + it->second);
-			} else {
-				return (root + "/" + it->second);
-			}
-		}
 	}
-	if (error_pages.empty()){
-		return  std::string();
-	}
-	it = error_pages.find(error_code);
-	if (it != error_pages.end()){
-		return (root + "/" + it->second);
-	}
-	return std::string();
+	return location.error_page_table[offset];
 }
 
 std::string const & Server::get_root(Location const & location) const{
-	if(location.root.empty()){
-		return root;
-	} else {
-		return location.root;
-	}
+	return location.effective_root;
 }
 
 size_t Server::get_client_max_body_size(Location const & location) const{
-	if (location.client_max_body_size.first == true){
-		return location.client_max_body_size.second;
-	} else {
-		return client_max_body_size;
-	}
+	return location.effective_client_max_body_size;
 }
 
 bool	Server::is_auto_index_on(Location const & location) const{
-	if (location.autoindex.first == true){
-		return location.autoindex.second;
-	} else {
-		return autoindex;
-	}
+	return location.effective_autoindex;
 }
 
 std::string const &	Server::get_index_page(Location const & location) const{
-	if (location.index.first == false){
-		return index;
-	} else {
-		return location.index.second;
-	}
+	return location.effective_index;
 }
 
-std::pair<std::string, std::string> Server::get_cgi(Location & location, std::string const & path) const{
+std::pair<std::string, std::string> Server::get_cgi(Location const & location, std::string const & path) const{
 	std::pair<std::string, std::string> result;
 	if(location.cgi.empty()){
 		return result;
@@ -253,15 +289,23 @@ std::pair<std::string, std::string> Server::get_cgi(Location & location, std::st
 }
 
 std::string const & Server::get_redirection(Location const & location) const{
-	if (location.redirect.empty()){
-		return redirect;
-	} else {
-		return location.redirect;
-	}
+	return location.effective_redirect;
 }
 
 std::string const & Server::get_upload_dir(Location const & location) const{
 	return location.upload_directory;
 }
 
+std::string const & Server::get_fastcgi(Location const & location) const{
+	return location.fastcgi;
+}
+
+std::string const & Server::get_proxy_pass(Location const & location) const{
+	return location.proxy_pass;
+}
+
+std::string const & Server::get_handler(Location const & location) const{
+	return location.handler;
+}
+
 } //namespace webserv
@@ -0,0 +1,366 @@
+#include "Snapshot.h"
+#include "Address.h"
+#include "Handler.h"
+#include "Proxy.h"
+
+#include <cstdint>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace webserv {
+
+namespace snapshot {
+
+// Everything after the header is numbers (uint64_t, in the byte order of the machine) and
+// strings (their size, then the characters)
+struct Header
+{
+	char magic[8];
+	uint64_t version;
+	uint64_t config_size; // Of the JSON file the snapshot was made from
+	int64_t config_mtime_sec;
+	int64_t config_mtime_nsec;
+};
+
+static char const MAGIC[8] = {'W', 'E', 'B', 'S', 'E', 'R', 'V', 'S'};
+
+class Writer
+{
+	public:
+	template <typename T>
+	void field(T const& value)
+	{
+		uint64_t number = static_cast<uint64_t>(value);
+		data.append(reinterpret_cast<char const*>(&number), sizeof(number));
+	}
+
+	void field(std::string const& value)
+	{
+		field(value.size());
+		data += value;
+	}
+
+	void field(std::vector<std::string> const& values)
+	{
+		field(values.size());
+		for (std::string const& value : values)
+			field(value);
+	}
+
+	void field(std::unordered_map<int, std::string> const& values)
+	{
+		field(values.size());
+		for (auto const& pair : values)
+		{
+			field(pair.first);
+			field(pair.second);
+		}
+	}
+
+	template <typename T>
+	void field(std::pair<bool, T> const& value)
+	{
+		field(value.first);
+		field(value.second);
+	}
+
+	public:
+	std::string data;
+};
+
+class Reader
+{
+	public:
+	Reader(char const* data, size_t size) : data(data), size(size), pos(0) {}
+
+	template <typename T>
+	void field(T& value)
+	{
+		uint64_t number;
+		std::memcpy(&number, take(sizeof(number)), sizeof(number));
+		value = static_cast<T>(number);
+	}
+
+	void field(std::string& value)
+	{
+		size_t length;
+		field(length);
+		value.assign(take(length), length);
+	}
+
+	void field(std::vector<std::string>& values)
+	{
+		size_t count;
+		field(count);
+		values.resize(count);
+		for (std::string& value : values)
+			field(value);
+	}
+
+	void field(std::unordered_map<int, std::string>& values)
+	{
+		size_t count;
+		field(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			int key;
+			field(key);
+			field(values[key]);
+		}
+	}
+
+	template <typename T>
+	void field(std::pair<bool, T>& value)
+	{
+		field(value.first);
+		field(value.second);
+	}
+
+	bool at_end(void) const { return (pos == size); }
+
+	private:
+	char const* take(size_t length)
+	{
+		if (length > size - pos)
+			throw (std::runtime_error("Snapshot is truncated"));
+		pos += length;
+		return (data + pos - length);
+	}
+
+	private:
+	char const* data;
+	size_t size;
+	size_t pos;
+};
+
+// The fields set by the config, once for writing and for reading. What Server::compile()
+// derives from them isn't stored.
+template <typename Archive, typename L>
+static void location_fields(Archive& archive, L& location)
+{
+	archive.field(location.path);
+	archive.field(location.match);
+	archive.field(location.root);
+	archive.field(location.index);
+	archive.field(location.autoindex);
+	archive.field(location.error_pages);
+	archive.field(location.client_max_body_size);
+	archive.field(location.allowed_http_commands);
+	archive.field(location.redirect);
+	archive.field(location.cgi);
+	archive.field(location.upload_directory);
+	archive.field(location.fastcgi);
+	archive.field(location.fastcgi_connections);
+	archive.field(location.cgi_splice);
+	archive.field(location.cgi_cache);
+	archive.field(location.cgi_cache_directory);
+	archive.field(location.cgi_cache_key_headers);
+	archive.field(location.cgi_max_concurrent);
+	archive.field(location.cgi_queue_size);
+	archive.field(location.proxy_pass);
+	archive.field(location.proxy_connections);
+	archive.field(location.cgi_timeout);
+	archive.field(location.handler);
+	archive.field(location.cgi_spool_threshold);
+	archive.field(location.cgi_spool_directory);
+	archive.field(location.metrics);
+}
+
+template <typename Archive, typename S>
+static void server_fields(Archive& archive, S& server)
+{
+	archive.field(server.port);
+	archive.field(server.host);
+	archive.field(server.server_names);
+	archive.field(server.root);
+	archive.field(server.index);
+	archive.field(server.autoindex);
+	archive.field(server.error_pages);
+	archive.field(server.client_max_body_size);
+	archive.field(server.allowed_http_commands);
+	archive.field(server.redirect);
+}
+
+template <typename Archive, typename U>
+static void upstream_fields(Archive& archive, U& upstream)
+{
+	archive.field(upstream.policy);
+	archive.field(upstream.max_fails);
+	archive.field(upstream.fail_timeout);
+	archive.field(upstream.health_interval);
+	archive.field(upstream.health_check);
+}
+
+template <typename Archive, typename C>
+static void config_fields(Archive& archive, C& config)
+{
+	archive.field(config.access_log);
+	archive.field(config.access_log_format);
+	archive.field(config.access_log_buffer_size);
+	archive.field(config.slow_request_threshold);
+	archive.field(config.server_timing);
+}
+
+// The stamp of the JSON file in a header, false when it can't be read
+static bool stamp(std::string const& config_path, Header& header)
+{
+	struct stat config_stat;
+	if (stat(config_path.c_str(), &config_stat) == -1)
+		return (false);
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = SNAPSHOT_VERSION;
+	header.config_size = static_cast<uint64_t>(config_stat.st_size);
+#ifdef __APPLE__
+	header.config_mtime_sec = config_stat.st_mtimespec.tv_sec;
+	header.config_mtime_nsec = config_stat.st_mtimespec.tv_nsec;
+#else
+	header.config_mtime_sec = config_stat.st_mtim.tv_sec;
+	header.config_mtime_nsec = config_stat.st_mtim.tv_nsec;
+#endif
+	return (true);
+}
+
+void write(std::string const& config_path, Config const& config, upstream_map_t const& upstreams)
+{
+	Header header = {};
+	if (!stamp(config_path, header))
+		throw (std::runtime_error("Can't open file: " + config_path));
+
+	Writer writer;
+	writer.data.assign(reinterpret_cast<char const*>(&header), sizeof(header));
+	config_fields(writer, config);
+	writer.field(upstreams.size());
+	for (auto const& pair : upstreams)
+	{
+		writer.field(pair.first);
+		upstream_fields(writer, *pair.second);
+		writer.field(pair.second->get_members().size());
+		for (UpstreamMember const& member : pair.second->get_members())
+			writer.field(member.address);
+	}
+	writer.field(config.servers.size());
+	for (auto const& server : config.servers)
+	{
+		server_fields(writer, *server);
+		writer.field(server->locations.size());
+		for (Location const& location : server->locations)
+			location_fields(writer, location);
+	}
+
+	// Written next to it and renamed, a server starting meanwhile never reads half a snapshot
+	std::string path = config_path + SNAPSHOT_SUFFIX;
+	std::string temporary_path = path + ".tmp";
+	std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+	if (!file.write(writer.data.data(), static_cast<std::streamsize>(writer.data.size())) || (file.close(), file.fail()))
+	{
+		(void)std::remove(temporary_path.c_str());
+		throw (std::runtime_error("Can't write " + temporary_path));
+	}
+	if (std::rename(temporary_path.c_str(), path.c_str()) == -1)
+		throw (std::runtime_error("Can't write " + path + ": " + strerror(errno)));
+}
+
+// Unmaps the snapshot however reading it ends
+struct Mapping
+{
+	void* address;
+	size_t size;
+	~Mapping() { (void)munmap(address, size); }
+};
+
+config_t read(std::string const& config_path)
+{
+	std::string path = config_path + SNAPSHOT_SUFFIX;
+	Header expected = {};
+	if (!stamp(config_path, expected))
+		return (nullptr);
+
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return (nullptr);
+	struct stat snapshot_stat;
+	if (fstat(fd, &snapshot_stat) == -1 || static_cast<size_t>(snapshot_stat.st_size) < sizeof(Header))
+	{
+		close(fd);
+		throw (std::runtime_error(path + " isn't a snapshot"));
+	}
+	size_t size = static_cast<size_t>(snapshot_stat.st_size);
+	void* address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (address == MAP_FAILED)
+		throw (std::runtime_error(path + ": " + strerror(errno)));
+	Mapping mapping {address, size};
+
+	char const* data = static_cast<char const*>(address);
+	Header header;
+	std::memcpy(&header, data, sizeof(header));
+	if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+		throw (std::runtime_error(path + " isn't a snapshot"));
+	if (header.version != expected.version || header.config_size != expected.config_size
+		|| header.config_mtime_sec != expected.config_mtime_sec || header.config_mtime_nsec != expected.config_mtime_nsec)
+	{
+		std::cout << path << " is stale, using " << config_path << std::endl;
+		return (nullptr);
+	}
+
+	Reader reader(data + sizeof(Header), size - sizeof(Header));
+	config_t config(new Config());
+	config_fields(reader, *config);
+	size_t count;
+	reader.field(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		std::string name;
+		reader.field(name);
+		std::unique_ptr<Upstream> upstream(new Upstream(name));
+		upstream_fields(reader, *upstream);
+		size_t members;
+		reader.field(members);
+		for (size_t j = 0; j < members; ++j)
+		{
+			std::string address;
+			reader.field(address);
+			upstream->add_member(address);
+		}
+		upstream->build_ring();
+		Upstream::add(upstream.release());
+	}
+
+	reader.field(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		std::unique_ptr<Server> server(new Server());
+		server_fields(reader, *server);
+		size_t locations;
+		reader.field(locations);
+		for (size_t j = 0; j < locations; ++j)
+		{
+			Location location;
+			location_fields(reader, location);
+			if (!server->add_location(location))
+				throw (std::runtime_error(path + ": invalid regex in location '" + location.path + "'"));
+			// Done now like the JSON parser does, a broken module or an address that
+			// doesn't resolve stops the load instead of the first request
+			if (!location.handler.empty())
+				(void)HandlerModule::get(location.handler);
+			if (!location.fastcgi.empty() && Upstream::find(location.fastcgi) == nullptr)
+				(void)Address::resolve(location.fastcgi);
+			if (!location.proxy_pass.empty())
+			{
+				std::string address, uri;
+				(void)proxy::parse_url(location.proxy_pass, address, uri);
+				if (Upstream::find(address) == nullptr)
+					(void)Address::resolve(address);
+			}
+		}
+		server->compile();
+		config->servers.push_back(std::move(server));
+	}
+	if (!reader.at_end() || config->servers.empty())
+		throw (std::runtime_error(path + " is damaged"));
+	return (config);
+}
+
+} // namespace snapshot
+
+} // namespace webserv
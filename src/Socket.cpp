@@ -1,6 +1,7 @@
 #include "Socket.h"
 #include "Connection.h"
 #include "Core.h"
+#include "Log.h"
 #include <arpa/inet.h>
 #include <memory>
 #include <stdexcept>
@@ -8,7 +9,7 @@
 
 namespace webserv {
 
-Socket::Socket(uint16_t _port, std::string const& _host) : port(_port), host(_host)
+Socket::Socket(uint16_t _port, std::string const& _host) : port(_port), host(_host), retired(false), connections(0)
 {
 	// Settings
 	const int domain = AF_INET;
@@ -51,20 +52,42 @@ Socket::Socket(uint16_t _port, std::string const& _host) : port(_port), host(_ho
 	}
 
 	// Info
-	std::cout << "Socket Created {address: "
+	LOG_INFO("Socket Created {address: "
 		<< inet_ntoa(address.sin_addr) << ":" << port
-		<< ", fd: " << socket_fd << '}'
-		<< std::endl;
+		<< ", fd: " << socket_fd << '}');
+}
+
+Socket::Socket(sockfd_t inherited_fd, uint16_t _port, std::string const& _host)
+:	port(_port),
+	host(_host),
+	socket_fd(inherited_fd),
+	retired(false),
+	connections(0)
+{
+	addr_in_t bound = {};
+	socklen_t bound_length = sizeof(bound);
+	if (getsockname(socket_fd, reinterpret_cast<addr_t*>(&bound), &bound_length) < 0)
+		throw (std::runtime_error(std::strerror(errno)));
+	if (bound.sin_family != AF_INET || ntohs(bound.sin_port) != port)
+		throw (std::runtime_error("Inherited descriptor " + std::to_string(socket_fd) + " isn't bound to port " + std::to_string(port)));
+	if (fcntl(socket_fd, F_SETFL, O_NONBLOCK) < 0)
+		throw (std::runtime_error(std::strerror(errno)));
+	address = bound;
+
+	LOG_INFO("Socket Inherited {address: "
+		<< inet_ntoa(address.sin_addr) << ":" << port
+		<< ", fd: " << socket_fd << '}');
 }
 
 Socket::~Socket()
 {
-	std::cout << "Socket " << socket_fd << " destroyed." << std::endl;
-	close(socket_fd);
+	LOG_INFO("Socket " << socket_fd << " destroyed.");
+	if (socket_fd >= 0)
+		close(socket_fd);
 }
 
 // Unavailable constructors
-Socket::Socket() : socket_fd(-1) {};
+Socket::Socket() : socket_fd(-1), retired(false), connections(0) {};
 Socket::Socket(Socket const& other) { (void)other; }
 Socket& Socket::operator=(Socket const& other) { (void)other; return *this; }
 
@@ -92,39 +115,57 @@ void Socket::accept_connections(pollable_map_t& fd_map)
 	socklen_t accepted_address_length = sizeof(addr_t);
 	sockfd_t connection_fd = 0;
 
-	std::cout << "Socket (" << socket_fd << ")\n";
 	while ((connection_fd = accept(socket_fd, &accepted_address, &accepted_address_length)) > 0)
 	{
 		Connection* c = new Connection(connection_fd, accepted_address, this);
-		std::cout << "- accepted: " << connection_fd << ", ip: " << c->get_ip() << '\n';
+		LOG_DEBUG("Socket (" << socket_fd << ") accepted: " << connection_fd << ", ip: " << c->get_ip());
 
 		// Add to the fd_map for poll()
 		fd_map.emplace(connection_fd, c);
 	}
-	std::cout << std::endl;
 }
 
+// The server named by the Host header, the default server when none is
 Server& Socket::get_server(std::string const& host)
 {
 	if (servers.empty())
 		throw (std::runtime_error("Socket has no servers"));
-	std::string hostname = host;
-	size_t pos = hostname.find_last_of(':');
-	if (pos != std::string::npos)
-		hostname = hostname.substr(0, pos);
-	for (auto* s : servers)
-	{
-		if (s->contain_server_name(hostname))
-			return (*s);
-	}
-	return (*servers[0]);
+	Server* server = host_index.find(host);
+	return (server != nullptr ? *server : *servers[0]);
+}
+
+void Socket::add_server_ref(Server* server)
+{
+	servers.push_back(server);
+	for (std::string const& name : server->server_names)
+		host_index.add(name, server);
+}
+
+void Socket::set_config(config_t const& _config, std::vector<Server*> const& config_servers)
+{
+	config = _config;
+	servers.clear();
+	host_index = HostIndex();
+	for (Server* server : config_servers)
+		add_server_ref(server);
 }
 
-void Socket::add_server_ref(std::unique_ptr<Server>& server_ref)
+config_t const& Socket::get_config(void) const { return (config); }
+
+// The listening descriptor is closed right away, so the address can be bound again
+void Socket::retire(void)
 {
-	servers.push_back(server_ref.get());
+	LOG_INFO("Socket " << socket_fd << " (" << host << ':' << port << ") no longer accepts connections");
+	close(socket_fd);
+	socket_fd = -1;
+	retired = true;
 }
 
+bool Socket::is_retired(void) const { return (retired); }
+void Socket::add_connection(void) { ++connections; }
+void Socket::remove_connection(void) { --connections; }
+size_t Socket::get_connections(void) const { return (connections); }
+
 sockfd_t Socket::get_fd(void) const { return socket_fd; }
 
 bool Socket::should_destroy(void) const { return false; }
@@ -0,0 +1,113 @@
+#include "Spool.h"
+#include "Core.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace webserv {
+
+// O_TMPFILE files have no name at all, elsewhere the file is unlinked right after it's created
+Spool::Spool(std::string const& directory, size_t content_length)
+:	file_fd(-1),
+	content_length(content_length),
+	received(0),
+	buffer(SPOOL_BUFFER_SIZE),
+	failed(false)
+{
+#ifdef O_TMPFILE
+	file_fd = open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+	if (file_fd < 0)
+	{
+		std::string path = directory + "/webserv-spool-XXXXXX";
+		file_fd = mkstemp(&path[0]);
+		if (file_fd >= 0)
+		{
+			(void)unlink(path.c_str());
+			(void)fcntl(file_fd, F_SETFD, FD_CLOEXEC);
+		}
+	}
+	if (file_fd < 0)
+		throw (std::runtime_error("Spool(): " + directory + ": " + strerror(errno)));
+
+#ifdef __linux__
+	(void)posix_fallocate(file_fd, 0, content_length);
+#endif
+}
+
+Spool::~Spool()
+{
+	if (file_fd >= 0)
+		close(file_fd);
+}
+
+// Unused
+Spool::Spool() : file_fd(-1), content_length(0) {}
+Spool::Spool(Spool const& other) : Gateway(), file_fd(-1), content_length(0) { (void)other; }
+Spool& Spool::operator=(Spool const& other) { (void)other; return *this; }
+//END
+
+bool Spool::is_output_closed(void) const { return (failed); }
+
+bool Spool::finish(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	return (true);
+}
+
+void Spool::abort(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	failed = true;
+}
+
+// The part of the body that came with the request header arrives through buffer_in
+void Spool::on_post_poll(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	if (pending_in_size() > 0)
+	{
+		receive(pending_in(), pending_in_size());
+		consume_in(pending_in_size());
+	}
+}
+
+bool Spool::can_splice(void) const { return (true); }
+
+ssize_t Spool::splice_from(sockfd_t fd, size_t size)
+{
+	ssize_t result = recv(fd, buffer.data(), std::min(size, buffer.size()), 0);
+	if (result > 0)
+		receive(buffer.data(), result);
+	return (result < 0 ? -1 : result);
+}
+
+void Spool::receive(char const* data, size_t size)
+{
+	size = std::min(size, content_length - received);
+	while (size > 0 && !failed)
+	{
+		ssize_t written = write(file_fd, data, size);
+		if (written < 0)
+		{
+			std::cerr << "Spool::receive(): " << strerror(errno) << std::endl;
+			failed = true;
+			return ;
+		}
+		received += written;
+		data += written;
+		size -= written;
+	}
+}
+
+bool Spool::is_complete(void) const { return (!failed && received >= content_length); }
+
+bool Spool::has_failed(void) const { return (failed); }
+
+int Spool::get_fd(void) const
+{
+	(void)lseek(file_fd, 0, SEEK_SET);
+	return (file_fd);
+}
+
+} // namespace webserv
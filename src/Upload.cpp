@@ -0,0 +1,368 @@
+#include "Upload.h"
+#include "Core.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <cctype>
+#include <sys/stat.h>
+
+namespace webserv {
+
+// The value of a parameter in a header field ("boundary=..." or "filename=\"...\"")
+static std::string get_parameter(std::string const& field, std::string const& name)
+{
+	size_t pos = 0;
+	while ((pos = field.find(name + '=', pos)) != std::string::npos)
+	{
+		// Don't match the end of another parameter name ("name=" in "filename=")
+		if (pos == 0 || field[pos - 1] == ';' || field[pos - 1] == ' ' || field[pos - 1] == '\t')
+			break ;
+		pos += name.size();
+	}
+	if (pos == std::string::npos)
+		return ("");
+
+	pos += name.size() + 1;
+	if (pos < field.size() && field[pos] == '"')
+	{
+		size_t end = field.find('"', pos + 1);
+		return (field.substr(pos + 1, end == std::string::npos ? std::string::npos : end - pos - 1));
+	}
+	return (field.substr(pos, field.find_first_of("; \t", pos) - pos));
+}
+
+// Files are never hidden (the temporary files are) and never outside of the directory
+static bool is_valid_name(std::string const& name)
+{
+	return (name.compare(0, 1, ".") != 0 && name.find("/.") == std::string::npos);
+}
+
+Upload::Upload(Request const& request, Location const& loc, std::string const& directory, size_t content_length)
+:	directory(directory),
+	replace(request.type == PUT),
+	parse(RAW),
+	content_length(content_length),
+	received(0),
+	buffer(UPLOAD_BUFFER_SIZE),
+	failed(false),
+	ended(false)
+{
+	file.fd = -1;
+	base_uri = loc.uri_prefix; // The location stands for the upload directory
+	if (base_uri.empty() || base_uri.back() != '/')
+		base_uri += '/'; // An exact location like "= /upload"
+
+	auto content_type = request.fields.find("content-type");
+	if (content_type != request.fields.end() && content_type->second.compare(0, 19, "multipart/form-data") == 0)
+	{
+		std::string boundary = get_parameter(content_type->second, "boundary");
+		if (boundary.empty())
+		{
+			fail("400");
+			return ;
+		}
+		delimiter = "\r\n--" + boundary;
+		pending = "\r\n"; // So the first boundary matches the delimiter as well
+		parse = PREAMBLE;
+		return ;
+	}
+
+	// The name comes from the uri, a POST to a directory gets a generated one
+	std::string name = request.path.substr(std::min(loc.uri_prefix.size(), request.path.size()));
+	if ((name.empty() || name.back() == '/') && replace)
+		fail("405");
+	else if (!is_valid_name(name))
+		fail("403");
+	else
+		open_file(name);
+}
+
+Upload::~Upload()
+{
+	if (file.fd >= 0)
+	{
+		close(file.fd);
+		(void)unlink(file.temp_path.c_str());
+	}
+	for (File const& f : stored)
+	{
+		if (!f.temp_path.empty())
+			(void)unlink(f.temp_path.c_str());
+	}
+}
+
+// Unused
+Upload::Upload() : content_length(0) {}
+Upload::Upload(Upload const& other) : Gateway(), content_length(0) { (void)other; }
+Upload& Upload::operator=(Upload const& other) { (void)other; return *this; }
+//END
+
+bool Upload::is_output_closed(void) const { return (ended); }
+
+bool Upload::finish(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	return (true);
+}
+
+// The client is gone, nothing of the body is kept
+void Upload::abort(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	failed = true;
+	ended = true;
+}
+
+// The part of the body that came with the request header arrives through buffer_in
+void Upload::on_post_poll(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	if (pending_in_size() > 0)
+	{
+		receive(pending_in(), pending_in_size());
+		consume_in(pending_in_size());
+	}
+	check_end();
+}
+
+bool Upload::can_splice(void) const { return (true); }
+
+// Reads the body from the client socket straight into the file (or the multipart parser)
+ssize_t Upload::splice_from(sockfd_t fd, size_t size)
+{
+	ssize_t result = recv(fd, buffer.data(), std::min(size, buffer.size()), 0);
+	if (result <= 0)
+		return (result == 0 ? 0 : -1);
+	receive(buffer.data(), result);
+	check_end();
+	return (result);
+}
+
+void Upload::receive(char const* data, size_t size)
+{
+	size = std::min(size, content_length - received);
+	received += size;
+	if (failed)
+		return ;
+
+	if (parse == RAW)
+		write_file(data, size);
+	else
+	{
+		pending.append(data, size);
+		parse_multipart();
+	}
+}
+
+void Upload::check_end(void)
+{
+	if (ended || received < content_length)
+		return ;
+
+	if (!failed && parse == RAW)
+		close_file();
+	else if (!failed && parse != EPILOGUE)
+		fail("400"); // The body ended in the middle of the multipart data
+	if (!failed)
+		complete();
+	ended = true;
+}
+
+void Upload::parse_multipart(void)
+{
+	while (!failed)
+	{
+		if (parse == PREAMBLE || parse == PART_DATA)
+		{
+			size_t pos = pending.find(delimiter);
+			// Everything that can't be the start of a delimiter is data
+			size_t size = (pos != std::string::npos) ? pos
+				: (pending.size() >= delimiter.size() ? pending.size() - delimiter.size() + 1 : 0);
+			if (parse == PART_DATA && file.fd >= 0)
+				write_file(pending.data(), size);
+			if (pos == std::string::npos)
+			{
+				pending.erase(0, size);
+				return ;
+			}
+			if (parse == PART_DATA && file.fd >= 0)
+				close_file();
+			pending.erase(0, pos + delimiter.size());
+			parse = PART_END;
+		}
+		else if (parse == PART_END)
+		{
+			if (pending.size() < 2)
+				return ;
+			if (pending.compare(0, 2, "--") == 0)
+				parse = EPILOGUE;
+			else if (pending.compare(0, 2, "\r\n") == 0)
+			{
+				pending.erase(0, 2);
+				parse = PART_HEADER;
+			}
+			else
+				fail("400");
+		}
+		else if (parse == PART_HEADER)
+		{
+			size_t pos = (pending.compare(0, 2, "\r\n") == 0) ? 0 : pending.find("\r\n\r\n");
+			if (pos == std::string::npos)
+			{
+				if (pending.size() > UPLOAD_MAX_PART_HEADER_SIZE)
+					fail("400");
+				return ;
+			}
+			std::string header = pending.substr(0, pos);
+			pending.erase(0, pos + (pos == 0 ? 2 : 4));
+			parse = PART_DATA;
+			parse_part_header(header);
+		}
+		else
+		{
+			pending.clear();
+			return ;
+		}
+	}
+}
+
+// Parts with a filename in their Content-Disposition are files, other form fields are dropped
+void Upload::parse_part_header(std::string const& header)
+{
+	std::stringstream stream(header);
+	std::string line;
+
+	while (std::getline(stream, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		std::string name = line.substr(0, line.find(':'));
+		std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+		if (name != "content-disposition")
+			continue ;
+
+		std::string filename = get_parameter(line, "filename");
+		if (filename.empty())
+			return ;
+		// Browsers may send a path, only its last component is used
+		filename = filename.substr(filename.find_last_of("/\\") + 1);
+		if (filename.empty() || !is_valid_name(filename))
+			fail("400");
+		else
+			open_file(filename);
+		return ;
+	}
+}
+
+// The file is written under a hidden temporary name in the directory, so the rename is atomic
+void Upload::open_file(std::string const& name)
+{
+	file.temp_path = directory + "/.upload-XXXXXX";
+	file.fd = mkstemp(&file.temp_path[0]);
+	if (file.fd < 0)
+	{
+		int error = errno;
+		std::cerr << "Upload::open_file(): " << directory << ": " << strerror(error) << std::endl;
+		fail((error == ENOENT || error == ENOTDIR) ? "404" : (error == EACCES) ? "403" : "500");
+		return ;
+	}
+	(void)fchmod(file.fd, 0644);
+
+	// A directory gets a file named after the random part of the temporary name
+	std::string stored_name = name;
+	if (name.empty() || name.back() == '/')
+		stored_name += "upload-" + file.temp_path.substr(file.temp_path.size() - 6);
+	file.path = directory + '/' + stored_name;
+	file.uri = base_uri + stored_name;
+	file.size = 0;
+
+#ifdef __linux__
+	// The rest of the body is the most the file can take
+	size_t size = content_length - received;
+	if (size > 0 && posix_fallocate(file.fd, 0, size) == ENOSPC)
+		fail("507");
+#endif
+}
+
+void Upload::write_file(char const* data, size_t size)
+{
+	while (size > 0 && !failed)
+	{
+		ssize_t written = write(file.fd, data, size);
+		if (written < 0)
+		{
+			int error = errno;
+			std::cerr << "Upload::write_file(): " << strerror(error) << std::endl;
+			fail(error == ENOSPC || error == EDQUOT ? "507" : "500");
+			return ;
+		}
+		file.size += written;
+		data += written;
+		size -= written;
+	}
+}
+
+// The preallocated space past the data is given back
+void Upload::close_file(void)
+{
+	if (file.fd < 0)
+		return ;
+	if (ftruncate(file.fd, file.size) < 0)
+		std::cerr << "Upload::close_file(): " << strerror(errno) << std::endl;
+	close(file.fd);
+	file.fd = -1;
+	stored.push_back(file);
+}
+
+void Upload::complete(void)
+{
+	if (stored.empty())
+	{
+		fail("400"); // A form without files
+		return ;
+	}
+
+	bool created = false;
+	std::string body;
+	for (File& f : stored)
+	{
+		struct stat info;
+		created = created || stat(f.path.c_str(), &info) != 0;
+		if (rename(f.temp_path.c_str(), f.path.c_str()) < 0)
+		{
+			int error = errno;
+			std::cerr << "Upload::complete(): " << f.path << ": " << strerror(error) << std::endl;
+			fail((error == ENOENT || error == ENOTDIR || error == EISDIR) ? "409" : "500");
+			return ;
+		}
+		f.temp_path.clear();
+		body += "Stored " + f.uri + " (" + std::to_string(f.size) + " bytes)\n";
+		LOG_DEBUG("Upload stored: " << f.path << " (" << f.size << " bytes)");
+	}
+
+	// A PUT that replaced a file answers 200, anything that created one 201
+	std::string status = (replace && !created) ? "200 OK" : "201 Created";
+	std::string header = "Status: " + status + "\r\n"
+		+ "Location: " + stored.front().uri + "\r\n"
+		+ "Content-Type: text/plain\r\n"
+		+ "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+	buffer_out.assign(header.begin(), header.end());
+	buffer_out.insert(buffer_out.end(), body.begin(), body.end());
+}
+
+void Upload::fail(std::string const& status)
+{
+	if (failed)
+		return ;
+	failed = true;
+	if (file.fd >= 0)
+	{
+		close(file.fd);
+		(void)unlink(file.temp_path.c_str());
+		file.fd = -1;
+	}
+	std::string header = "Status: " + status + "\r\n\r\n";
+	buffer_out.assign(header.begin(), header.end());
+}
+
+} // namespace webserv
@@ -0,0 +1,373 @@
+#include "Upstream.h"
+#include "Address.h"
+#include "Core.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace webserv {
+
+static upstream_map_t s_upstreams;
+
+// FNV-1a with the murmur3 finalizer, keys that only differ at the end still land far apart on the ring
+static uint32_t hash_string(std::string const& str)
+{
+	uint32_t hash = 2166136261u;
+	for (char c : str)
+	{
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 16777619u;
+	}
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return (hash);
+}
+
+// MEMBER
+
+UpstreamMember::UpstreamMember(std::string const& address)
+:	address(address),
+	active(0),
+	fails(0),
+	first_fail(0),
+	ejected_until(0),
+	healthy(true),
+	probing(false),
+	next_probe(0),
+	latency(0),
+	requests(0),
+	failures(0) {}
+
+bool UpstreamMember::is_available(time_t now) const { return (healthy && ejected_until <= now); }
+
+// UPSTREAM
+
+Upstream::Upstream(std::string const& name)
+:	policy(ROUND_ROBIN),
+	max_fails(UPSTREAM_DEFAULT_MAX_FAILS),
+	fail_timeout(UPSTREAM_DEFAULT_FAIL_TIMEOUT),
+	health_interval(0),
+	name(name),
+	next(0) {}
+
+// Unused
+Upstream::Upstream() : next(0) {}
+Upstream::Upstream(Upstream const& other) : next(0) { (void)other; }
+Upstream& Upstream::operator=(Upstream const& other) { (void)other; return *this; }
+//END
+
+std::shared_ptr<Upstream> Upstream::find(std::string const& name)
+{
+	auto it = s_upstreams.find(name);
+	return (it == s_upstreams.end() ? nullptr : it->second);
+}
+
+void Upstream::add(Upstream* upstream) { s_upstreams[upstream->get_name()].reset(upstream); }
+
+upstream_map_t const& Upstream::get_all(void) { return (s_upstreams); }
+
+void Upstream::replace_all(upstream_map_t const& upstreams) { s_upstreams = upstreams; }
+
+void Upstream::tick(pollable_map_t& fd_map)
+{
+	time_t now = std::time(nullptr);
+
+	for (auto& pair : s_upstreams)
+	{
+		Upstream& upstream = *pair.second;
+		if (upstream.health_interval == 0)
+			continue ;
+		for (UpstreamMember& member : upstream.members)
+		{
+			if (member.probing || member.next_probe > now)
+				continue ;
+			member.next_probe = now + upstream.health_interval;
+			try
+			{
+				HealthProbe* probe = new HealthProbe(pair.second, &member);
+				fd_map.insert({probe->get_fd(), probe});
+				member.probing = true;
+			}
+			catch (std::exception& e)
+			{
+#ifdef DEBUG
+				std::cerr << "Upstream::tick(): " << e.what() << std::endl;
+#endif
+				upstream.probe_done(&member, false);
+			}
+		}
+	}
+}
+
+// Resolved now, probes and connections to the member use the result
+void Upstream::add_member(std::string const& address)
+{
+	(void)Address::resolve(address);
+	members.emplace_back(address);
+}
+
+void Upstream::build_ring(void)
+{
+	ring.clear();
+	for (size_t i = 0; i < members.size(); ++i)
+	{
+		for (size_t point = 0; point < UPSTREAM_RING_POINTS; ++point)
+			ring.emplace_back(hash_string(members[i].address + '#' + std::to_string(point)), i);
+	}
+	std::sort(ring.begin(), ring.end());
+}
+
+UpstreamMember* Upstream::pick(std::string const& uri, std::string const& client_ip)
+{
+	time_t now = std::time(nullptr);
+	UpstreamMember* member = nullptr;
+
+	// The second round runs when every member is down, one of them may have recovered
+	for (int available_only = 1; available_only >= 0 && member == nullptr; --available_only)
+	{
+		switch (policy)
+		{
+			case ROUND_ROBIN: member = pick_round_robin(now, available_only); break;
+			case LEAST_CONN: member = pick_least_conn(now, available_only); break;
+			case HASH_URI: member = pick_hash(uri, now, available_only); break;
+			case HASH_IP: member = pick_hash(client_ip, now, available_only); break;
+		}
+	}
+	if (member != nullptr)
+	{
+		++member->active;
+		++member->requests;
+	}
+	return (member);
+}
+
+UpstreamMember* Upstream::pick_round_robin(time_t now, bool available_only)
+{
+	for (size_t i = 0; i < members.size(); ++i)
+	{
+		UpstreamMember& member = members[next];
+		next = (next + 1) % members.size();
+		if (!available_only || member.is_available(now))
+			return (&member);
+	}
+	return (nullptr);
+}
+
+// Expected wait for a new request, members that aren't measured yet count as 1ms.
+// Scanning starts after the last pick so equal members take turns.
+UpstreamMember* Upstream::pick_least_conn(time_t now, bool available_only)
+{
+	UpstreamMember* best = nullptr;
+	double best_score = 0;
+
+	for (size_t i = 0; i < members.size(); ++i)
+	{
+		UpstreamMember& member = members[(next + i) % members.size()];
+		if (available_only && !member.is_available(now))
+			continue ;
+		double score = static_cast<double>(member.active + 1) * std::max(member.latency, 1.0);
+		if (best == nullptr || score < best_score)
+		{
+			best = &member;
+			best_score = score;
+		}
+	}
+	if (!members.empty())
+		next = (next + 1) % members.size();
+	return (best);
+}
+
+// The first member clockwise of the key on the ring, skipping the ones that are down.
+// Only the keys of a member that goes down move, they spread over the others.
+UpstreamMember* Upstream::pick_hash(std::string const& key, time_t now, bool available_only)
+{
+	if (ring.empty())
+		return (nullptr);
+
+	auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(hash_string(key), static_cast<size_t>(0)));
+	for (size_t i = 0; i < ring.size(); ++i, ++it)
+	{
+		if (it == ring.end())
+			it = ring.begin();
+		UpstreamMember& member = members[it->second];
+		if (!available_only || member.is_available(now))
+			return (&member);
+	}
+	return (nullptr);
+}
+
+// Every picked member is reported once, max_fails failures within fail_timeout eject it for fail_timeout
+void Upstream::report(UpstreamMember* member, Result result, double latency)
+{
+	if (member->active > 0)
+		--member->active;
+	if (result == CANCELLED)
+		return ;
+
+	if (result == SUCCESS)
+	{
+		member->fails = 0;
+		if (member->latency == 0)
+			member->latency = latency;
+		else
+			member->latency += UPSTREAM_EWMA_WEIGHT * (latency - member->latency);
+		return ;
+	}
+
+	time_t now = std::time(nullptr);
+	++member->failures;
+	if (member->fails == 0 || now - member->first_fail >= static_cast<time_t>(fail_timeout))
+	{
+		member->fails = 0;
+		member->first_fail = now;
+	}
+	if (max_fails != 0 && ++member->fails >= max_fails)
+	{
+		LOG_INFO("Upstream " << name << ": " << member->address
+			<< " ejected for " << fail_timeout << "s after " << member->fails << " failure(s)");
+		member->ejected_until = now + fail_timeout;
+		member->fails = 0;
+	}
+}
+
+void Upstream::probe_done(UpstreamMember* member, bool healthy)
+{
+	member->probing = false;
+	if (member->healthy != healthy)
+		LOG_INFO("Upstream " << name << ": " << member->address << " is " << (healthy ? "up" : "down"));
+	member->healthy = healthy;
+}
+
+std::string const& Upstream::get_name(void) const { return (name); }
+
+std::vector<UpstreamMember> const& Upstream::get_members(void) const { return (members); }
+
+// HEALTH PROBE
+
+HealthProbe::HealthProbe(std::shared_ptr<Upstream> const& upstream, UpstreamMember* member)
+:	socket_fd(-1),
+	upstream(upstream),
+	member(member),
+	sent(0),
+	deadline(std::time(nullptr) + std::max(upstream->health_interval, static_cast<size_t>(1))),
+	finished(false)
+{
+	std::string const& address = member->address;
+	Address const& target = Address::get(address);
+	socket_fd = socket(target.get_family(), SOCK_STREAM, 0);
+	if (socket_fd < 0)
+		throw (std::runtime_error(std::string("HealthProbe socket: ") + strerror(errno)));
+	int result = (fcntl(socket_fd, F_SETFL, O_NONBLOCK) == 0) ? connect(socket_fd, target.get_addr(), target.length) : -1;
+
+	if (result < 0 && errno != EINPROGRESS)
+	{
+		std::string message = strerror(errno);
+		close(socket_fd);
+		throw (std::runtime_error("Connect to " + address + " failed: " + message));
+	}
+
+	if (!upstream->health_check.empty())
+		request = "GET " + upstream->health_check + " HTTP/1.0\r\nHost: " + address
+			+ "\r\nUser-Agent: webserv\r\nConnection: close\r\n\r\n";
+}
+
+HealthProbe::~HealthProbe()
+{
+	if (socket_fd >= 0)
+		close(socket_fd);
+}
+
+// Unused
+HealthProbe::HealthProbe() : socket_fd(-1) {}
+HealthProbe::HealthProbe(HealthProbe const& other) : Pollable() { (void)other; }
+HealthProbe& HealthProbe::operator=(HealthProbe const& other) { (void)other; return *this; }
+//END
+
+sockfd_t HealthProbe::get_fd(void) const { return (socket_fd); }
+
+bool HealthProbe::should_destroy(void) const { return (finished); }
+
+// Writable once connected, then readable for the status line
+short HealthProbe::get_events(sockfd_t fd) const
+{
+	(void)fd;
+	if (sent < request.size() || request.empty())
+		return (POLLOUT);
+	return (POLLIN);
+}
+
+void HealthProbe::on_post_poll(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	if (!finished && std::time(nullptr) >= deadline)
+		done(false);
+}
+
+void HealthProbe::on_pollout(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	if (finished)
+		return ;
+
+	int error = 0;
+	socklen_t length = sizeof(error);
+	if (sent == 0 && (getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0))
+	{
+		done(false);
+		return ;
+	}
+	// Without a health_check the connection is all that's checked
+	if (request.empty())
+	{
+		done(true);
+		return ;
+	}
+
+	ssize_t result = ::send(socket_fd, request.data() + sent, request.size() - sent, 0);
+	if (result <= 0)
+	{
+		done(false);
+		return ;
+	}
+	sent += result;
+}
+
+void HealthProbe::on_pollin(pollable_map_t& fd_map)
+{
+	(void)fd_map;
+	if (finished)
+		return ;
+
+	char buffer[UPSTREAM_PROBE_BUFFER_SIZE];
+	ssize_t result = recv(socket_fd, buffer, sizeof(buffer), 0);
+	if (result > 0)
+		response.append(buffer, result);
+	if (result > 0 && response.find("\r\n") == std::string::npos && response.size() < UPSTREAM_PROBE_BUFFER_SIZE)
+		return ;
+
+	// "HTTP/1.x 2xx" or "HTTP/1.x 3xx"
+	done(response.compare(0, 5, "HTTP/") == 0 && response.size() > 9
+		&& (response[9] == '2' || response[9] == '3'));
+}
+
+void HealthProbe::on_pollhup(pollable_map_t& fd_map, sockfd_t fd)
+{
+	(void)fd;
+	// The status line may still be waiting in the socket
+	if (!finished && sent == request.size() && !request.empty())
+		on_pollin(fd_map);
+	if (!finished)
+		done(false);
+}
+
+void HealthProbe::done(bool healthy)
+{
+	finished = true;
+	upstream->probe_done(member, healthy);
+}
+
+} // namespace webserv
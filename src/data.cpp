@@ -1,4 +1,5 @@
 #include "data.h"
+#include "Log.h"
 
 #include <sys/stat.h>
 
@@ -57,11 +58,11 @@ namespace data
 	}
 
 	// Send a chunk of a file (ifstream)
-	bool send_file(sockfd_t fd, std::ifstream& istream, size_t buffer_size)
+	bool send_file(sockfd_t fd, std::ifstream& istream, size_t buffer_size, size_t& sent_size)
 	{
 		if (!istream || istream.eof())
 		{
-			std::cout << "No more file!" << std::endl;
+			LOG_DEBUG("No more file!");
 			return (false); // No more file left to conquer
 		}
 
@@ -72,6 +73,8 @@ namespace data
 
 		buffer.resize(istream.gcount());
 		ssize_t send_size = send(fd, buffer);
+		if (send_size > 0)
+			sent_size += send_size;
 		if (send_size < 0 || static_cast<size_t>(send_size) != buffer.size())
 		{
 			if (send_size < 0)
@@ -1,59 +1,312 @@
 #include "html.h"
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
 #include <dirent.h>
+#include <list>
 #include <sys/stat.h>
 
+// st_mtim is called st_mtimespec on macOS
+#ifdef __APPLE__
+# define STAT_MTIM(st) ((st).st_mtimespec)
+#else
+# define STAT_MTIM(st) ((st).st_mtim)
+#endif
+
 namespace webserv {
 
-	std::string build_index(std::string const& dir_path, std::string const& dir_name)
+	namespace
 	{
-		std::string page_buffer;
-		page_buffer += "<html>\n<head><title>Index of " + dir_name + "</title></head>\n";
-		page_buffer += "<h1>Index of " + dir_name + "</h1><hr>\n";
+		struct IndexEntry
+		{
+			std::string name;
+			bool is_dir;
+			time_t mtime;
+			off_t size;
+		};
 
-		DIR *dir;
-		struct dirent *ent;
-		if ((dir = opendir (dir_path.c_str())) == NULL)
+		// A directory listing stays valid as long as the mtime of the directory doesn't change
+		struct IndexCache
 		{
-			std::cerr << "Can't open directory: " << dir_path << std::endl;
-			return (std::string {});
+			struct timespec mtime;
+			ino_t inode;
+			std::vector<IndexEntry> entries;
+			std::vector<size_t> order[3]; // sorted entry indices per IndexOptions::Sort, built lazily
+			std::list<std::string>::iterator lru; // Position in s_index_lru
+		};
+
+		std::unordered_map<std::string, IndexCache> s_index_cache;
+		// Paths of the cached listings, most recently used first. The least recently used one makes room.
+		std::list<std::string> s_index_lru;
+	}
+
+	IndexOptions::IndexOptions() : sort(NAME), reverse(false), page(1), json(false) {}
+
+	IndexOptions parse_index_options(std::string const& query)
+	{
+		IndexOptions options;
+		std::stringstream stream(query);
+		std::string pair;
+
+		while (std::getline(stream, pair, '&'))
+		{
+			size_t pos = pair.find('=');
+			if (pos == std::string::npos)
+				continue ;
+			std::string key = pair.substr(0, pos);
+			std::string value = pair.substr(pos + 1);
+
+			if (key == "sort")
+			{
+				if (value == "mtime") options.sort = IndexOptions::MTIME;
+				else if (value == "size") options.sort = IndexOptions::SIZE;
+			}
+			else if (key == "order")
+				options.reverse = (value == "desc");
+			else if (key == "format")
+				options.json = (value == "json");
+			else if (key == "page")
+			{
+				try { options.page = std::max(1ul, std::stoul(value)); }
+				catch (std::exception& e) { options.page = 1; }
+			}
 		}
-		page_buffer += "<table><tr><th>Name</th><th>Last Modified</th><th>Size (bytes)</th></tr>";
+		return (options);
+	}
+
+	static std::string escape_html(std::string const& str)
+	{
+		std::string out;
+		out.reserve(str.size());
+		for (char c : str)
+		{
+			switch (c)
+			{
+				case '&': out += "&amp;"; break;
+				case '<': out += "&lt;"; break;
+				case '>': out += "&gt;"; break;
+				case '"': out += "&quot;"; break;
+				default: out += c;
+			}
+		}
+		return (out);
+	}
+
+	static std::string escape_json(std::string const& str)
+	{
+		std::string out;
+		out.reserve(str.size());
+		for (char c : str)
+		{
+			if (c == '"' || c == '\\')
+			{
+				out += '\\';
+				out += c;
+			}
+			else if (static_cast<unsigned char>(c) < 0x20)
+			{
+				char hex[8];
+				(void)snprintf(hex, sizeof(hex), "\\u%04x", c);
+				out += hex;
+			}
+			else
+				out += c;
+		}
+		return (out);
+	}
+
+	// Read the directory through its fd, stat-ing every entry relative to it
+	static bool read_directory(int dir_fd, IndexCache& cache)
+	{
+		DIR* dir = fdopendir(dir_fd);
+		if (dir == NULL)
+			return (false);
+
+		cache.entries.clear();
+		for (auto& order : cache.order)
+			order.clear();
+
+		struct dirent* ent;
 		while ((ent = readdir(dir)) != NULL)
 		{
-			if (std::string(ent->d_name) == ".")
+			if (std::strcmp(ent->d_name, ".") == 0)
+				continue ;
+
+			struct stat buf;
+			if (fstatat(dirfd(dir), ent->d_name, &buf, 0) != 0)
 				continue ;
 
-			std::string filepath = dir_path;
-			if(dir_path.back()!= '/'){
-				filepath += '/';
+			IndexEntry entry;
+			entry.name = ent->d_name;
+			entry.is_dir = S_ISDIR(buf.st_mode);
+			entry.mtime = buf.st_mtime;
+			entry.size = buf.st_size;
+			cache.entries.push_back(entry);
+		}
+		closedir(dir);
+		return (true);
+	}
+
+	// Returns the cached listing of dir_path, rereading it when the directory changed
+	static IndexCache* get_listing(std::string const& dir_path)
+	{
+		int dir_fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY);
+		if (dir_fd < 0)
+			return (nullptr);
+
+		struct stat buf;
+		if (fstat(dir_fd, &buf) != 0)
+		{
+			close(dir_fd);
+			return (nullptr);
+		}
+
+		auto it = s_index_cache.find(dir_path);
+		if (it != s_index_cache.end()
+			&& it->second.inode == buf.st_ino
+			&& it->second.mtime.tv_sec == STAT_MTIM(buf).tv_sec
+			&& it->second.mtime.tv_nsec == STAT_MTIM(buf).tv_nsec)
+		{
+			close(dir_fd);
+			s_index_lru.splice(s_index_lru.begin(), s_index_lru, it->second.lru);
+			return (&it->second);
+		}
+
+		if (it == s_index_cache.end())
+		{
+			if (s_index_cache.size() >= INDEX_CACHE_SIZE)
+			{
+				s_index_cache.erase(s_index_lru.back());
+				s_index_lru.pop_back();
+			}
+			it = s_index_cache.emplace(dir_path, IndexCache()).first;
+			s_index_lru.push_front(dir_path);
+			it->second.lru = s_index_lru.begin();
+		}
+		else
+			s_index_lru.splice(s_index_lru.begin(), s_index_lru, it->second.lru);
+
+		// fdopendir() takes ownership of dir_fd
+		if (!read_directory(dir_fd, it->second))
+		{
+			close(dir_fd);
+			s_index_lru.erase(it->second.lru);
+			s_index_cache.erase(it);
+			return (nullptr);
+		}
+		it->second.inode = buf.st_ino;
+		it->second.mtime = STAT_MTIM(buf);
+		return (&it->second);
+	}
+
+	static std::vector<size_t> const& get_order(IndexCache& cache, IndexOptions::Sort sort)
+	{
+		std::vector<size_t>& order = cache.order[sort];
+		if (order.size() == cache.entries.size())
+			return (order);
+
+		order.resize(cache.entries.size());
+		for (size_t i = 0; i < order.size(); ++i)
+			order[i] = i;
+
+		std::vector<IndexEntry> const& e = cache.entries;
+		switch (sort)
+		{
+			case IndexOptions::NAME:
+				std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return e[a].name < e[b].name; });
+				break;
+			case IndexOptions::MTIME:
+				std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return e[a].mtime < e[b].mtime; });
+				break;
+			case IndexOptions::SIZE:
+				std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return e[a].size < e[b].size; });
+				break;
+		}
+		return (order);
+	}
+
+	static std::string page_link(IndexOptions const& options, size_t page)
+	{
+		static char const* const sort_names[] = {"name", "mtime", "size"};
+		std::string link = "?sort=";
+		link += sort_names[options.sort];
+		link += options.reverse ? "&amp;order=desc" : "&amp;order=asc";
+		link += "&amp;page=" + std::to_string(page);
+		return (link);
+	}
+
+	std::string build_index(std::string const& dir_path, std::string const& dir_name, IndexOptions const& options)
+	{
+		IndexCache* cache = get_listing(dir_path);
+		if (cache == nullptr)
+		{
+			std::cerr << "Can't open directory: " << dir_path << std::endl;
+			return (std::string {});
+		}
+
+		std::vector<size_t> const& order = get_order(*cache, options.sort);
+		size_t total = order.size();
+		size_t pages = std::max(1ul, (total + INDEX_PAGE_SIZE - 1) / INDEX_PAGE_SIZE);
+		size_t first = (options.page > pages) ? total : (options.page - 1) * INDEX_PAGE_SIZE;
+		size_t last = std::min(total, first + INDEX_PAGE_SIZE);
+
+		std::string page_buffer;
+		page_buffer.reserve((last - first) * 128 + 512);
+
+		if (options.json)
+		{
+			page_buffer += "{\"path\":\"" + escape_json(dir_name) + "\",";
+			page_buffer += "\"page\":" + std::to_string(options.page) + ",";
+			page_buffer += "\"pages\":" + std::to_string(pages) + ",";
+			page_buffer += "\"total\":" + std::to_string(total) + ",";
+			page_buffer += "\"entries\":[";
+			for (size_t i = first; i < last; ++i)
+			{
+				IndexEntry const& entry = cache->entries[order[options.reverse ? total - 1 - i : i]];
+				if (i != first)
+					page_buffer += ',';
+				page_buffer += "{\"name\":\"" + escape_json(entry.name) + "\",";
+				page_buffer += entry.is_dir ? "\"type\":\"directory\"," : "\"type\":\"file\",";
+				page_buffer += "\"mtime\":" + std::to_string(entry.mtime) + ",";
+				page_buffer += "\"size\":" + std::to_string(entry.size) + "}";
 			}
-			filepath += ent->d_name;
+			page_buffer += "]}\n";
+			return (page_buffer);
+		}
+
+		std::string name = escape_html(dir_name);
+		page_buffer += "<html>\n<head><title>Index of " + name + "</title></head>\n";
+		page_buffer += "<h1>Index of " + name + "</h1><hr>\n";
+		page_buffer += "<table><tr><th>Name</th><th>Last Modified</th><th>Size (bytes)</th></tr>";
+		for (size_t i = first; i < last; ++i)
+		{
+			IndexEntry const& entry = cache->entries[order[options.reverse ? total - 1 - i : i]];
+			std::string entry_name = escape_html(entry.name);
+			if (entry.is_dir)
+				entry_name += '/';
 
-			//get directory/file information
-			struct stat buf; //struct to store file/directory data
-			stat(filepath.c_str(), &buf);
 			char timeline[80]; //string to store c-style string for the time of last modified
-			(void)strftime(timeline, 80, "%D %r", localtime(&buf.st_mtimespec.tv_sec));
-
-			page_buffer += "<tr><td>";
-			page_buffer += "<a href=\"";
-			page_buffer += ent->d_name;
-			if (ent->d_type == DT_DIR)
-				page_buffer += "/";
-			page_buffer += "\">";
-			page_buffer += ent->d_name;
-			if (ent->d_type == DT_DIR)
-				page_buffer += "/";
-			page_buffer += "</a></td><td>";
+			(void)strftime(timeline, 80, "%D %r", localtime(&entry.mtime));
+
+			page_buffer += "<tr><td><a href=\"" + entry_name + "\">" + entry_name + "</a></td><td>";
 			page_buffer += timeline;
-			if (ent->d_type != DT_DIR)
-				page_buffer += "</td><td align=\"right\">" + std::to_string(buf.st_size) + "</td>";
+			if (!entry.is_dir)
+				page_buffer += "</td><td align=\"right\">" + std::to_string(entry.size) + "</td>";
 			else
 				page_buffer += "</td><td align=\"right\"> - </td>";
 			page_buffer += '\n';
 		}
-		closedir(dir);	
-		page_buffer += "</table></hr></body>\n</html>\n";
+		page_buffer += "</table><hr>\n";
+		if (pages > 1)
+		{
+			if (options.page > 1)
+				page_buffer += "<a href=\"" + page_link(options, options.page - 1) + "\">previous</a> ";
+			page_buffer += "page " + std::to_string(options.page) + " of " + std::to_string(pages);
+			if (options.page < pages)
+				page_buffer += " <a href=\"" + page_link(options, options.page + 1) + "\">next</a>";
+			page_buffer += '\n';
+		}
+		page_buffer += "</body>\n</html>\n";
 		return (page_buffer);
 	}
 
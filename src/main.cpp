@@ -1,13 +1,26 @@
 #include "Core.h"
+#include "AccessLog.h"
+#include "LoopProfile.h"
+#include "Reaper.h"
 #include "Server.h"
+#include "Snapshot.h"
 #include "Socket.h"
+#include "Upstream.h"
 #include "parsing.h"
 
+#include <algorithm>
 #include <csignal>
+#include <cstdlib>
 #include <unordered_map>
+#include <sys/syscall.h>
 
 using namespace webserv;
 
+// Passed to the new binary on an upgrade (SIGUSR2): the listening sockets as "fd:host:port;...",
+// and the pipe it writes to once it's listening
+constexpr char const* LISTEN_FDS_ENV {"WEBSERV_LISTEN_FDS"};
+constexpr char const* UPGRADE_FD_ENV {"WEBSERV_UPGRADE_FD"};
+
 static pollable_map_t build_map(std::vector<std::unique_ptr<Socket>>& sockets)
 {
 	pollable_map_t fd_map(sockets.size());
@@ -52,11 +65,8 @@ static std::vector<struct pollfd> get_descriptors(pollable_map_t& fd_map)
 	return (fds);
 }
 
-static void webserv_parsing(
-	std::string const& config_path,
-	std::vector<std::unique_ptr<Server>>& servers_out,
-	std::vector<std::unique_ptr<Socket>>& sockets_out,
-	pollable_map_t& fd_map_out)
+// Parses the JSON configuration file, its upstreams are added
+static config_t parse_config(std::string const& config_path)
 {
 	njson::JsonParser json_parser(config_path);
 	if (json_parser.has_error())
@@ -66,12 +76,266 @@ static void webserv_parsing(
 	if (root_node->is<std::nullptr_t>())
 		throw (std::runtime_error("Invalid configuration file."));
 
-	servers_out = parse_servers(root_node);
-	if (servers_out.empty())
+	config_t config(new Config());
+	if (!parse_access_log(root_node, *config))
+		throw (std::runtime_error("Invalid access_log configuration"));
+	if (!parse_request_timing(root_node, *config))
+		throw (std::runtime_error("Invalid request_timing configuration"));
+	if (!parse_upstreams(root_node))
+		throw (std::runtime_error("Invalid upstream configuration"));
+
+	config->servers = parse_servers(root_node);
+	if (config->servers.empty())
 		throw (std::runtime_error("No proper server configuration provided"));
+	return (config);
+}
+
+// Loads the configuration into a new generation, from its snapshot when that's up to date.
+// The upstreams are replaced with the ones of the file, the previous ones are back in place when
+// the file has an error.
+static config_t load_config(std::string const& config_path)
+{
+	static size_t s_generation = 0;
+
+	upstream_map_t previous_upstreams = Upstream::get_all();
+	Upstream::replace_all(upstream_map_t());
+
+	config_t config;
+	try
+	{
+		config = snapshot::read(config_path);
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << e.what() << ", using " << config_path << std::endl;
+		Upstream::replace_all(upstream_map_t());
+	}
+
+	try
+	{
+		if (config == nullptr)
+			config = parse_config(config_path);
+	}
+	catch (...)
+	{
+		Upstream::replace_all(previous_upstreams);
+		throw ;
+	}
+	config->generation = ++s_generation;
+	return (config);
+}
+
+// webserv --compile-config [config]: validates the JSON file and writes its snapshot
+static int webserv_compile_config(std::string const& config_path)
+{
+	try
+	{
+		config_t config = parse_config(config_path);
+		snapshot::write(config_path, *config, Upstream::get_all());
+		std::cout << "Wrote " << config_path << SNAPSHOT_SUFFIX << " (" << config->servers.size() << " servers)" << std::endl;
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return (EXIT_FAILURE);
+	}
+	return (EXIT_SUCCESS);
+}
+
+// The listening sockets of the previous binary, when this one was started by an upgrade
+static std::vector<std::unique_ptr<Socket>> inherit_sockets(void)
+{
+	std::vector<std::unique_ptr<Socket>> sockets;
+	char const* value = std::getenv(LISTEN_FDS_ENV);
+	if (value == nullptr)
+		return (sockets);
+
+	std::stringstream stream(value);
+	std::string entry;
+	while (std::getline(stream, entry, ';'))
+	{
+		size_t host_start = entry.find(':');
+		size_t port_start = entry.rfind(':');
+		if (host_start == port_start)
+			throw (std::runtime_error(std::string("Invalid ") + LISTEN_FDS_ENV + ": " + entry));
+		sockfd_t fd = std::stoi(entry.substr(0, host_start));
+		uint16_t port = static_cast<uint16_t>(std::stoi(entry.substr(port_start + 1)));
+		sockets.emplace_back(new Socket(fd, port, entry.substr(host_start + 1, port_start - host_start - 1)));
+	}
+	(void)unsetenv(LISTEN_FDS_ENV);
+	return (sockets);
+}
+
+// Lets the previous binary know the sockets are taken over, so it stops accepting
+static void notify_upgrade(void)
+{
+	char const* value = std::getenv(UPGRADE_FD_ENV);
+	if (value == nullptr)
+		return ;
+	sockfd_t fd = std::atoi(value);
+	(void)write(fd, "", 1);
+	close(fd);
+	(void)unsetenv(UPGRADE_FD_ENV);
+}
 
-	sockets_out = build_sockets(servers_out);
+static void webserv_parsing(
+	std::string const& config_path,
+	std::vector<std::unique_ptr<Socket>>& sockets_out,
+	pollable_map_t& fd_map_out)
+{
+	// Inherited sockets the config doesn't listen on anymore are closed with inherited
+	std::vector<std::unique_ptr<Socket>> inherited = inherit_sockets();
+	config_t config = load_config(config_path);
+	AccessLog::configure(config->access_log, config->access_log_format, config->access_log_buffer_size);
+	sockets_out = build_sockets(config, inherited);
 	fd_map_out = build_map(sockets_out);
+
+	// Collects exited CGIs, owned by the fd_map like connections
+	Reaper* reaper = new Reaper();
+	fd_map_out.insert({reaper->get_fd(), reaper});
+	notify_upgrade();
+}
+
+// Sockets stop accepting and wait in retired for their last connection
+static void retire_sockets(
+	std::vector<std::unique_ptr<Socket>>& sockets,
+	std::vector<std::unique_ptr<Socket>>& retired,
+	pollable_map_t& fd_map)
+{
+	for (auto& socket : sockets)
+	{
+		fd_map.erase(socket->get_fd());
+		socket->retire();
+		retired.push_back(std::move(socket));
+	}
+	sockets.clear();
+}
+
+// Loads the configuration file again (SIGHUP). Sockets of addresses that are still listened on
+// are kept, sockets of removed addresses stop accepting and wait in retired for their last
+// connection. On any error the running configuration stays as it is.
+static void webserv_reload(
+	std::string const& config_path,
+	std::vector<std::unique_ptr<Socket>>& sockets,
+	std::vector<std::unique_ptr<Socket>>& retired,
+	pollable_map_t& fd_map)
+{
+	std::vector<std::unique_ptr<Socket>> new_sockets;
+	try
+	{
+		config_t config = load_config(config_path);
+		AccessLog::configure(config->access_log, config->access_log_format, config->access_log_buffer_size);
+		new_sockets = build_sockets(config, sockets);
+		std::cout << "Reloaded " << config_path << " (generation " << config->generation << ')' << std::endl;
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		std::cout << "Reload failed, keeping the running configuration" << std::endl;
+		return ;
+	}
+
+	// What's left in sockets isn't listened on anymore
+	retire_sockets(sockets, retired, fd_map);
+	for (auto& socket : new_sockets)
+		fd_map.insert({socket->get_fd(), socket.get()});
+	sockets = std::move(new_sockets);
+}
+
+// Closes every descriptor from 3 on except the ones in keep (sorted). close_range() (Linux 5.9)
+// does that in a few calls, without it each descriptor below the limit is closed on its own,
+// which takes seconds with the limits of containers. Runs in the forked child.
+static void close_other_fds(std::vector<sockfd_t> const& keep, long max_fd)
+{
+#ifdef SYS_close_range
+	unsigned int first = 3;
+	bool closed = true;
+	for (sockfd_t fd : keep)
+	{
+		unsigned int kept = static_cast<unsigned int>(fd);
+		if (kept > first && syscall(SYS_close_range, first, kept - 1, 0) != 0)
+		{
+			closed = false;
+			break ;
+		}
+		first = std::max(first, kept + 1);
+	}
+	if (closed && syscall(SYS_close_range, first, ~0U, 0) == 0)
+		return ;
+#endif
+	for (sockfd_t fd = 3; fd < max_fd; ++fd)
+	{
+		if (!std::binary_search(keep.begin(), keep.end(), fd))
+			close(fd);
+	}
+}
+
+// Starts the binary at argv[0] again (SIGUSR2), with the listening sockets and nothing else.
+// Both processes accept connections until the new one writes to the returned pipe, see
+// webserv_check_upgrade(), so no connection is refused while it starts.
+static sockfd_t webserv_upgrade(char** argv, std::vector<std::unique_ptr<Socket>> const& sockets)
+{
+	int ready[2];
+	if (pipe(ready) == -1)
+	{
+		std::cerr << "Upgrade failed: " << strerror(errno) << std::endl;
+		return (-1);
+	}
+	(void)fcntl(ready[0], F_SETFL, O_NONBLOCK);
+	(void)fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+
+	std::string listen_fds;
+	std::vector<sockfd_t> keep {ready[1]};
+	for (auto& socket : sockets)
+	{
+		listen_fds += std::to_string(socket->get_fd()) + ':' + socket->get_host() + ':' + std::to_string(socket->get_port()) + ';';
+		keep.push_back(socket->get_fd());
+	}
+	(void)setenv(LISTEN_FDS_ENV, listen_fds.c_str(), 1);
+	(void)setenv(UPGRADE_FD_ENV, std::to_string(ready[1]).c_str(), 1);
+	long max_fd = sysconf(_SC_OPEN_MAX);
+	std::sort(keep.begin(), keep.end());
+
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		// The connections, CGI pipes and files stay with this process
+		close_other_fds(keep, max_fd);
+		for (sockfd_t fd : keep)
+			(void)fcntl(fd, F_SETFD, 0);
+		// The server blocks SIGCHLD (see Reaper)
+		sigset_t mask;
+		sigemptyset(&mask);
+		(void)sigprocmask(SIG_SETMASK, &mask, NULL);
+		execvp(argv[0], argv);
+		_exit(EXIT_FAILURE);
+	}
+	(void)unsetenv(LISTEN_FDS_ENV);
+	(void)unsetenv(UPGRADE_FD_ENV);
+	close(ready[1]);
+	if (pid < 0)
+	{
+		std::cerr << "Upgrade failed: " << strerror(errno) << std::endl;
+		close(ready[0]);
+		return (-1);
+	}
+	std::cout << "Upgrading to " << argv[0] << " (pid " << pid << ')' << std::endl;
+	return (ready[0]);
+}
+
+// True once the new binary is listening. The pipe is closed when it's done: when the new binary
+// is listening, or when it exited before that (bad binary or config) and this one keeps running.
+static bool webserv_check_upgrade(sockfd_t& upgrade_fd)
+{
+	char byte;
+	ssize_t ret = read(upgrade_fd, &byte, 1);
+	if (ret < 0)
+		return (false);
+	close(upgrade_fd);
+	upgrade_fd = -1;
+	if (ret == 0)
+		std::cout << "Upgrade failed, the new binary exited, keeping this one" << std::endl;
+	return (ret > 0);
 }
 
 static void webserv_cleanup(std::vector<std::unique_ptr<Socket>>& sockets, pollable_map_t& fd_map)
@@ -106,12 +370,15 @@ static void webserv_cleanup(std::vector<std::unique_ptr<Socket>>& sockets, polla
 static void webserv_poll(pollable_map_t& fd_map)
 {
 	constexpr size_t POLL_TIMEOUT = 1000;
+	LoopProfile& profile = LoopProfile::get();
 	std::vector<struct pollfd> fds = get_descriptors(fd_map);
 
+	profile.start_poll();
 	int amount = poll(fds.data(), static_cast<nfds_t>(fds.size()), POLL_TIMEOUT);
 	// Only really happens on interrupt
 	if (amount < 0)
 		return ;
+	profile.end_poll(amount);
 
 	for (struct pollfd& pfd : fds)
 	{
@@ -120,16 +387,33 @@ static void webserv_poll(pollable_map_t& fd_map)
 		if (pfd.revents != 0)
 		{
 			// Notify the connection/socket/cgi that a new event needs to be handled
-			fd_map.at(pfd.fd)->notify(pfd.revents, fd_map, pfd.fd);
+			Pollable* pollable = fd_map.at(pfd.fd);
+			LoopProfile::Call call = profile.start_call(pollable, pfd.fd, pfd.revents, LoopProfile::NOTIFY);
+			pollable->notify(pfd.revents, fd_map, pfd.fd);
+			profile.end_call(call);
 		}
 		if (fd_map.find(pfd.fd) == fd_map.end())
 			continue ;
-		fd_map.at(pfd.fd)->on_post_poll(fd_map);
+		Pollable* pollable = fd_map.at(pfd.fd);
+		LoopProfile::Call call = profile.start_call(pollable, pfd.fd, 0, LoopProfile::POST_POLL);
+		pollable->on_post_poll(fd_map);
+		profile.end_call(call);
 	}
+
+	// Health probes of the upstreams, poll() returns at least once a second
+	Upstream::tick(fd_map);
+	profile.end_iteration();
 }
 
 // Static global for better exiting
 static bool s_run = true;
+// Set by SIGHUP, the configuration is reloaded between poll rounds
+static volatile sig_atomic_t s_reload = 0;
+// Set by SIGUSR1, the access log is opened again after it was rotated and the event loop
+// profile is written out
+static volatile sig_atomic_t s_reopen = 0;
+// Set by SIGUSR2, the binary is started again and this process drains its connections
+static volatile sig_atomic_t s_upgrade = 0;
 
 int main(int argc, char **argv)
 {
@@ -145,28 +429,72 @@ int main(int argc, char **argv)
 	// Overwriting SIGINT behaviour to close the program cleanly
 	(void)std::signal(SIGINT, [](int i) { (void)i; s_run = false; });
 
+	(void)std::signal(SIGHUP, [](int i) { (void)i; s_reload = 1; });
+
+	(void)std::signal(SIGUSR1, [](int i) { (void)i; s_reopen = 1; });
+
+	(void)std::signal(SIGUSR2, [](int i) { (void)i; s_upgrade = 1; });
+
 	// configure where to look for config
 	std::string config_path = DEFAULT_CONFIG_PATH;
-	if (argc > 1)
-		config_path = argv[1];
+	bool compile_config = (argc > 1 && std::string(argv[1]) == "--compile-config");
+	if (argc > 1 + compile_config)
+		config_path = argv[1 + compile_config];
+	if (compile_config)
+		return (webserv_compile_config(config_path));
 
 	try
 	{
-		std::vector<std::unique_ptr<Server>> servers;
 		std::vector<std::unique_ptr<Socket>> sockets;
+		std::vector<std::unique_ptr<Socket>> retired;
 		pollable_map_t fd_map;
-		webserv_parsing(config_path, servers, sockets, fd_map);
+		webserv_parsing(config_path, sockets, fd_map);
+		sockfd_t upgrade_fd = -1;
+		bool draining = false; // The new binary took over the sockets
 
 		while (s_run)
+		{
 			webserv_poll(fd_map);
+			if (s_reload)
+			{
+				s_reload = 0;
+				if (!draining && upgrade_fd < 0)
+					webserv_reload(config_path, sockets, retired, fd_map);
+			}
+			if (s_reopen)
+			{
+				s_reopen = 0;
+				AccessLog::reopen();
+				LoopProfile::get().dump();
+			}
+			if (s_upgrade)
+			{
+				s_upgrade = 0;
+				if (!draining && upgrade_fd < 0)
+					upgrade_fd = webserv_upgrade(argv, sockets);
+			}
+			if (upgrade_fd >= 0 && webserv_check_upgrade(upgrade_fd))
+			{
+				std::cout << "The new binary is listening, draining connections" << std::endl;
+				retire_sockets(sockets, retired, fd_map);
+				draining = true;
+			}
+			retired.erase(std::remove_if(retired.begin(), retired.end(),
+				[](std::unique_ptr<Socket> const& socket) { return (socket->get_connections() == 0); }),
+				retired.end());
+			if (draining && retired.empty())
+				s_run = false;
+		}
 
 		std::cout << "losing webserv^" << std::endl;
 		std::cout << "\n\n === PLEASE WAIT ===\n\n" << std::endl;
 		webserv_cleanup(sockets, fd_map);
+		AccessLog::close();
 	}
 	// catch and handle all exceptions during runtime
 	catch (std::exception& e)
 	{
+		AccessLog::close();
 		std::cerr << e.what() << std::endl;
 		std::cout << "Exception occured, goodbye!" << std::endl;
 		return (EXIT_FAILURE);
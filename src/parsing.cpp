@@ -1,9 +1,14 @@
 #include "parsing.h"
+#include "Address.h"
+#include "Handler.h"
+#include "Proxy.h"
+#include "Upstream.h"
 
 #include <algorithm>
 #include <cctype>
 #include <memory>
 #include <set>
+#include <unordered_map>
 
 namespace webserv {
 
@@ -12,7 +17,7 @@ static void	print_error(std::string const & message){
 }
 
 static bool check_directives_location_block(njson::Json::object& loc){
-	std::set<std::string>supported_directives({
+	static std::set<std::string> const supported_directives({
 		"client_body_size",
 		"error_pages",
 		"root",
@@ -21,8 +26,23 @@ static bool check_directives_location_block(njson::Json::object& loc){
 		"index",
 		"auto_index",
 		"redirect",
+		"proxy_pass",
+		"proxy_connections",
 		"CGI",
-		"upload_directory"});
+		"upload_directory",
+		"fastcgi",
+		"fastcgi_connections",
+		"cgi_splice",
+		"cgi_cache",
+		"cgi_cache_directory",
+		"cgi_cache_key_headers",
+		"cgi_max_concurrent",
+		"cgi_queue_size",
+		"cgi_timeout",
+		"cgi_spool_threshold",
+		"cgi_spool_directory",
+		"handler",
+		"metrics"});
 
 	njson::Json::object::iterator it;
 	for(it = loc.begin(); it != loc.end(); ++it){
@@ -35,7 +55,7 @@ static bool check_directives_location_block(njson::Json::object& loc){
 }
 
 static bool check_directives_server_block(njson::Json::object& serverblock){
-	std::set<std::string>supported_directives({
+	static std::set<std::string> const supported_directives({
 		"listen",
 		"host",
 		"server_names",
@@ -197,6 +217,10 @@ static bool set_server_variables(njson::Json::object& serverblock, Server* serve
 						print_error("error page key value needs to be all digits");
 						return false;
 					}
+					if(errit->first.size() != 3 || errit->first < "100" || errit->first > "599"){
+						print_error("error page key value needs to be a status code (100-599)");
+						return false;
+					}
 					try{
 						server->add_error_page(std::stoi(errit->first),errit->second->get<std::string>());
 					} catch (std::exception e){
@@ -264,11 +288,27 @@ static bool set_location_variables(std::string const & path, njson::Json::object
 		return false;
 	}
 	njson::Json::object::iterator it;
-	if (!(path.front() == '/' && path.back() == '/')){
+	//"= /path" is an exact location, "~ regex" and "~* regex" are regex locations
+	if (path.compare(0, 2, "= ") == 0){
+		loc.match = Location::EXACT;
+		loc.path = path.substr(2);
+		if (loc.path.empty() || loc.path.front() != '/'){
+			print_error("Exact location path needs to start with a /");
+			return false;
+		}
+	} else if (path.compare(0, 2, "~ ") == 0 || path.compare(0, 3, "~* ") == 0){
+		loc.match = (path[1] == '*') ? Location::REGEX_ICASE : Location::REGEX;
+		loc.path = path.substr(path.find(' ') + 1);
+		if (loc.path.empty()){
+			print_error("Regex location needs a regex");
+			return false;
+		}
+	} else if (!(path.front() == '/' && path.back() == '/')){
 		print_error("Location path needs to start and end with a /");
 		return false;
+	} else {
+		loc.path = path;
 	}
-	loc.path = path;
 
 	//root
 	//if not set it will default to the server root value 
@@ -324,6 +364,10 @@ static bool set_location_variables(std::string const & path, njson::Json::object
 						print_error("error page key value needs to be all digits");
 						return false;
 					}
+					if(errit->first.size() != 3 || errit->first < "100" || errit->first > "599"){
+						print_error("error page key value needs to be a status code (100-599)");
+						return false;
+					}
 					try{
 						loc.add_error_page(std::stoi(errit->first),errit->second->get<std::string>());
 					} catch (std::exception e){
@@ -417,6 +461,351 @@ static bool set_location_variables(std::string const & path, njson::Json::object
 			loc.upload_directory = it->second->get<std::string>();
 		}
 	}
+
+	//setting proxy_pass
+	it = locationblock.find("proxy_pass");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::STRING){
+			print_error("proxy_pass needs to be a string");
+			return false;
+		} else {
+			std::string address, uri;
+			if (!proxy::parse_url(it->second->get<std::string>(), address, uri) && Upstream::find(address) == nullptr){
+				print_error("proxy_pass needs to be \"http://host:port\" or \"http://upstream\" with an optional uri");
+				return false;
+			}
+			if (Upstream::find(address) == nullptr){
+				try {
+					(void)Address::resolve(address);
+				} catch (std::exception& e) {
+					print_error(std::string("proxy_pass: ") + e.what());
+					return false;
+				}
+			}
+			loc.proxy_pass = it->second->get<std::string>();
+		}
+	}
+
+	//setting proxy_connections
+	it = locationblock.find("proxy_connections");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::INT){
+			print_error("proxy_connections needs to be an integer");
+			return false;
+		} else {
+			int connections = it->second->get<int>();
+			if (connections < 0){
+				print_error("proxy_connections can't be negative");
+				return false;
+			}
+			loc.proxy_connections = connections;
+		}
+	}
+
+	//setting fastcgi
+	it = locationblock.find("fastcgi");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::STRING){
+			print_error("fastcgi needs to be a string");
+			return false;
+		} else {
+			std::string address = it->second->get<std::string>();
+			if (address.compare(0, 5, "unix:") != 0 && address.find(':') == std::string::npos
+				&& Upstream::find(address) == nullptr){
+				print_error("fastcgi needs to be \"unix:/path/to/socket\", \"host:port\" or the name of an upstream");
+				return false;
+			}
+			if (Upstream::find(address) == nullptr){
+				try {
+					(void)Address::resolve(address);
+				} catch (std::exception& e) {
+					print_error(std::string("fastcgi: ") + e.what());
+					return false;
+				}
+			}
+			loc.fastcgi = address;
+		}
+	}
+
+	//setting fastcgi_connections
+	it = locationblock.find("fastcgi_connections");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::INT){
+			print_error("fastcgi_connections needs to be an integer");
+			return false;
+		} else {
+			int connections = it->second->get<int>();
+			if (connections <= 0){
+				print_error("fastcgi_connections needs to be at least 1");
+				return false;
+			}
+			loc.fastcgi_connections = connections;
+		}
+	}
+
+	//setting cgi_splice
+	it = locationblock.find("cgi_splice");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::BOOL){
+			print_error("cgi_splice value needs to be a boolean");
+			return false;
+		} else {
+			loc.cgi_splice = it->second->get<bool>();
+		}
+	}
+
+	//setting metrics
+	it = locationblock.find("metrics");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::BOOL){
+			print_error("metrics value needs to be a boolean");
+			return false;
+		} else {
+			loc.metrics = it->second->get<bool>();
+		}
+	}
+
+	//setting cgi_cache
+	it = locationblock.find("cgi_cache");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::INT){
+			print_error("cgi_cache needs to be an integer");
+			return false;
+		} else {
+			int ttl = it->second->get<int>();
+			if (ttl < 0){
+				print_error("cgi_cache can't be negative");
+				return false;
+			}
+			loc.cgi_cache = ttl;
+		}
+	}
+
+	//setting cgi_cache_directory
+	it = locationblock.find("cgi_cache_directory");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::STRING){
+			print_error("cgi_cache_directory needs to be a string");
+			return false;
+		} else {
+			loc.cgi_cache_directory = it->second->get<std::string>();
+		}
+	}
+
+	//setting cgi_cache_key_headers
+	it = locationblock.find("cgi_cache_key_headers");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::ARRAY){
+			print_error("cgi_cache_key_headers needs to be set in an array");
+			return false;
+		} else {
+			njson::Json::array& headers = it->second->get<njson::Json::array>();
+			for(size_t i = 0; i < headers.size(); ++i){
+				if (headers[i]->get_type() != njson::Json::STRING){
+					print_error("cgi_cache_key_headers values needs to be a string");
+					return false;
+				}
+				std::string header = headers[i]->get<std::string>();
+				std::transform(header.begin(), header.end(), header.begin(), ::tolower);
+				loc.cgi_cache_key_headers.push_back(header);
+			}
+		}
+	}
+
+	//setting cgi_max_concurrent
+	it = locationblock.find("cgi_max_concurrent");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::INT){
+			print_error("cgi_max_concurrent needs to be an integer");
+			return false;
+		} else {
+			int max_concurrent = it->second->get<int>();
+			if (max_concurrent < 0){
+				print_error("cgi_max_concurrent can't be negative");
+				return false;
+			}
+			loc.cgi_max_concurrent = max_concurrent;
+		}
+	}
+
+	//setting cgi_queue_size
+	it = locationblock.find("cgi_queue_size");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::INT){
+			print_error("cgi_queue_size needs to be an integer");
+			return false;
+		} else {
+			int queue_size = it->second->get<int>();
+			if (queue_size < 0){
+				print_error("cgi_queue_size can't be negative");
+				return false;
+			}
+			loc.cgi_queue_size = queue_size;
+		}
+	}
+
+	//setting cgi_timeout
+	it = locationblock.find("cgi_timeout");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::INT){
+			print_error("cgi_timeout needs to be an integer");
+			return false;
+		} else {
+			int timeout = it->second->get<int>();
+			if (timeout < 0){
+				print_error("cgi_timeout can't be negative");
+				return false;
+			}
+			loc.cgi_timeout = timeout;
+		}
+	}
+
+	//setting cgi_spool_threshold
+	it = locationblock.find("cgi_spool_threshold");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::INT){
+			print_error("cgi_spool_threshold needs to be an integer");
+			return false;
+		} else {
+			int threshold = it->second->get<int>();
+			if (threshold < 0){
+				print_error("cgi_spool_threshold can't be negative");
+				return false;
+			}
+			loc.cgi_spool_threshold = threshold;
+		}
+	}
+
+	//setting cgi_spool_directory
+	it = locationblock.find("cgi_spool_directory");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::STRING){
+			print_error("cgi_spool_directory needs to be a string");
+			return false;
+		} else {
+			loc.cgi_spool_directory = it->second->get<std::string>();
+		}
+	}
+
+	//setting handler, the module is loaded right away so a broken one stops the server from starting
+	it = locationblock.find("handler");
+	if (it != locationblock.end()){
+		if (it->second->get_type() != njson::Json::STRING){
+			print_error("handler needs to be a string");
+			return false;
+		} else {
+			try {
+				(void)HandlerModule::get(it->second->get<std::string>());
+			} catch (std::exception& e) {
+				print_error(e.what());
+				return false;
+			}
+			loc.handler = it->second->get<std::string>();
+		}
+	}
+	return true;
+}
+
+static bool check_directives_upstream_block(njson::Json::object& upstreamblock){
+	static std::set<std::string> const supported_directives({
+		"servers",
+		"policy",
+		"max_fails",
+		"fail_timeout",
+		"health_interval",
+		"health_check"});
+
+	njson::Json::object::iterator it;
+	for(it = upstreamblock.begin(); it != upstreamblock.end(); ++it){
+		if(supported_directives.count(it->first) == 0){
+			std::cerr << "unknown directive '" << it->first << "' for upstream block" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool set_upstream_variables(njson::Json::object& upstreamblock, Upstream& upstream){
+
+	if (!check_directives_upstream_block(upstreamblock)){
+		return false;
+	}
+
+	//setting servers
+	njson::Json::object::iterator it = upstreamblock.find("servers");
+	if (it == upstreamblock.end() || it->second->get_type() != njson::Json::ARRAY){
+		print_error("upstream " + upstream.get_name() + " needs a servers array");
+		return false;
+	}
+	njson::Json::array& servers = it->second->get<njson::Json::array>();
+	for (auto& node : servers){
+		if (node->get_type() != njson::Json::STRING){
+			print_error("upstream servers need to be strings");
+			return false;
+		}
+		std::string address = node->get<std::string>();
+		if (address.compare(0, 5, "unix:") != 0 && (address.find(':') == std::string::npos
+			|| !is_all_digits(address.substr(address.find_last_of(':') + 1)))){
+			print_error("upstream servers need to be \"host:port\" or \"unix:/path/to/socket\"");
+			return false;
+		}
+		try {
+			upstream.add_member(address);
+		} catch (std::exception& e) {
+			print_error("upstream " + upstream.get_name() + ": " + e.what());
+			return false;
+		}
+	}
+	if (upstream.get_members().empty()){
+		print_error("upstream " + upstream.get_name() + " has no servers");
+		return false;
+	}
+
+	//setting policy
+	it = upstreamblock.find("policy");
+	if (it != upstreamblock.end()){
+		std::string policy = (it->second->get_type() == njson::Json::STRING) ? it->second->get<std::string>() : "";
+		if (policy == "round_robin")
+			upstream.policy = Upstream::ROUND_ROBIN;
+		else if (policy == "least_conn")
+			upstream.policy = Upstream::LEAST_CONN;
+		else if (policy == "hash_uri")
+			upstream.policy = Upstream::HASH_URI;
+		else if (policy == "hash_ip")
+			upstream.policy = Upstream::HASH_IP;
+		else {
+			print_error("policy needs to be round_robin, least_conn, hash_uri or hash_ip");
+			return false;
+		}
+	}
+
+	//setting max_fails, fail_timeout and health_interval
+	std::pair<char const*, size_t*> const numbers[] = {
+		{"max_fails", &upstream.max_fails},
+		{"fail_timeout", &upstream.fail_timeout},
+		{"health_interval", &upstream.health_interval}};
+	for (auto const& number : numbers){
+		it = upstreamblock.find(number.first);
+		if (it == upstreamblock.end())
+			continue ;
+		if (it->second->get_type() != njson::Json::INT || it->second->get<int>() < 0){
+			print_error(std::string(number.first) + " needs to be a positive integer");
+			return false;
+		}
+		*number.second = it->second->get<int>();
+	}
+
+	//setting health_check
+	it = upstreamblock.find("health_check");
+	if (it != upstreamblock.end()){
+		if (it->second->get_type() != njson::Json::STRING || it->second->get<std::string>().compare(0, 1, "/") != 0){
+			print_error("health_check needs to be a uri starting with a /");
+			return false;
+		}
+		upstream.health_check = it->second->get<std::string>();
+	}
+
+	upstream.build_ring();
 	return true;
 }
 
@@ -435,7 +824,10 @@ static bool process_locations(njson::Json::object& serverblock, Server* server){
 				if(!set_location_variables(loc_it->first, loc_it->second->get<njson::Json::object>(), loc)){
 					return false;
 				}
-				server->add_location(loc);
+				if(!server->add_location(loc)){
+					print_error("invalid regex in location '" + loc_it->first + "'");
+					return false;
+				}
 			}
 		}
 	}
@@ -462,9 +854,154 @@ Server* build_server(njson::Json::pointer& node)
 		delete server;
 		return nullptr;
 	}
+	server->compile();
 	return (server);
 }
 
+// "access_log": {"path": "/var/log/webserv/access.log", "format": "combined" or "json", "buffer_size": bytes}
+bool parse_access_log(njson::Json::pointer& root_node, Config& config)
+{
+	njson::Json::pointer& access_log_node = root_node->find("access_log");
+	if (!access_log_node)
+		return (true);
+	if (access_log_node->get_type() != njson::Json::OBJECT)
+	{
+		print_error("access_log needs to be set in key value pairs");
+		return (false);
+	}
+
+	njson::Json::object& access_log = access_log_node->get<njson::Json::object>();
+	static std::set<std::string> const supported_directives({"path", "format", "buffer_size"});
+	for (auto& pair : access_log)
+	{
+		if (supported_directives.count(pair.first) == 0)
+		{
+			std::cerr << "unknown directive '" << pair.first << "' for access_log" << std::endl;
+			return (false);
+		}
+	}
+
+	//setting path
+	njson::Json::object::iterator it = access_log.find("path");
+	if (it == access_log.end() || it->second->get_type() != njson::Json::STRING || it->second->get<std::string>().empty())
+	{
+		print_error("access_log needs a path");
+		return (false);
+	}
+	config.access_log = it->second->get<std::string>();
+
+	//setting format
+	it = access_log.find("format");
+	if (it != access_log.end())
+	{
+		std::string format = (it->second->get_type() == njson::Json::STRING) ? it->second->get<std::string>() : "";
+		if (format == "combined")
+			config.access_log_format = AccessLog::COMBINED;
+		else if (format == "json")
+			config.access_log_format = AccessLog::JSON;
+		else
+		{
+			print_error("access_log format needs to be combined or json");
+			return (false);
+		}
+	}
+
+	//setting buffer_size
+	it = access_log.find("buffer_size");
+	if (it != access_log.end())
+	{
+		if (it->second->get_type() != njson::Json::INT || it->second->get<int>() <= 0)
+		{
+			print_error("access_log buffer_size needs to be a positive integer");
+			return (false);
+		}
+		config.access_log_buffer_size = it->second->get<int>();
+	}
+	return (true);
+}
+
+// "request_timing": {"slow_threshold": milliseconds, "server_timing": true or false}
+bool parse_request_timing(njson::Json::pointer& root_node, Config& config)
+{
+	njson::Json::pointer& request_timing_node = root_node->find("request_timing");
+	if (!request_timing_node)
+		return (true);
+	if (request_timing_node->get_type() != njson::Json::OBJECT)
+	{
+		print_error("request_timing needs to be set in key value pairs");
+		return (false);
+	}
+
+	njson::Json::object& request_timing = request_timing_node->get<njson::Json::object>();
+	static std::set<std::string> const supported_directives({"slow_threshold", "server_timing"});
+	for (auto& pair : request_timing)
+	{
+		if (supported_directives.count(pair.first) == 0)
+		{
+			std::cerr << "unknown directive '" << pair.first << "' for request_timing" << std::endl;
+			return (false);
+		}
+	}
+
+	//setting slow_threshold
+	njson::Json::object::iterator it = request_timing.find("slow_threshold");
+	if (it != request_timing.end())
+	{
+		if (it->second->get_type() != njson::Json::INT || it->second->get<int>() < 0)
+		{
+			print_error("request_timing slow_threshold needs to be a positive integer");
+			return (false);
+		}
+		config.slow_request_threshold = it->second->get<int>();
+	}
+
+	//setting server_timing
+	it = request_timing.find("server_timing");
+	if (it != request_timing.end())
+	{
+		if (it->second->get_type() != njson::Json::BOOL)
+		{
+			print_error("request_timing server_timing needs to be a boolean");
+			return (false);
+		}
+		config.server_timing = it->second->get<bool>();
+	}
+	return (true);
+}
+
+// The upstreams have to be known before the locations that use them
+bool parse_upstreams(njson::Json::pointer& root_node)
+{
+	njson::Json::pointer& upstreams_node = root_node->find("upstreams");
+	if (!upstreams_node)
+		return (true);
+	if (upstreams_node->get_type() != njson::Json::OBJECT)
+	{
+		print_error("upstreams needs to be set in key value pairs");
+		return (false);
+	}
+
+	njson::Json::object& upstreams = upstreams_node->get<njson::Json::object>();
+	for (auto& pair : upstreams)
+	{
+		if (pair.first.empty() || pair.first.find_first_of(":/") != std::string::npos)
+		{
+			print_error("upstream name '" + pair.first + "' can't contain ':' or '/'");
+			return (false);
+		}
+		if (pair.second->get_type() != njson::Json::OBJECT)
+		{
+			print_error("upstream " + pair.first + " needs to be an object");
+			return (false);
+		}
+		std::unique_ptr<Upstream> upstream(new Upstream(pair.first));
+		if (!set_upstream_variables(pair.second->get<njson::Json::object>(), *upstream))
+			return (false);
+		Upstream::add(upstream.release());
+	}
+	return (true);
+}
+
 // allocates new servers
 std::vector<std::unique_ptr<Server>> parse_servers(njson::Json::pointer& root_node)
 {
@@ -489,30 +1026,44 @@ std::vector<std::unique_ptr<Server>> parse_servers(njson::Json::pointer& root_no
 	return (servers);
 }
 
-std::vector<std::unique_ptr<Socket>> build_sockets(std::vector<std::unique_ptr<Server>>& servers)
+// The sockets for the listen addresses of the config, with its servers. Sockets in previous that
+// listen on an address of the config are moved out of it and reused, so their connections stay.
+// Nothing is taken from previous when a new address can't be bound.
+std::vector<std::unique_ptr<Socket>> build_sockets(config_t const& config, std::vector<std::unique_ptr<Socket>>& previous)
 {
 	std::vector<std::unique_ptr<Socket>> sockets;
-	
-	std::set<std::string> hosts_to_listen;
-
-	for(size_t i = 0; i < servers.size(); ++i){
-		std::string server_key = servers[i]->host + ':' + std::to_string(servers[i]->port);
-		if(hosts_to_listen.count(server_key) == 0){
-			hosts_to_listen.insert(server_key);
-			Socket * sock_serv = new Socket(servers[i]->port, servers[i]->host);
-			sock_serv->add_server_ref(servers[i]);
-			sockets.emplace_back(sock_serv);
-		} else {
-			for(size_t j = 0; j < sockets.size(); ++j){
-				std::string socket_key = sockets[j]->get_host() + ':' + std::to_string(sockets[j]->get_port());
-				if(socket_key == server_key){
-					sockets[j]->add_server_ref(servers[i]);
-					break;
-				}
-			}
+	std::vector<std::vector<Server*>> socket_servers;
+	std::vector<size_t> reused;
+
+	std::unordered_map<std::string, size_t> previous_keys;
+	for(size_t i = 0; i < previous.size(); ++i){
+		previous_keys.emplace(previous[i]->get_host() + ':' + std::to_string(previous[i]->get_port()), i);
+	}
+
+	// "host:port" of the servers, by index in sockets
+	std::unordered_map<std::string, size_t> listen_keys;
+	for(auto& server : config->servers){
+		std::string server_key = server->host + ':' + std::to_string(server->port);
+		auto listen = listen_keys.find(server_key);
+		if(listen != listen_keys.end()){
+			socket_servers[listen->second].push_back(server.get());
+			continue;
+		}
+		listen_keys.emplace(server_key, sockets.size());
+		socket_servers.push_back({server.get()});
+
+		auto reuse = previous_keys.find(server_key);
+		reused.push_back(reuse == previous_keys.end() ? previous.size() : reuse->second);
+		sockets.emplace_back(reuse != previous_keys.end() ? nullptr : new Socket(server->port, server->host));
+	}
+
+	for(size_t i = 0; i < sockets.size(); ++i){
+		if(!sockets[i]){
+			sockets[i] = std::move(previous[reused[i]]);
 		}
+		sockets[i]->set_config(config, socket_servers[i]);
 	}
-	// sockets.emplace_back(new ShellSocket(6666));
+	previous.erase(std::remove(previous.begin(), previous.end(), nullptr), previous.end());
 	return (sockets);
 }
 